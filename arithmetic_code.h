@@ -23,9 +23,12 @@
 
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <iterator>
 #include <limits>
+#include <type_traits>
+#include <vector>
 
 
 template <typename FixedPoint = uint64_t, typename CompressedDigit = uint16_t, int MinRange = 0>
@@ -70,6 +73,34 @@ struct arithmetic_code {
   static_assert(min_range > 1, "min_range too small");
   static_assert(min_range < fixed_one/digit_base, "min_range too large");
 
+  // Pending overflow digits. Runs of more than a few are rare, so they are kept
+  // inline and only spill to the heap when that runs out.
+  class digit_buffer {
+   public:
+    size_t size() const { return size_; }
+    CompressedDigit& operator[](size_t i) {
+      return i < inline_capacity ? inline_digits[i] : spilled[i - inline_capacity];
+    }
+    void push_back(CompressedDigit digit) {
+      if (size_ < inline_capacity) {
+        inline_digits[size_] = digit;
+      } else {
+        spilled.push_back(digit);
+      }
+      size_++;
+    }
+    void clear() {
+      size_ = 0;
+      spilled.clear();
+    }
+
+   private:
+    static constexpr size_t inline_capacity = 16;
+    CompressedDigit inline_digits[inline_capacity];
+    std::vector<CompressedDigit> spilled;
+    size_t size_ = 0;
+  };
+
   // The encoder object takes an output iterator (e.g. to vector or ostream) to
   // emit compressed digits.
   // In addition to uncompressed data and compressed digits, the intermediate state is:
@@ -103,8 +134,26 @@ struct arithmetic_code {
      }
     // Symbol is int instead of bool because additional versions of `put()` could
     // accept more than two symbols, e.g. one could call `put(2, p1, p2, p3)`.
-    size_t put(int symbol, std::function<FixedPoint(FixedPoint)> probability_of_1) {
-      FixedPoint range_of_1 = probability_of_1(range);
+    // probability_of_1 maps the current range to the part of it assigned to 1.
+    // Lambdas bind to the template overload, so they are inlined rather than
+    // going through std::function.
+    template <typename ProbabilityFunction>
+    size_t put(int symbol, const ProbabilityFunction& probability_of_1) {
+      return put_range_of_1(symbol, probability_of_1(range));
+    }
+    size_t put(int symbol, const std::function<FixedPoint(FixedPoint)>& probability_of_1) {
+      return put_range_of_1(symbol, probability_of_1(range));
+    }
+
+    // Fixed-probability fast path: the probability of 1 is exactly 2^-shift.
+    size_t put_fixed(int symbol, int shift) {
+      return put_range_of_1(symbol, range >> shift);
+    }
+    size_t put_bypass(int symbol) {
+      return put_fixed(symbol, 1);
+    }
+
+    size_t put_range_of_1(int symbol, FixedPoint range_of_1) {
       FixedPoint range_of_0 = range - range_of_1;
       if (symbol != 0) {
         low += range_of_0;
@@ -152,7 +201,7 @@ struct arithmetic_code {
 
       // Check for a carry bit, and cascade from lowest overflow digit to highest.
       if (low >= fixed_one) {
-        for (int i = overflow.size()-1; i >= 0; i--) {
+        for (size_t i = overflow.size(); i-- > 0; ) {
           if (++overflow[i] != 0) break;
         }
         low -= fixed_one;
@@ -166,8 +215,8 @@ struct arithmetic_code {
         assert(range < most_significant_digit);
         overflow.push_back(digit);
       } else {
-        for (CompressedDigit overflow_digit : overflow) {
-          emit_digit(overflow_digit);
+        for (size_t i = 0; i < overflow.size(); i++) {
+          emit_digit(overflow[i]);
         }
         overflow.clear();
         emit_digit(digit);
@@ -197,7 +246,7 @@ struct arithmetic_code {
     // The range r, which starts as fixed-point 1.0.
     FixedPoint range;
     // High digits of x. If overflow.size() = s, then R = R_0 M^s (where R_0 = fixed_one).
-    std::vector<CompressedDigit> overflow;
+    digit_buffer overflow;
   };
 
   // The decoder object takes an input iterator (e.g. from vector or istream)
@@ -229,8 +278,23 @@ struct arithmetic_code {
       assert(range == initial_range);  // Should be true if we set digit_alignment correctly.
     }
 
-    int get(std::function<FixedPoint(FixedPoint)> probability_of_1) {
-      FixedPoint range_of_1 = probability_of_1(range);
+    // See encoder::put() for the overloads.
+    template <typename ProbabilityFunction>
+    int get(const ProbabilityFunction& probability_of_1) {
+      return get_range_of_1(probability_of_1(range));
+    }
+    int get(const std::function<FixedPoint(FixedPoint)>& probability_of_1) {
+      return get_range_of_1(probability_of_1(range));
+    }
+
+    int get_fixed(int shift) {
+      return get_range_of_1(range >> shift);
+    }
+    int get_bypass() {
+      return get_fixed(1);
+    }
+
+    int get_range_of_1(FixedPoint range_of_1) {
       FixedPoint range_of_0 = range - range_of_1;
       int symbol = (low >= range_of_0);
       if (symbol != 0) {
@@ -275,8 +339,18 @@ struct arithmetic_code {
     }
 
     // Consume a CompressedDigit as one or more InputDigits. Loop should be
-    // unrolled by the compiler.
+    // unrolled by the compiler. From a contiguous buffer of bytes, a whole
+    // digit is loaded at once while there is one left.
     CompressedDigit consume_digit_aligned() {
+      if constexpr (std::is_pointer<InputIterator>::value && sizeof(InputDigit) == 1
+                    && sizeof(*in) == 1 && sizeof(CompressedDigit) > 1) {
+        if (end - in >= std::ptrdiff_t(sizeof(CompressedDigit))) {
+          CompressedDigit digit;
+          memcpy(&digit, in, sizeof(digit));
+          in += sizeof(digit);
+          return big_endian(digit);
+        }
+      }
       CompressedDigit digit = 0;
       for (int i = sizeof(CompressedDigit)-sizeof(InputDigit); i >= 0; i -= sizeof(InputDigit)) {
         digit *= digit_base_for<InputDigit>();
@@ -287,6 +361,19 @@ struct arithmetic_code {
       return digit;
     }
 
+    static CompressedDigit big_endian(CompressedDigit digit) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      if constexpr (sizeof(digit) == 2) {
+        return __builtin_bswap16(digit);
+      } else if constexpr (sizeof(digit) == 4) {
+        return __builtin_bswap32(digit);
+      } else if constexpr (sizeof(digit) == 8) {
+        return __builtin_bswap64(digit);
+      }
+#endif
+      return digit;
+    }
+
     // Input digits are read from this iterator.
     InputIterator in, end;
     // The last digit read from the input - the lower bits are still to be used.
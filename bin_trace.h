@@ -0,0 +1,96 @@
+//
+// Traces of the bins coded by the recoder, for replaying them through the
+// arithmetic coders and estimators without ffmpeg (test/bin_trace_benchmark).
+//
+// A trace is the magic "AVRTRACE", then one record per bin in coding order:
+// a byte holding the symbol (bit 0) and CodingType (bits 1-7), followed by the
+// bin's estimator slot (see estimator_table.h) as a varint. Slots are
+// assigned in order of first use, so they are the same from run to run.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+struct bin_record {
+  uint32_t slot;
+  uint8_t symbol;
+  uint8_t coding_type;
+};
+
+constexpr char BIN_TRACE_MAGIC[8] = {'A','V','R','T','R','A','C','E'};
+
+class bin_trace_writer {
+ public:
+  explicit bin_trace_writer(const std::string& filename) : out(filename, std::ios::binary) {
+    if (!out) {
+      throw std::runtime_error("Failed to open bin trace: " + filename);
+    }
+    out.write(BIN_TRACE_MAGIC, sizeof(BIN_TRACE_MAGIC));
+    buffer.reserve(BUFFER_SIZE + 8);
+  }
+  ~bin_trace_writer() {
+    flush();
+  }
+
+  void put(int symbol, int coding_type, uint32_t slot) {
+    buffer.push_back(uint8_t((symbol & 1) | (coding_type << 1)));
+    while (slot >= 0x80) {
+      buffer.push_back(uint8_t(slot | 0x80));
+      slot >>= 7;
+    }
+    buffer.push_back(uint8_t(slot));
+    if (buffer.size() >= BUFFER_SIZE) {
+      flush();
+    }
+  }
+
+  void flush() {
+    out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+    buffer.clear();
+  }
+
+ private:
+  static constexpr size_t BUFFER_SIZE = 1 << 20;
+  std::ofstream out;
+  std::vector<uint8_t> buffer;
+};
+
+inline std::vector<bin_record> read_bin_trace(const std::string& filename) {
+  std::ifstream in(filename, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("Failed to open bin trace: " + filename);
+  }
+  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  if (bytes.size() < sizeof(BIN_TRACE_MAGIC)
+      || memcmp(bytes.data(), BIN_TRACE_MAGIC, sizeof(BIN_TRACE_MAGIC)) != 0) {
+    throw std::runtime_error("Not a bin trace: " + filename);
+  }
+  std::vector<bin_record> bins;
+  for (size_t i = sizeof(BIN_TRACE_MAGIC); i < bytes.size(); ) {
+    bin_record bin;
+    bin.symbol = bytes[i] & 1;
+    bin.coding_type = bytes[i] >> 1;
+    bin.slot = 0;
+    i++;
+    for (int shift = 0; ; shift += 7) {
+      if (i >= bytes.size() || shift > 28) {
+        throw std::runtime_error("Truncated bin trace: " + filename);
+      }
+      uint8_t byte = bytes[i++];
+      bin.slot |= uint32_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        break;
+      }
+    }
+    bins.push_back(bin);
+  }
+  return bins;
+}
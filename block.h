@@ -1,12 +1,28 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+// Coefficients tracked per macroblock, indexed by scan8_index * 16 + zigzag
+// index (an 8x8 block spans four scan8 entries).
+#define BLOCK_COEFFICIENTS ((3 * (16 + 1)) * 16)
+
+// By default only the significance of each coefficient is tracked, as a
+// bitmask next to num_nonzeros in BlockMeta, so neighbor lookups touch one
+// or two cache lines. Define FULL_RESIDUAL_LAYOUT to keep a value per
+// coefficient in Block instead, for modelling coefficient values.
 struct Block {
-    uint16_t residual[(3 * (16 + 1)) * 16];
+#ifdef FULL_RESIDUAL_LAYOUT
+    uint16_t residual[BLOCK_COEFFICIENTS];
+#endif
     int16_t mv_x[4][4];
     int16_t mv_y[4][4];
 };
 struct BlockMeta{
+    bool coded;
+    bool is_8x8;
+    uint8_t num_nonzeros[(3 * (16 + 1))];
+#ifndef FULL_RESIDUAL_LAYOUT
+    uint64_t significance[(BLOCK_COEFFICIENTS + 63) / 64];
+#endif
     int32_t rem_pred_mode[16];
     int32_t prev_pred_mode[16];
     uint8_t sub_mb_type[4];
@@ -17,9 +33,5 @@ struct BlockMeta{
     uint8_t chromai8x8mode;
     uint8_t last_mb_qp;
     uint8_t luma_qp;
-    bool is_8x8;
-    bool coded;
-    uint8_t num_nonzeros[(3 * (16 + 1))];
 };
 #endif
-
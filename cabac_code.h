@@ -50,7 +50,7 @@ struct cabac {
 
     // Simple implementation: put_bypass assumes a symbol probability of exactly 1/2.
     size_t put_bypass(int symbol) {
-      return e.put(symbol, [](fixed_point range) { return range/2; });
+      return e.put_bypass(symbol);
     }
 
     // The end of stream symbol is always assumed to have probability ~2/256.
@@ -81,6 +81,180 @@ struct cabac {
     cabac_arithmetic_code::encoder<OutputIterator, uint8_t> e;
   };
 
+  // Bit-exact with encoder, in the H.264 spec's own formulation: a 9-bit
+  // range, renormalized by a table lookup, and low bits shifted out a byte at
+  // a time with carries resolved through the pending 0xFF bytes. Runs of
+  // bypass bins are coded up to 8 at once.
+  template <typename OutputIterator>
+  class fast_encoder {
+   public:
+    explicit fast_encoder(OutputIterator out) : out(out) {}
+    ~fast_encoder() {
+      if (!finished) {
+        finish();
+      }
+    }
+
+    size_t put(int symbol, uint8_t* state) {
+      size_t emitted_before = bytes_emitted;
+      int range_of_lps = ff_h264_lps_range[2 * (range & 0xC0) + *state];
+      range -= range_of_lps;
+      if (symbol != ((*state) & 1)) {
+        low += range;
+        range = range_of_lps;
+        *state = ff_h264_mlps_state[127 - *state];
+      } else {
+        *state = ff_h264_mlps_state[128 + *state];
+      }
+      renormalize();
+      return bytes_emitted - emitted_before;
+    }
+
+    size_t put_bypass(int symbol) {
+      size_t emitted_before = bytes_emitted;
+      low <<= 1;
+      low += -uint32_t(symbol & 1) & range;
+      queue += 1;
+      shift_out_byte();
+      return bytes_emitted - emitted_before;
+    }
+
+    // Code the low `count` bits of `symbols` as bypass bins, most significant first.
+    size_t put_bypass_bins(uint32_t symbols, int count) {
+      size_t emitted_before = bytes_emitted;
+      while (count > 0) {
+        int n = count < 8 ? count : 8;
+        count -= n;
+        low <<= n;
+        low += ((symbols >> count) & ((1u << n) - 1)) * range;
+        queue += n;
+        shift_out_byte();
+      }
+      return bytes_emitted - emitted_before;
+    }
+
+    size_t put_terminate(int end_of_stream_symbol) {
+      size_t emitted_before = bytes_emitted;
+      range -= 2;
+      if (end_of_stream_symbol) {
+        low += range;
+        range = 2 << 7;
+        low <<= 7;
+        queue += 7;
+        shift_out_byte();
+        finish();
+      } else {
+        renormalize();
+      }
+      return bytes_emitted - emitted_before;
+    }
+
+    // The same code value as encoder::finish: within [low, low + range),
+    // the value ending in the highest possible stop bit, up to the byte
+    // holding that bit.
+    void finish() {
+      int stop = 0;
+      while ((2u << stop) < range) {
+        stop++;
+      }
+      for (; stop > 0; stop--) {
+        uint32_t x = (low | (1u << stop)) & ~((1u << stop) - 1);
+        if (low <= x && x < low + range) {
+          break;
+        }
+      }
+      low = (low | (1u << stop)) & ~((1u << stop) - 1);
+      // Bit position of the stop bit in the output, counting from 1.
+      size_t stop_position = 8 * bytes_determined() + queue + 18 - stop;
+      size_t total_bytes = (stop_position + 7) / 8;
+      while (bytes_determined() < total_bytes) {
+        low <<= -queue;
+        queue = 0;
+        shift_out_byte();
+      }
+      flush_pending();
+      finished = true;
+    }
+
+   private:
+    void renormalize() {
+      int shift = renormalize_shift[range >> 3];
+      range <<= shift;
+      low <<= shift;
+      queue += shift;
+      shift_out_byte();
+    }
+
+    // Once a whole byte is above the 10 bits of low, move it out.
+    void shift_out_byte() {
+      if (queue >= 0) {
+        uint32_t byte = low >> (queue + 10);
+        low &= (0x400u << queue) - 1;
+        queue -= 8;
+        put_byte(byte);
+      }
+    }
+
+    // byte may carry (0x100) into the output so far. A run of 0xFF bytes is
+    // held back until it is known whether a carry turns it into zeros.
+    void put_byte(uint32_t byte) {
+      if (byte == 0xFF) {
+        pending_ff++;
+        return;
+      }
+      uint8_t carry = byte >> 8;
+      if (has_cached) {
+        emit(cached + carry);
+      } else {
+        assert(carry == 0);
+      }
+      for (; pending_ff > 0; pending_ff--) {
+        emit(0xFF + carry);
+      }
+      cached = uint8_t(byte);
+      has_cached = true;
+    }
+
+    void flush_pending() {
+      if (has_cached) {
+        emit(cached);
+        has_cached = false;
+      }
+      for (; pending_ff > 0; pending_ff--) {
+        emit(0xFF);
+      }
+    }
+
+    void emit(uint8_t byte) {
+      *out++ = byte;
+      bytes_emitted++;
+    }
+
+    size_t bytes_determined() const {
+      return bytes_emitted + has_cached + pending_ff;
+    }
+
+    // Left shift that brings a range of at least 6 (the smallest LPS range)
+    // back to [0x100, 0x200), indexed by range >> 3.
+    static constexpr uint8_t renormalize_shift[64] = {
+      6, 5, 4, 4, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    };
+
+    OutputIterator out;
+    size_t bytes_emitted = 0;
+    // The spec's codILow, with `queue` more bits below the next output byte.
+    uint32_t low = 0;
+    uint32_t range = 0x1FE;
+    int queue = -9;
+    uint8_t cached = 0;
+    bool has_cached = false;
+    size_t pending_ff = 0;
+    bool finished = false;
+  };
+
   class decoder {
   };
 };
@@ -0,0 +1,231 @@
+//
+// Warm-start priors for the estimators: the initial state of each estimator
+// slot, trained on a corpus (`recode train-prior`), so that short files don't
+// code most of their bins before the model has learned anything.
+//
+// A prior file is mapped read-only and used in place: loading costs nothing
+// up front, and processes using the same prior share its pages. Layout:
+//   prior_header
+//   State fixed[fixed_slots]        by slot, see estimator_table.h
+//   prior_entry<State> buckets[]    dynamic keys, open-addressed by prior_hash()
+// Dynamic keys are stored by context id rather than by context pointer,
+// since the pointers differ from run to run (see h264_model::context_id).
+// The header's hash covers everything after the header; files record it in
+// Recoded::Metadata::prior_hash.
+//
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "estimator_table.h"
+
+
+constexpr char PRIOR_MAGIC[8] = {'A','V','R','P','R','I','O','R'};
+constexpr uint32_t PRIOR_VERSION = 1;
+
+struct prior_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t estimator;    // Estimator::ID
+  uint32_t state_size;   // sizeof(Estimator::state)
+  uint32_t fixed_slots;  // estimator_slots::DYNAMIC_BASE
+  uint32_t buckets;      // Power of 2.
+  uint32_t reserved;
+  uint64_t hash;
+};
+
+template <typename State>
+struct prior_entry {
+  int32_t context_id;  // -1: empty bucket.
+  int32_t param1;
+  int32_t param2;
+  State state;
+};
+
+// A dynamic key that can be stored in a prior.
+struct prior_key {
+  int context_id, param1, param2;
+  bool operator<(const prior_key& other) const {
+    return std::tie(context_id, param1, param2) < std::tie(other.context_id, other.param1, other.param2);
+  }
+};
+
+// Counts of zeros and ones coded for each key over a corpus, that a prior is
+// trained on.
+typedef std::array<uint64_t, 2> symbol_counts;
+struct prior_counts {
+  std::vector<symbol_counts> fixed = std::vector<symbol_counts>(estimator_slots::DYNAMIC_BASE);
+  std::map<prior_key, symbol_counts> dynamic;
+};
+
+inline uint64_t prior_hash(int context_id, int param1, int param2) {
+  uint64_t h = uint32_t(context_id);
+  h = (h ^ uint32_t(param1)) * 0x9E3779B97F4A7C15ull;
+  h = (h ^ uint32_t(param2)) * 0xC2B2AE3D27D4EB4Full;
+  return h ^ (h >> 29);
+}
+
+// FNV-1a, the prior's content hash.
+inline uint64_t prior_content_hash(const uint8_t *data, size_t size) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < size; i++) {
+    h = (h ^ data[i]) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+template <typename Estimator>
+class estimator_prior {
+ public:
+  typedef typename Estimator::state state;
+  static_assert(std::is_trivially_copyable<state>::value, "prior states are stored as bytes");
+
+  explicit estimator_prior(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0) close(fd);
+      throw std::invalid_argument("Failed to open prior: " + filename);
+    }
+    size = st.st_size;
+    void *mapping = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      throw std::invalid_argument("Failed to map prior: " + filename);
+    }
+    bytes = static_cast<const uint8_t*>(mapping);
+    if (size < sizeof(prior_header) || memcmp(header().magic, PRIOR_MAGIC, sizeof(PRIOR_MAGIC)) != 0) {
+      unmap();
+      throw std::runtime_error("Not a prior: " + filename);
+    }
+    const prior_header& h = header();
+    if (h.version != PRIOR_VERSION || h.estimator != Estimator::ID || h.state_size != sizeof(state) ||
+        h.fixed_slots != estimator_slots::DYNAMIC_BASE || h.buckets == 0 || (h.buckets & (h.buckets - 1)) ||
+        size != file_size(h.buckets)) {
+      unmap();
+      throw std::runtime_error("Prior doesn't match this build's estimator: " + filename);
+    }
+  }
+  estimator_prior(const estimator_prior&) = delete;
+  estimator_prior& operator=(const estimator_prior&) = delete;
+  ~estimator_prior() {
+    unmap();
+  }
+
+  uint64_t hash() const {
+    return header().hash;
+  }
+  // Initial states of the fixed slots, [0, DYNAMIC_BASE).
+  const state *fixed_states() const {
+    return reinterpret_cast<const state*>(bytes + sizeof(prior_header));
+  }
+  // Initial state of a dynamic key, or a new estimator's if the prior
+  // doesn't have it (or context_id is -1).
+  state dynamic_state(int context_id, int param1, int param2) const {
+    if (context_id < 0) {
+      return state();
+    }
+    size_t mask = header().buckets - 1;
+    for (size_t i = prior_hash(context_id, param1, param2) & mask; ; i = (i + 1) & mask) {
+      const prior_entry<state>& entry = buckets()[i];
+      if (entry.context_id < 0) {
+        return state();
+      }
+      if (entry.context_id == context_id && entry.param1 == param1 && entry.param2 == param2) {
+        return entry.state;
+      }
+    }
+  }
+
+  // Writes the prior trained on counts. Returns its hash.
+  static uint64_t write(const std::string& filename, const prior_counts& counts) {
+    std::vector<state> fixed;
+    for (const symbol_counts& c : counts.fixed) {
+      fixed.push_back(Estimator::prior_state(c[1], c[0]));
+    }
+    std::map<prior_key, state> dynamic;
+    for (const auto& key_counts : counts.dynamic) {
+      dynamic[key_counts.first] = Estimator::prior_state(key_counts.second[1], key_counts.second[0]);
+    }
+    return write(filename, fixed, dynamic);
+  }
+
+  // Writes a prior with the given fixed states (DYNAMIC_BASE of them) and
+  // dynamic keys. Returns its hash.
+  static uint64_t write(const std::string& filename, const std::vector<state>& fixed,
+                        const std::map<prior_key, state>& dynamic) {
+    if (fixed.size() != estimator_slots::DYNAMIC_BASE) {
+      throw std::invalid_argument("Prior needs a state for every fixed slot.");
+    }
+    uint32_t buckets = 16;
+    while (buckets < 2 * dynamic.size()) buckets *= 2;
+    std::vector<uint8_t> out(file_size(buckets));
+    memcpy(out.data() + sizeof(prior_header), fixed.data(), fixed.size() * sizeof(state));
+    prior_entry<state> *table = reinterpret_cast<prior_entry<state>*>(out.data() + buckets_offset());
+    for (uint32_t i = 0; i < buckets; i++) {
+      table[i] = {-1, 0, 0, state()};
+    }
+    for (const auto& key_state : dynamic) {
+      const prior_key& key = key_state.first;
+      size_t i = prior_hash(key.context_id, key.param1, key.param2) & (buckets - 1);
+      while (table[i].context_id >= 0) i = (i + 1) & (buckets - 1);
+      table[i] = {key.context_id, key.param1, key.param2, key_state.second};
+    }
+    prior_header h = {};
+    memcpy(h.magic, PRIOR_MAGIC, sizeof(PRIOR_MAGIC));
+    h.version = PRIOR_VERSION;
+    h.estimator = Estimator::ID;
+    h.state_size = sizeof(state);
+    h.fixed_slots = estimator_slots::DYNAMIC_BASE;
+    h.buckets = buckets;
+    h.hash = prior_content_hash(out.data() + sizeof(prior_header), out.size() - sizeof(prior_header));
+    memcpy(out.data(), &h, sizeof(h));
+
+    std::ofstream file(filename, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(out.data()), out.size());
+    if (!file) {
+      throw std::runtime_error("Failed to write prior: " + filename);
+    }
+    return h.hash;
+  }
+
+ private:
+  static size_t buckets_offset() {
+    size_t offset = sizeof(prior_header) + estimator_slots::DYNAMIC_BASE * sizeof(state);
+    size_t align = alignof(prior_entry<state>);
+    return (offset + align - 1) / align * align;
+  }
+  static size_t file_size(uint32_t buckets) {
+    return buckets_offset() + size_t(buckets) * sizeof(prior_entry<state>);
+  }
+  const prior_header& header() const {
+    return *reinterpret_cast<const prior_header*>(bytes);
+  }
+  const prior_entry<state> *buckets() const {
+    return reinterpret_cast<const prior_entry<state>*>(bytes + buckets_offset());
+  }
+  void unmap() {
+    if (bytes) {
+      munmap(const_cast<uint8_t*>(bytes), size);
+      bytes = nullptr;
+    }
+  }
+
+  const uint8_t *bytes = nullptr;
+  size_t size = 0;
+};
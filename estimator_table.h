@@ -0,0 +1,206 @@
+//
+// Dense storage for the adaptive bit estimators used by h264_model.
+//
+// Every coded bin looks up an estimator by its model key (context pointer plus
+// two integer parameters). Rather than searching an ordered map on each
+// lookup, each key is mapped once to a dense integer slot, and the estimators
+// live in a flat, cache-aligned array indexed by that slot:
+//   [0, CABAC_STATE_SLOTS)        CABAC states, by offset into the slice's state array
+//   BYPASS_SLOT, TERMINATE_SLOT   bypass and end-of-slice bins
+//   EOB_SLOT + {0,1}              significance end-of-block bins
+//   [DYNAMIC_BASE, ...)           everything else, assigned on first use
+// Keys in the last range have a sparse parameter space (e.g. the significance
+// map context), so they are assigned slots through an open-addressed index.
+// The table can be capped at a number of slots (to stay within a memory
+// budget): past it, new keys share the slots of the existing ones.
+// The table holds the state of whichever estimator policy the model uses
+// (estimators.h).
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "estimators.h"
+#include "memory_budget.h"
+
+
+// A model key along with the estimator slot it resolves to. Callers compute
+// the key once per bin and pass it to both the coder and the updater.
+struct model_key {
+  const void *context;
+  int param1;
+  int param2;
+  uint32_t slot;
+};
+
+template <typename T, size_t Alignment = 64>
+struct cache_aligned_allocator {
+  typedef T value_type;
+  template <typename U> struct rebind { typedef cache_aligned_allocator<U, Alignment> other; };
+
+  cache_aligned_allocator() = default;
+  template <typename U>
+  cache_aligned_allocator(const cache_aligned_allocator<U, Alignment>&) {}
+
+  T* allocate(size_t n) {
+    void *p = nullptr;
+    if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0) throw std::bad_alloc();
+    return static_cast<T*>(p);
+  }
+  void deallocate(T* p, size_t) { free(p); }
+
+  template <typename U>
+  bool operator==(const cache_aligned_allocator<U, Alignment>&) const { return true; }
+  template <typename U>
+  bool operator!=(const cache_aligned_allocator<U, Alignment>&) const { return false; }
+};
+
+struct estimator_slots {
+  static constexpr uint32_t CABAC_STATE_SLOTS = 1024;  // sizeof(H264SliceContext::cabac_state)
+  static constexpr uint32_t BYPASS_SLOT = CABAC_STATE_SLOTS;
+  static constexpr uint32_t TERMINATE_SLOT = BYPASS_SLOT + 1;
+  static constexpr uint32_t EOB_SLOT = TERMINATE_SLOT + 1;
+  static constexpr uint32_t DYNAMIC_BASE = EOB_SLOT + 2;
+};
+
+template <typename State>
+class basic_estimator_table : public estimator_slots {
+ public:
+  basic_estimator_table() : estimators(DYNAMIC_BASE), index(INITIAL_INDEX_SIZE) {
+    account_memory();
+  }
+
+  State& operator[](uint32_t slot) { return estimators[slot]; }
+  const State& operator[](uint32_t slot) const { return estimators[slot]; }
+  size_t size() const { return estimators.size(); }
+
+  // Back to a new table's state, keeping the allocations. Slots are assigned
+  // in order of first use, so they come out the same as in a new table.
+  void clear() {
+    estimators.resize(DYNAMIC_BASE);
+    if (initial_states) {
+      std::copy(initial_states, initial_states + DYNAMIC_BASE, estimators.begin());
+    } else {
+      std::fill(estimators.begin(), estimators.end(), State());
+    }
+    std::fill(index.begin(), index.end(), index_entry());
+    index_used = 0;
+    limit = 0;
+  }
+
+  // As clear(), also giving back the memory of the dynamic slots.
+  void release() {
+    clear();
+    estimators.shrink_to_fit();
+    std::vector<index_entry>(INITIAL_INDEX_SIZE).swap(index);
+    account_memory();
+  }
+
+  // Stop allocating slots once there are this many (0: no limit, as after
+  // clear()). It is at least one past the fixed slots, so keys past it have
+  // a dynamic slot to share.
+  void set_slot_limit(size_t slots) {
+    limit = slots ? std::max<size_t>(slots, DYNAMIC_BASE + 1) : 0;
+  }
+  size_t slot_limit() const {
+    return limit;
+  }
+
+  // Start the fixed slots from these DYNAMIC_BASE states (e.g. a prior's)
+  // instead of new estimators, from now on. Clears the table.
+  void set_initial_states(const State *states) {
+    initial_states = states;
+    clear();
+  }
+
+  // Slot for a key outside the fixed ranges, allocating one on first use.
+  uint32_t dynamic_slot(const void *context, int param1, int param2) {
+    return dynamic_slot(context, param1, param2, []() { return State(); });
+  }
+  // As above, with the state of a new slot from initial_state().
+  template <typename InitialState>
+  uint32_t dynamic_slot(const void *context, int param1, int param2, const InitialState& initial_state) {
+    size_t mask = index.size() - 1;
+    for (size_t i = hash(context, param1, param2) & mask; ; i = (i + 1) & mask) {
+      index_entry &entry = index[i];
+      if (entry.context == nullptr) {
+        if (limit && estimators.size() >= limit) {
+          // Shared with an existing key, but the same one every time.
+          return uint32_t(DYNAMIC_BASE + hash(context, param1, param2) % (estimators.size() - DYNAMIC_BASE));
+        }
+        entry = {context, param1, param2, uint32_t(estimators.size())};
+        size_t capacity = estimators.capacity();
+        estimators.push_back(initial_state());
+        if (estimators.capacity() != capacity) {
+          account_memory();
+        }
+        if (++index_used * 2 > index.size()) {
+          uint32_t slot = entry.slot;
+          grow_index();
+          account_memory();
+          return slot;
+        }
+        return entry.slot;
+      }
+      if (entry.context == context && entry.param1 == param1 && entry.param2 == param2) {
+        return entry.slot;
+      }
+    }
+  }
+
+  // Calls f(context, param1, param2, slot) for each dynamic key.
+  template <typename Function>
+  void for_each_dynamic_key(const Function& f) const {
+    for (const index_entry &entry : index) {
+      if (entry.context != nullptr) {
+        f(entry.context, entry.param1, entry.param2, entry.slot);
+      }
+    }
+  }
+
+ private:
+  static constexpr size_t INITIAL_INDEX_SIZE = 1 << 12;
+
+  struct index_entry {
+    const void *context = nullptr;
+    int param1 = 0, param2 = 0;
+    uint32_t slot = 0;
+  };
+
+  static size_t hash(const void *context, int param1, int param2) {
+    uint64_t h = reinterpret_cast<uintptr_t>(context);
+    h = (h ^ uint32_t(param1)) * 0x9E3779B97F4A7C15ull;
+    h = (h ^ uint32_t(param2)) * 0xC2B2AE3D27D4EB4Full;
+    return size_t(h ^ (h >> 29));
+  }
+
+  void grow_index() {
+    std::vector<index_entry> old(index.size() * 2);
+    old.swap(index);
+    size_t mask = index.size() - 1;
+    for (const index_entry &entry : old) {
+      if (entry.context == nullptr) continue;
+      size_t i = hash(entry.context, entry.param1, entry.param2) & mask;
+      while (index[i].context != nullptr) i = (i + 1) & mask;
+      index[i] = entry;
+    }
+  }
+
+  void account_memory() {
+    footprint.set(estimators.capacity() * sizeof(State) + index.capacity() * sizeof(index_entry));
+  }
+
+  std::vector<State, cache_aligned_allocator<State>> estimators;
+  std::vector<index_entry> index;
+  size_t index_used = 0;
+  size_t limit = 0;
+  const State *initial_states = nullptr;
+  memory::account footprint{memory::ESTIMATORS};
+};
+
+typedef basic_estimator_table<estimator> estimator_table;
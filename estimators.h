@@ -0,0 +1,142 @@
+//
+// The adaptive bit estimators of h264_model, selected at compile time through
+// its Estimator template parameter (AVRECODE_ESTIMATOR in recode.cpp).
+//
+// An estimator policy provides:
+//   state                                 per-slot storage in the estimator table
+//   ID                                    Metadata::estimator of the files it codes
+//   probability(range, state)             the part of range assigned to 1, in (0, range)
+//   update(state, symbol, fast)           adapt after coding symbol; fast adapts
+//                                         quicker (the significance map)
+//   prior_state(ones, zeros)              a slot's initial state in a prior
+//                                         trained on these symbol counts
+// Policies with the same ID must compute the same probabilities, since the
+// decompressor has to reproduce them exactly.
+//
+
+#pragma once
+
+#include <cstdint>
+
+
+// Counts of each symbol, halved when their total passes a limit. The original
+// estimator: probability is (range / total) * pos, with a division per bin.
+struct estimator { int pos = 1, neg = 1; };
+
+struct count_estimator {
+  typedef estimator state;
+  static constexpr uint32_t ID = 0;
+  static constexpr int LIMIT = 0x60;
+  static constexpr int FAST_LIMIT = 0x50;
+  // A prior's counts add up to this, so a file's own bins soon outweigh it.
+  static constexpr int PRIOR_WEIGHT = 0x20;
+
+  template <typename Range>
+  static Range probability(Range range, const state& e) {
+    return (range / (e.pos + e.neg)) * e.pos;
+  }
+  static void update(state& e, int symbol, bool fast) {
+    if (symbol) {
+      e.pos++;
+    } else {
+      e.neg++;
+    }
+    if (e.pos + e.neg > (fast ? FAST_LIMIT : LIMIT)) {
+      e.pos = (e.pos + 1) / 2;
+      e.neg = (e.neg + 1) / 2;
+    }
+  }
+  static state prior_state(uint64_t ones, uint64_t zeros) {
+    state e;
+    if (ones + zeros) {
+      e.pos = 1 + int((ones * (PRIOR_WEIGHT - 2) + (ones + zeros) / 2) / (ones + zeros));
+      e.neg = PRIOR_WEIGHT - e.pos;
+    }
+    return e;
+  }
+};
+
+// Reciprocals for dividing 64-bit numbers by small totals without a division:
+// x / d is (high + ((x - high) >> 1)) >> shift, with high the upper half of
+// x * multiplier (the round-up method of Granlund and Montgomery).
+struct reciprocal_table {
+  static constexpr int MAX_DIVISOR = 0x100;
+  struct reciprocal {
+    uint64_t multiplier;
+    int shift;
+  };
+  reciprocal entries[MAX_DIVISOR + 1] = {};
+
+  constexpr reciprocal_table() {
+    for (int d = 2; d <= MAX_DIVISOR; d++) {
+      int log2_ceil = 0;
+      while ((1 << log2_ceil) < d) log2_ceil++;
+      // floor(2^64 * (2^log2_ceil - d) / d) + 1
+      unsigned __int128 numerator = (unsigned __int128)((1ull << log2_ceil) - d) << 64;
+      entries[d] = {uint64_t(numerator / d) + 1, log2_ceil - 1};
+    }
+  }
+
+  // x / d for 2 <= d <= MAX_DIVISOR.
+  uint64_t divide(uint64_t x, int d) const {
+    const reciprocal& r = entries[d];
+    uint64_t high = uint64_t(((unsigned __int128)x * r.multiplier) >> 64);
+    return (high + ((x - high) >> 1)) >> r.shift;
+  }
+};
+inline constexpr reciprocal_table total_reciprocals{};
+
+// The count estimator with the division replaced by a multiply by the
+// reciprocal of total. The quotient is exact, so this codes exactly the same
+// files as count_estimator.
+struct reciprocal_count_estimator : count_estimator {
+  static constexpr uint32_t ID = count_estimator::ID;
+  static_assert(LIMIT <= reciprocal_table::MAX_DIVISOR && FAST_LIMIT <= reciprocal_table::MAX_DIVISOR,
+                "totals past the reciprocal table");
+
+  template <typename Range>
+  static Range probability(Range range, const state& e) {
+    static_assert(sizeof(Range) <= sizeof(uint64_t), "range wider than the reciprocals");
+    return Range(total_reciprocals.divide(range, e.pos + e.neg)) * e.pos;
+  }
+};
+
+// A 16-bit probability of 1, moved toward each coded symbol by a fraction
+// 2^-rate of the distance. The rate starts at 1 and grows with the number of
+// bins coded up to a maximum, so new contexts adapt fast and settle into
+// roughly the window of the counts. No division or comparison with a limit;
+// its files are not decodable with the count estimators (Metadata::estimator 1).
+struct shift_estimator {
+  struct state {
+    uint16_t p1 = 0x8000;
+    uint8_t rate = 1;
+  };
+  static constexpr uint32_t ID = 1;
+  static constexpr int MAX_RATE = 6;
+  static constexpr int FAST_MAX_RATE = 5;
+  // A prior's slots start part way up the rate ramp.
+  static constexpr int PRIOR_RATE = 4;
+
+  template <typename Range>
+  static Range probability(Range range, const state& e) {
+    // p1 is in [1, 0xffff], so this is in (0, range) for range >= 2^16.
+    return (range >> 16) * e.p1;
+  }
+  static void update(state& e, int symbol, bool fast) {
+    if (symbol) {
+      e.p1 += (0x10000 - e.p1) >> e.rate;
+    } else {
+      e.p1 -= e.p1 >> e.rate;
+    }
+    e.rate += e.rate < (fast ? FAST_MAX_RATE : MAX_RATE);
+  }
+  static state prior_state(uint64_t ones, uint64_t zeros) {
+    state e;
+    if (ones + zeros) {
+      uint64_t p1 = ((ones << 16) + (ones + zeros) / 2) / (ones + zeros);
+      e.p1 = uint16_t(p1 < 1 ? 1 : p1 > 0xffff ? 0xffff : p1);
+      e.rate = PRIOR_RATE;
+    }
+    return e;
+  }
+};
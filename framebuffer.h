@@ -1,42 +1,148 @@
 #ifndef _FRAMEBUFFER_H_
 #define _FRAMEBUFFER_H_
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
 #include "block.h"
+#include "memory_budget.h"
 
+// Recycles frame storage, so that models created one after another (e.g. one
+// per segment) reuse the pages of earlier frames instead of faulting in new
+// ones. Storage is 64-byte aligned, and accounted as memory::FRAMES until it
+// is freed; near the memory budget, released storage is freed, not pooled.
+class FramePool {
+    static const size_t MAX_FREE = 8;
+    std::mutex mutex_;
+    std::vector<std::pair<void*, size_t> > free_;
+ public:
+    static FramePool& instance() {
+        static FramePool pool;
+        return pool;
+    }
+    ~FramePool() {
+        for (auto &entry : free_) {
+            free(entry.first);
+            memory::add(memory::FRAMES, -int64_t(entry.second));
+        }
+    }
+    // Returns at least size bytes, and the actual size in *capacity.
+    void *acquire(size_t size, size_t *capacity) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            size_t best = free_.size();
+            for (size_t i = 0; i < free_.size(); ++i) {
+                if (free_[i].second >= size
+                    && (best == free_.size() || free_[i].second < free_[best].second)) {
+                    best = i;
+                }
+            }
+            if (best != free_.size()) {
+                void *storage = free_[best].first;
+                *capacity = free_[best].second;
+                free_.erase(free_.begin() + best);
+                return storage;
+            }
+        }
+        void *storage = nullptr;
+        if (posix_memalign(&storage, 64, size) != 0) {
+            throw std::bad_alloc();
+        }
+        memory::add(memory::FRAMES, size);
+        *capacity = size;
+        return storage;
+    }
+    void release(void *storage, size_t capacity) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_.size() < MAX_FREE && !memory::under_pressure()) {
+                free_.emplace_back(storage, capacity);
+                return;
+            }
+        }
+        free(storage);
+        memory::add(memory::FRAMES, -int64_t(capacity));
+    }
+};
+
+// Residuals and metadata of each macroblock of a frame. Clearing is lazy:
+// bzero() starts a new generation, and a block reads as zero until it is
+// first accessed for writing in the current generation, when it is cleared.
 class FrameBuffer {
     Block *image_;
+    BlockMeta *meta_;
+    // Generation in which each block and meta was last cleared.
+    uint32_t *image_generation_;
+    uint32_t *meta_generation_;
+    uint32_t generation_;
     uint32_t width_;
     uint32_t height_;
     uint32_t nblocks_;
-    BlockMeta *meta_;
-    uint8_t *storage_;
-    uint8_t *meta_storage_;
-    uint8_t *mb_types_;
-    uint16_t *cbp_;
+    void *storage_;
+    size_t capacity_;
     int frame_num_;
     FrameBuffer(const FrameBuffer &other) = delete;
     FrameBuffer& operator=(const FrameBuffer&other) = delete;
+    static size_t align(size_t size) {
+        return (size + 63) & ~size_t(63);
+    }
+    static const Block& zero_block() {
+        static const Block zero = Block();
+        return zero;
+    }
+    static const BlockMeta& zero_meta() {
+        static const BlockMeta zero = BlockMeta();
+        return zero;
+    }
     void destroy() {
-        if (width_ && height_) {
-            free(storage_);
-            free(meta_storage_);
+        if (storage_) {
+            FramePool::instance().release(storage_, capacity_);
         }
-        memset(this, 0, sizeof(*this));
+        storage_ = nullptr;
+        capacity_ = 0;
     }
  public:
     FrameBuffer() {
         image_ = nullptr;
+        meta_ = nullptr;
+        image_generation_ = nullptr;
+        meta_generation_ = nullptr;
+        generation_ = 1;
         storage_ = nullptr;
+        capacity_ = 0;
         width_ = 0;
         height_ = 0;
         nblocks_ = 0;
+        frame_num_ = 0;
     }
     void bzero() {
-        memset(meta_, 0, sizeof(BlockMeta) * nblocks_);
-        memset(image_, 0, sizeof(Block) * nblocks_);
+        if (++generation_ == 0) {
+            // Wrapped around: old stamps could look current.
+            memset(image_generation_, 0, sizeof(uint32_t) * nblocks_);
+            memset(meta_generation_, 0, sizeof(uint32_t) * nblocks_);
+            generation_ = 1;
+        }
     }
     void set_frame_num(int frame_num) {
         frame_num_ = frame_num;
     }
+    // Forget the frame, as if newly constructed, but keep its storage for
+    // the next init().
+    void forget() {
+        width_ = 0;
+        height_ = 0;
+        nblocks_ = 0;
+        frame_num_ = 0;
+    }
+    // Forget the frame and give its storage back to the pool.
+    void release() {
+        destroy();
+        forget();
+    }
     bool is_same_frame(int frame_num) const {
         return frame_num_ == frame_num && width_ != 0 && height_ != 0;
     }
@@ -50,21 +156,22 @@ class FrameBuffer {
         height_ = height;
         width_ = width;
         nblocks_ = width * height;
-        storage_ = (uint8_t*)malloc(nblocks_ * sizeof(Block) + 31);
-        meta_storage_ = (uint8_t*)malloc(nblocks_ * sizeof(BlockMeta) + 31);
-        size_t offset = storage_ - (uint8_t *)nullptr;
-        if (offset & 32) {
-            image_ = (Block*)(storage_ + 32 - (offset &31));
-        } else { // already aligned
-            image_ = (Block*)storage_;
-        }
-        offset = meta_storage_ - (uint8_t *)nullptr;
-        if (offset & 32) {
-            meta_ = (BlockMeta*)(meta_storage_ + 32 - (offset &31));
-        } else { // already aligned
-            meta_ = (BlockMeta*)meta_storage_;
+        size_t image_size = align(nblocks_ * sizeof(Block));
+        size_t meta_size = align(nblocks_ * sizeof(BlockMeta));
+        size_t generation_size = align(nblocks_ * sizeof(uint32_t));
+        size_t size = image_size + meta_size + 2 * generation_size;
+        if (size > capacity_) {
+            destroy();
+            storage_ = FramePool::instance().acquire(size, &capacity_);
         }
-        bzero();
+        uint8_t *storage = (uint8_t*)storage_;
+        image_ = (Block*)storage;
+        meta_ = (BlockMeta*)(storage + image_size);
+        image_generation_ = (uint32_t*)(storage + image_size + meta_size);
+        meta_generation_ = (uint32_t*)(storage + image_size + meta_size + generation_size);
+        memset(image_generation_, 0, sizeof(uint32_t) * nblocks_);
+        memset(meta_generation_, 0, sizeof(uint32_t) * nblocks_);
+        generation_ = 1;
     }
     ~FrameBuffer() {
         destroy();
@@ -73,16 +180,69 @@ class FrameBuffer {
         return nblocks_;
     }
     Block& at(uint32_t x, uint32_t y) {
-        return image_[x + y * width_];
+        uint32_t i = x + y * width_;
+        if (image_generation_[i] != generation_) {
+            memset(&image_[i], 0, sizeof(Block));
+            image_generation_[i] = generation_;
+        }
+        return image_[i];
     }
     const Block& at(uint32_t x, uint32_t y) const{
-        return image_[x + y * width_];
+        uint32_t i = x + y * width_;
+        return image_generation_[i] == generation_ ? image_[i] : zero_block();
     }
     BlockMeta& meta_at(uint32_t x, uint32_t y) {
-        return meta_[x + y * width_];
+        uint32_t i = x + y * width_;
+        if (meta_generation_[i] != generation_) {
+            memset(&meta_[i], 0, sizeof(BlockMeta));
+            meta_generation_[i] = generation_;
+        }
+        return meta_[i];
     }
     const BlockMeta& meta_at(uint32_t x, uint32_t y) const{
-        return meta_[x + y * width_];
+        uint32_t i = x + y * width_;
+        return meta_generation_[i] == generation_ ? meta_[i] : zero_meta();
+    }
+    // Significance (0 or 1) of coefficient k of a macroblock, see block.h.
+    int significance(uint32_t x, uint32_t y, int k) const {
+#ifdef FULL_RESIDUAL_LAYOUT
+        return at(x, y).residual[k];
+#else
+        return (meta_at(x, y).significance[k >> 6] >> (k & 63)) & 1;
+#endif
+    }
+    void set_significance(uint32_t x, uint32_t y, int k, int symbol) {
+#ifdef FULL_RESIDUAL_LAYOUT
+        at(x, y).residual[k] = symbol;
+#else
+        uint64_t &word = meta_at(x, y).significance[k >> 6];
+        uint64_t bit = uint64_t(1) << (k & 63);
+        word = symbol ? (word | bit) : (word & ~bit);
+#endif
+    }
+    // Number of significant coefficients in [begin, begin + count).
+    int count_significance(uint32_t x, uint32_t y, int begin, int count) const {
+        int total = 0;
+#ifdef FULL_RESIDUAL_LAYOUT
+        const Block &block = at(x, y);
+        for (int k = begin; k < begin + count; ++k) {
+            assert(block.residual[k] == 1 || block.residual[k] == 0);
+            total += block.residual[k] != 0;
+        }
+#else
+        const uint64_t *significance = meta_at(x, y).significance;
+        for (int k = begin; k < begin + count; ) {
+            int shift = k & 63;
+            int bits = std::min(64 - shift, begin + count - k);
+            uint64_t word = significance[k >> 6] >> shift;
+            if (bits < 64) {
+                word &= (uint64_t(1) << bits) - 1;
+            }
+            total += __builtin_popcountll(word);
+            k += bits;
+        }
+#endif
+        return total;
     }
 };
 #endif
@@ -0,0 +1,219 @@
+//
+// The I/O stages around the recoder, each on a thread of its own, so that
+// reading the input, recoding and writing the output overlap:
+//   prefetcher    faults in the pages of a mapped input ahead of where the
+//                 decoder reads, so it doesn't wait on the disk
+//   async_writer  a streambuf that hands full buffers to a writer thread
+// Both are bounded: the reader stays at most a window ahead of the decoder,
+// and the writer holds at most queue_depth buffers before the producer waits.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memory_budget.h"
+
+
+class prefetcher {
+ public:
+  // Read ahead in [data, data + size), up to window bytes past the last
+  // position passed to consumed().
+  prefetcher(const uint8_t *data, size_t size, size_t window)
+    : data(data), size(size), window(window), thread([this]() { run(); }) {}
+  prefetcher(const prefetcher&) = delete;
+  prefetcher& operator=(const prefetcher&) = delete;
+  ~prefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+  }
+
+  // Everything before pos has been read.
+  void consumed(size_t pos) {
+    pos = std::min(pos, size);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (pos <= consumed_pos) {
+        return;
+      }
+      consumed_pos = pos;
+    }
+    wake.notify_one();
+  }
+
+ private:
+  // Pages are faulted in a step at a time, so a new position isn't missed for long.
+  static constexpr size_t STEP = 256 * 1024;
+
+  void run() {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t next = 0;
+    while (true) {
+      size_t end;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&]() { return stopping || next < target(); });
+        if (stopping) {
+          return;
+        }
+        next = std::max(next, consumed_pos / page_size * page_size);
+        end = std::min(target(), next + STEP);
+      }
+      uintptr_t begin = reinterpret_cast<uintptr_t>(data + next) / page_size * page_size;
+      posix_madvise(reinterpret_cast<void*>(begin), reinterpret_cast<uintptr_t>(data + end) - begin,
+                    POSIX_MADV_WILLNEED);
+      // Touch each page, to wait for it here rather than in the decoder.
+      for (size_t pos = next; pos < end; pos += page_size) {
+        *static_cast<const volatile uint8_t*>(data + pos);
+      }
+      next = end;
+    }
+  }
+  size_t target() const {
+    return std::min(size, consumed_pos + std::min(window, size - consumed_pos));
+  }
+
+  const uint8_t *data;
+  size_t size;
+  size_t window;
+  std::mutex mutex;
+  std::condition_variable wake;
+  size_t consumed_pos = 0;
+  bool stopping = false;
+  std::thread thread;
+};
+
+// Writes to out on a writer thread, in buffers of buffer_size bytes with up
+// to queue_depth of them waiting. Call finish() before out is used again.
+class async_writer : public std::streambuf {
+ public:
+  async_writer(std::ostream& out, size_t buffer_size, int queue_depth)
+    : out(out), buffer_size(std::max<size_t>(buffer_size, 1)), queue_depth(std::max(queue_depth, 1)),
+      thread([this]() { run(); }) {
+    current.reserve(this->buffer_size);
+    footprint.set(this->buffer_size);
+  }
+  async_writer(const async_writer&) = delete;
+  async_writer& operator=(const async_writer&) = delete;
+  ~async_writer() {
+    try {
+      finish();
+    } catch (const std::exception&) {
+    }
+  }
+
+  // Write out everything written so far and stop the writer thread. Throws
+  // if out failed.
+  void finish() {
+    if (thread.joinable()) {
+      queue_current();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        finishing = true;
+      }
+      queued.notify_one();
+      thread.join();
+      out.flush();
+    }
+    if (failed || !out) {
+      throw std::runtime_error("Failed to write output.");
+    }
+  }
+
+ protected:
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    for (std::streamsize written = 0; written < n; ) {
+      size_t chunk = std::min<size_t>(n - written, buffer_size - current.size());
+      current.insert(current.end(), s + written, s + written + chunk);
+      written += chunk;
+      if (current.size() == buffer_size) {
+        queue_current();
+      }
+    }
+    return n;
+  }
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      char byte = traits_type::to_char_type(c);
+      xsputn(&byte, 1);
+    }
+    return traits_type::not_eof(c);
+  }
+  int sync() override {
+    queue_current();
+    return 0;
+  }
+
+ private:
+  // Hand the current buffer to the writer, waiting for room in the queue,
+  // and start the next one in a buffer the writer is done with.
+  void queue_current() {
+    if (current.empty()) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    dequeued.wait(lock, [&]() { return int(queue.size()) < queue_depth; });
+    queue.push_back(std::move(current));
+    if (!spare.empty()) {
+      current = std::move(spare.back());
+      spare.pop_back();
+    } else {
+      footprint.add(buffer_size);
+    }
+    current.clear();
+    current.reserve(buffer_size);
+    lock.unlock();
+    queued.notify_one();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      queued.wait(lock, [&]() { return finishing || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      std::vector<char> buffer = std::move(queue.front());
+      queue.pop_front();
+      lock.unlock();
+      dequeued.notify_one();
+      if (!failed) {
+        out.write(buffer.data(), buffer.size());
+        failed = !out;
+      }
+      lock.lock();
+      spare.push_back(std::move(buffer));
+    }
+  }
+
+  std::ostream& out;
+  const size_t buffer_size;
+  const int queue_depth;
+  std::vector<char> current;
+  std::mutex mutex;
+  std::condition_variable queued, dequeued;
+  std::deque<std::vector<char>> queue;
+  std::vector<std::vector<char>> spare;
+  bool finishing = false;
+  bool failed = false;
+  // The buffers allocated so far, which are all kept until the end.
+  memory::account footprint{memory::IO_BUFFERS};
+  std::thread thread;
+};
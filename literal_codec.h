@@ -0,0 +1,87 @@
+//
+// Compression of the literal blocks (container atoms, audio, skipped slices)
+// with a general-purpose codec, recorded per block in Block::literal_codec.
+//
+// Most literal bytes are audio or slice data that won't compress, so a block
+// is only compressed when a cheap estimate says it will pay off: the order-0
+// entropy of a sample of its bytes. Blocks that compress anyway but don't
+// come out smaller are kept as they are.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include <zlib.h>
+
+
+enum literal_codec : uint32_t {
+  LITERAL_RAW = 0,
+  LITERAL_DEFLATE = 1,  // zlib, at its fastest level.
+};
+
+struct literal_compression {
+  // Smaller blocks aren't worth a codec's framing.
+  static constexpr size_t MIN_SIZE = 512;
+  // Bytes of a block sampled for the estimate, in SAMPLE_RUNS evenly spaced runs.
+  static constexpr size_t SAMPLE_SIZE = 4096;
+  static constexpr size_t SAMPLE_RUNS = 16;
+  // Estimated bits per byte above which a block is left alone.
+  static constexpr double MAX_ENTROPY = 7.0;
+
+  // Order-0 entropy in bits per byte of a sample of data.
+  static double estimate_entropy(const uint8_t *data, size_t size) {
+    uint32_t counts[256] = {};
+    size_t run = std::min(size, SAMPLE_SIZE) / SAMPLE_RUNS;
+    size_t sampled = 0;
+    for (size_t i = 0; i < SAMPLE_RUNS && run > 0; i++) {
+      const uint8_t *start = data + (size - run) * i / (SAMPLE_RUNS - 1);
+      for (size_t j = 0; j < run; j++) {
+        counts[start[j]]++;
+      }
+      sampled += run;
+    }
+    double bits = 0;
+    for (uint32_t count : counts) {
+      if (count) {
+        bits -= count * std::log2(double(count) / sampled);
+      }
+    }
+    return sampled ? bits / sampled : 8;
+  }
+
+  // Compress data into *out if that is estimated to pay off and does.
+  // Returns the codec used, or LITERAL_RAW with *out untouched.
+  static literal_codec compress(const uint8_t *data, size_t size, std::string *out) {
+    if (size < MIN_SIZE || estimate_entropy(data, size) > MAX_ENTROPY) {
+      return LITERAL_RAW;
+    }
+    std::string compressed(compressBound(size), '\0');
+    uLongf compressed_size = compressed.size();
+    if (compress2(reinterpret_cast<Bytef*>(&compressed[0]), &compressed_size, data, size, Z_BEST_SPEED) != Z_OK ||
+        compressed_size >= size) {
+      return LITERAL_RAW;
+    }
+    compressed.resize(compressed_size);
+    out->swap(compressed);
+    return LITERAL_DEFLATE;
+  }
+
+  // The size bytes that in decompresses to with codec.
+  static std::string decompress(uint32_t codec, const std::string& in, size_t size) {
+    if (codec != LITERAL_DEFLATE) {
+      throw std::runtime_error("Unknown literal codec " + std::to_string(codec) + ".");
+    }
+    std::string out(size, '\0');
+    uLongf out_size = size;
+    if (uncompress(reinterpret_cast<Bytef*>(&out[0]), &out_size, reinterpret_cast<const Bytef*>(in.data()),
+                   in.size()) != Z_OK || out_size != size) {
+      throw std::runtime_error("Invalid compressed literal block.");
+    }
+    return out;
+  }
+};
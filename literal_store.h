@@ -0,0 +1,152 @@
+//
+// A content-addressed store for the literal blocks shared by many files (the
+// container headers and metadata atoms a camera writes into every file).
+//
+// With a store, the compressor writes each literal block of at least a given
+// size to the store under the SHA-256 of its bytes, and the Recoded block
+// holds only that hash (Block::literal_sha256) and the size. The store is a
+// directory with one file per block, named by the hex hash, so a block that
+// is already there costs no write at all. The decompressor maps the block's
+// file read-only and checks its hash before using it.
+//
+// Blocks are written to a temporary file and renamed into place, so several
+// processes can share a store.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include "libavutil/sha.h"
+}
+
+
+class literal_store {
+ public:
+  static constexpr size_t HASH_SIZE = 32;
+
+  // A block's bytes, mapped from the store while this is alive.
+  class block {
+   public:
+    block(const uint8_t *data, size_t size) : data(data), size(size) {}
+    block(const block&) = delete;
+    block& operator=(const block&) = delete;
+    ~block() {
+      munmap(const_cast<uint8_t*>(data), size);
+    }
+    const uint8_t *const data;
+    const size_t size;
+  };
+
+  explicit literal_store(const std::string& directory) : directory(directory) {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (!std::filesystem::is_directory(directory)) {
+      throw std::invalid_argument("Failed to open literal store: " + directory);
+    }
+  }
+
+  // SHA-256 of data, as HASH_SIZE bytes.
+  static std::string content_hash(const uint8_t *data, size_t size) {
+    std::unique_ptr<AVSHA, void (*)(void*)> sha(av_sha_alloc(), av_free);
+    if (!sha || av_sha_init(sha.get(), HASH_SIZE * 8) < 0) {
+      throw std::bad_alloc();
+    }
+    // av_sha_update takes at most an unsigned int at a time.
+    for (size_t pos = 0; pos < size; ) {
+      unsigned int n = unsigned(std::min<size_t>(size - pos, 1u << 30));
+      av_sha_update(sha.get(), data + pos, n);
+      pos += n;
+    }
+    std::string hash(HASH_SIZE, '\0');
+    av_sha_final(sha.get(), reinterpret_cast<uint8_t*>(&hash[0]));
+    return hash;
+  }
+
+  // Store data under hash, unless it is there already. Returns false if a
+  // different block is stored under the hash, which the caller should then
+  // keep inline.
+  bool put(const std::string& hash, const uint8_t *data, size_t size) const {
+    std::string path = block_path(hash);
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+      if (size_t(st.st_size) != size) {
+        return false;
+      }
+      std::unique_ptr<block> stored = map(path, size);
+      return memcmp(stored->data, data, size) == 0;
+    }
+    std::ostringstream temp_path;
+    temp_path << path << ".tmp." << getpid() << "." << std::this_thread::get_id();
+    {
+      std::ofstream file(temp_path.str(), std::ios::binary);
+      file.write(reinterpret_cast<const char*>(data), size);
+      if (!file) {
+        unlink(temp_path.str().c_str());
+        throw std::runtime_error("Failed to write to literal store: " + temp_path.str());
+      }
+    }
+    if (rename(temp_path.str().c_str(), path.c_str()) != 0) {
+      unlink(temp_path.str().c_str());
+      throw std::runtime_error("Failed to write to literal store: " + path);
+    }
+    return true;
+  }
+
+  // Map the block stored under hash, which must be size bytes long.
+  std::unique_ptr<block> get(const std::string& hash, size_t size) const {
+    std::string path = block_path(hash);
+    std::unique_ptr<block> stored = map(path, size);
+    if (content_hash(stored->data, stored->size) != hash) {
+      throw std::runtime_error("Corrupt literal store block: " + path);
+    }
+    return stored;
+  }
+
+ private:
+  std::string block_path(const std::string& hash) const {
+    if (hash.size() != HASH_SIZE) {
+      throw std::runtime_error("Invalid literal block hash.");
+    }
+    static const char digits[] = "0123456789abcdef";
+    std::string name;
+    for (char c : hash) {
+      name.push_back(digits[uint8_t(c) >> 4]);
+      name.push_back(digits[uint8_t(c) & 0xf]);
+    }
+    return directory + "/" + name;
+  }
+
+  static std::unique_ptr<block> map(const std::string& path, size_t size) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0) close(fd);
+      throw std::runtime_error("Missing literal store block: " + path);
+    }
+    void *mapping = size && size_t(st.st_size) == size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0)
+                                                      : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error("Invalid literal store block: " + path);
+    }
+    return std::unique_ptr<block>(new block(static_cast<const uint8_t*>(mapping), size));
+  }
+
+  std::string directory;
+};
@@ -0,0 +1,129 @@
+//
+// Accounting of the memory the recoder holds, by subsystem, against an
+// optional budget (--max-memory):
+//   FRAMES      the models' frame buffers, including those pooled for reuse
+//   ESTIMATORS  the estimator tables and their key indexes
+//   BLOCKS      recoded blocks held in memory until they are written out
+//   IO_BUFFERS  the demuxer's input buffers and the output write queues
+// Each owner of such memory holds an account and sets it to what it has
+// allocated, so the totals are the bytes held now and the peaks since the
+// last reset_peaks(). The counts are process-wide, like a container's limit.
+//
+// Near the budget, the recoder sheds what it can do without: frame storage
+// isn't pooled, and the compressor caps the estimator table (recorded in the
+// output, so the decompressor does the same). Segment workers give back their
+// model's storage as soon as they finish.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace memory {
+
+enum subsystem {
+  FRAMES,
+  ESTIMATORS,
+  BLOCKS,
+  IO_BUFFERS,
+  NUM_SUBSYSTEMS
+};
+constexpr const char *subsystem_names[NUM_SUBSYSTEMS] = {"frames", "estimators", "blocks", "io_buffers"};
+
+struct global_state {
+  std::atomic<int64_t> current[NUM_SUBSYSTEMS] = {};
+  std::atomic<int64_t> peak[NUM_SUBSYSTEMS] = {};
+  std::atomic<int64_t> total = {0};
+  std::atomic<int64_t> peak_total = {0};
+  std::atomic<int64_t> budget = {0};
+};
+inline global_state& global() {
+  static global_state state;
+  return state;
+}
+
+inline void raise_peak(std::atomic<int64_t>& peak, int64_t value) {
+  int64_t seen = peak.load(std::memory_order_relaxed);
+  while (value > seen && !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+  }
+}
+
+// Count bytes (or give them back, if negative) for a subsystem.
+inline void add(subsystem s, int64_t bytes) {
+  global_state& g = global();
+  int64_t now = g.current[s].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  int64_t total = g.total.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  if (bytes > 0) {
+    raise_peak(g.peak[s], now);
+    raise_peak(g.peak_total, total);
+  }
+}
+
+inline size_t current(subsystem s) {
+  return size_t(global().current[s].load(std::memory_order_relaxed));
+}
+inline size_t peak(subsystem s) {
+  return size_t(global().peak[s].load(std::memory_order_relaxed));
+}
+inline size_t total() {
+  return size_t(global().total.load(std::memory_order_relaxed));
+}
+inline size_t peak_total() {
+  return size_t(global().peak_total.load(std::memory_order_relaxed));
+}
+
+// Start the peaks over from what is held now.
+inline void reset_peaks() {
+  global_state& g = global();
+  for (int i = 0; i < NUM_SUBSYSTEMS; i++) {
+    g.peak[i].store(g.current[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+  g.peak_total.store(g.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+// The budget in bytes, 0 for none.
+inline void set_budget(size_t bytes) {
+  global().budget.store(int64_t(bytes), std::memory_order_relaxed);
+}
+inline size_t budget() {
+  return size_t(global().budget.load(std::memory_order_relaxed));
+}
+
+// Whether the accounted bytes are within an eighth of the budget, or over it.
+inline bool under_pressure() {
+  int64_t limit = global().budget.load(std::memory_order_relaxed);
+  return limit > 0 && global().total.load(std::memory_order_relaxed) >= limit - limit / 8;
+}
+
+// The bytes of a subsystem held by one object, given back when it goes.
+class account {
+ public:
+  explicit account(subsystem s) : s(s) {}
+  account(const account&) = delete;
+  account& operator=(const account&) = delete;
+  ~account() {
+    set(0);
+  }
+
+  void set(size_t bytes) {
+    if (bytes != held) {
+      memory::add(s, int64_t(bytes) - int64_t(held));
+      held = bytes;
+    }
+  }
+  void add(int64_t bytes) {
+    set(size_t(int64_t(held) + bytes));
+  }
+  size_t bytes() const {
+    return held;
+  }
+
+ private:
+  subsystem s;
+  size_t held = 0;
+};
+
+}  // namespace memory
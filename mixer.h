@@ -0,0 +1,110 @@
+//
+// Logistic mixing of several estimators' predictions of a bin, for
+// h264_model's significance map (built with AVRECODE_MIXING=1).
+//
+// Each input is a 12-bit probability of a 1. The mixer adds up the inputs in
+// the logistic domain, stretch(p) = ln(p / (1 - p)), with weights from one of
+// a few weight sets chosen by the caller, and squashes the sum back into a
+// probability. After the bin is coded, each weight of the set moves along the
+// gradient of the coding cost, err * stretch(p_i). Everything is in integers,
+// so from the same inputs the compressor and decompressor compute the same
+// probabilities, and the inputs and weights are fixed-size int32 arrays so the
+// loops vectorize.
+//
+
+#pragma once
+
+#include <cstdint>
+
+
+// stretch and squash in fixed point: probabilities in 12 bits, logits with 8
+// fractional bits, clamped to +-2047.
+struct logistic_tables {
+  static constexpr int PROBABILITY_BITS = 12;
+  static constexpr int MAX_LOGIT = 2047;
+  int16_t stretch_table[1 << PROBABILITY_BITS] = {};
+
+  // p = 4096 / (1 + e^-x), interpolated from 33 points.
+  static constexpr int squash(int x) {
+    constexpr int16_t points[33] = {
+      1, 2, 3, 6, 10, 16, 27, 45, 73, 120, 194, 310, 488, 747, 1101, 1546, 2047,
+      2549, 2994, 3348, 3607, 3785, 3901, 3975, 4022, 4050, 4068, 4079, 4085, 4089, 4092, 4093, 4094};
+    if (x > MAX_LOGIT) x = MAX_LOGIT;
+    if (x < -MAX_LOGIT) x = -MAX_LOGIT;
+    int w = x & 127;
+    int i = (x >> 7) + 16;
+    return (points[i] * (128 - w) + points[i + 1] * w + 64) >> 7;
+  }
+
+  // The inverse of squash.
+  constexpr logistic_tables() {
+    int p = 0;
+    for (int x = -MAX_LOGIT; x <= MAX_LOGIT; x++) {
+      for (int end = squash(x); p <= end; p++) {
+        stretch_table[p] = int16_t(x);
+      }
+    }
+    for (; p < (1 << PROBABILITY_BITS); p++) {
+      stretch_table[p] = MAX_LOGIT;
+    }
+  }
+  int stretch(int p) const {
+    return stretch_table[p];
+  }
+};
+inline constexpr logistic_tables logistic{};
+
+template <int Inputs, int WeightSets>
+class logistic_mixer {
+ public:
+  static constexpr int PROBABILITY_BITS = logistic_tables::PROBABILITY_BITS;
+  // Weights in 16 fractional bits. Input 0 starts with all the weight, so a
+  // new mixer predicts what that input does.
+  static constexpr int32_t ONE = 1 << 16;
+  // The weight update is err * stretch(p_i) >> LEARNING_SHIFT, a learning
+  // rate of about 1/128.
+  static constexpr int LEARNING_SHIFT = 11;
+  static constexpr int32_t MAX_WEIGHT = 16 * ONE;
+
+  logistic_mixer() {
+    reset();
+  }
+
+  void reset() {
+    for (int set = 0; set < WeightSets; set++) {
+      for (int i = 0; i < Inputs; i++) {
+        weights[set][i] = i == 0 ? ONE : 0;
+      }
+    }
+  }
+
+  // The mixed probability of a 1, in (0, 1 << PROBABILITY_BITS), of the
+  // inputs' probabilities p[] with weight set `set`. The inputs are kept for
+  // update().
+  int mix(const int *p, int set) {
+    weight_set = set;
+    int64_t dot = 0;
+    for (int i = 0; i < Inputs; i++) {
+      stretched[i] = logistic.stretch(p[i]);
+      dot += int64_t(weights[set][i]) * stretched[i];
+    }
+    mixed = logistic_tables::squash(int(dot >> 16));
+    return mixed;
+  }
+
+  // Train the weights used by the last mix() on the coded symbol.
+  void update(int symbol) {
+    int32_t err = (symbol << PROBABILITY_BITS) - mixed;
+    int32_t *w = weights[weight_set];
+    for (int i = 0; i < Inputs; i++) {
+      int32_t updated = w[i] + ((stretched[i] * err) >> LEARNING_SHIFT);
+      w[i] = updated > MAX_WEIGHT ? MAX_WEIGHT : updated < -MAX_WEIGHT ? -MAX_WEIGHT : updated;
+    }
+  }
+
+ private:
+  alignas(16) int32_t weights[WeightSets][Inputs];
+  alignas(16) int32_t stretched[Inputs] = {};
+  int weight_set = 0;
+  int mixed = 1 << (PROBABILITY_BITS - 1);
+};
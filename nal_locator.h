@@ -0,0 +1,167 @@
+//
+// Index of candidate slice NAL units in the original file, used by the
+// compressor to find the slice data passed to each CABAC decoder.
+//
+// libavcodec hands the decoder the bytes following a slice header, so those
+// bytes have to be found in the input to be replaced. Instead of searching
+// all of the read-ahead for every slice, slice NAL unit starts are recorded
+// as the input is read, and the slice data is only looked for in a short
+// window after each of them: O(window + slice size) for the right candidate.
+//
+// Candidates are Annex B start codes (00 00 01) and 4-byte big-endian length
+// prefixes (the usual MP4 framing), followed by a slice NAL unit header. A
+// false candidate only costs a failed match in its window. Slices the
+// candidates miss (1- or 2-byte length prefixes, NAL units of 16 MB or more,
+// slice headers longer than MAX_SLICE_HEADER_BYTES) are left to
+// find_or_search, which falls back to searching the whole range.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+
+class nal_locator {
+ public:
+  // Slice data starting further than this after its NAL unit header (a very
+  // long slice header) is not found.
+  static constexpr size_t MAX_SLICE_HEADER_BYTES = 1024;
+
+  // Add the candidates in data[0, end), continuing from the previous call.
+  void scan(const uint8_t *data, size_t end) {
+    // Each candidate is decided by the 5 bytes at its position.
+    for (size_t i = scanned; i + 5 <= end; i++) {
+      const uint8_t *zero = static_cast<const uint8_t*>(memchr(&data[i], 0, end - 4 - i));
+      if (zero == nullptr) {
+        break;
+      }
+      i = zero - data;
+      if (data[i + 1] == 0 && data[i + 2] == 1 && is_slice_header(data[i + 3])) {
+        add(i + 4);
+      }
+      if (is_slice_header(data[i + 4]) && (data[i + 1] | data[i + 2] | data[i + 3]) != 0) {
+        add(i + 5);
+      }
+    }
+    scanned = end < 4 ? 0 : std::max(scanned, end - 4);
+  }
+
+  // Offset of the slice data [buf, buf + size) in data[begin, end), or -1 if
+  // it doesn't follow any candidate (e.g. because it was NAL-escaped).
+  int64_t find(const uint8_t *data, size_t begin, size_t end, const uint8_t *buf, size_t size) {
+    while (!candidates.empty() && candidates.front() < begin) {
+      candidates.pop_front();
+    }
+    if (size == 0 || size > end) {
+      return -1;
+    }
+    // Look for a short prefix in each window, then compare the rest.
+    size_t prefix = std::min<size_t>(size, 8);
+    for (size_t candidate : candidates) {
+      if (candidate + size > end) {
+        break;
+      }
+      size_t window_end = std::min(candidate + MAX_SLICE_HEADER_BYTES, end - size) + prefix;
+      const uint8_t *p = &data[candidate];
+      while ((p = static_cast<const uint8_t*>(
+                  memmem(p, &data[window_end] - p, buf, prefix))) != nullptr) {
+        if (memcmp(p + prefix, buf + prefix, size - prefix) == 0) {
+          return p - data;
+        }
+        p++;
+      }
+    }
+    return -1;
+  }
+
+  // Like find, but if no candidate's window has the slice data, search all of
+  // data[begin, end) for it, and set *searched when that is what found it.
+  int64_t find_or_search(const uint8_t *data, size_t begin, size_t end, const uint8_t *buf, size_t size,
+                         bool *searched) {
+    *searched = false;
+    int64_t offset = find(data, begin, end, buf, size);
+    if (offset >= 0 || size == 0 || end < begin + size) {
+      return offset;
+    }
+    const uint8_t *p = static_cast<const uint8_t*>(memmem(&data[begin], end - begin, buf, size));
+    if (p == nullptr) {
+      return -1;
+    }
+    *searched = true;
+    return p - data;
+  }
+
+  // Like find, but for slice data that was NAL-escaped: in the input, each
+  // 0x03 following two zero bytes is an emulation prevention byte that the
+  // decoder removed. Returns the offset and sets *escaped_size to the length
+  // of the match in the input, and *escapes to the offsets in buf before
+  // which an emulation prevention byte was skipped.
+  int64_t find_escaped(const uint8_t *data, size_t begin, size_t end, const uint8_t *buf, size_t size,
+                       size_t *escaped_size, std::vector<uint32_t> *escapes) {
+    while (!candidates.empty() && candidates.front() < begin) {
+      candidates.pop_front();
+    }
+    if (size == 0 || size > end) {
+      return -1;
+    }
+    for (size_t candidate : candidates) {
+      if (candidate + size > end) {
+        break;
+      }
+      size_t window_end = std::min(candidate + MAX_SLICE_HEADER_BYTES, end - size) + 1;
+      const uint8_t *p = &data[candidate];
+      while ((p = static_cast<const uint8_t*>(
+                  memchr(p, buf[0], &data[window_end] - p))) != nullptr) {
+        if (match_escaped(p - data, data, end, buf, size, escaped_size, escapes)) {
+          return p - data;
+        }
+        p++;
+      }
+    }
+    return -1;
+  }
+
+ private:
+  static bool match_escaped(size_t start, const uint8_t *data, size_t end, const uint8_t *buf, size_t size,
+                            size_t *escaped_size, std::vector<uint32_t> *escapes) {
+    escapes->clear();
+    int zeros = 0;
+    size_t i = start;
+    for (size_t j = 0; j < size; i++) {
+      if (i >= end) {
+        return false;
+      }
+      if (zeros >= 2 && data[i] == 3) {
+        escapes->push_back(j);
+        zeros = 0;
+        continue;
+      }
+      if (data[i] != buf[j]) {
+        return false;
+      }
+      zeros = data[i] == 0 ? zeros + 1 : 0;
+      j++;
+    }
+    *escaped_size = i - start;
+    return true;
+  }
+
+  // forbidden_zero_bit clear, and a coded slice (1) or IDR slice (5).
+  static bool is_slice_header(uint8_t nal_header) {
+    int nal_unit_type = nal_header & 0x1f;
+    return (nal_header & 0x80) == 0 && (nal_unit_type == 1 || nal_unit_type == 5);
+  }
+
+  void add(size_t candidate) {
+    if (candidates.empty() || candidates.back() < candidate) {
+      candidates.push_back(candidate);
+    }
+  }
+
+  std::deque<size_t> candidates;
+  size_t scanned = 0;
+};
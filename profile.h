@@ -0,0 +1,232 @@
+//
+// Low-overhead profiling of the recoding pipeline: cycles and calls for each
+// pipeline stage, and cycles and bins for each CodingType. Stage times are
+// inclusive: e.g. DECODE (ffmpeg's decode call) includes the hooks, and
+// ARITHMETIC includes the estimator lookups made while coding a bin.
+//
+// Counters are kept per thread, and folded into the totals when a thread
+// exits, so segment workers don't contend for them. Cycles come from the
+// time stamp counter where there is one, and are converted to seconds
+// against the steady clock.
+//
+// Define AVRECODE_NO_PROFILE to compile out all the counting.
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+namespace profile {
+
+enum stage {
+  COMPRESS,
+  DECOMPRESS,
+  DEMUX,
+  DECODE,
+  SLICE,
+  MODEL_KEY,
+  ESTIMATOR,
+  ARITHMETIC,
+  SERIALIZE,
+  NUM_STAGES
+};
+constexpr const char *stage_names[NUM_STAGES] = {
+  "compress", "decompress", "demux", "decode", "slice", "model_key", "estimator", "arithmetic", "serialize"
+};
+constexpr int MAX_CODING_TYPES = 32;
+
+inline uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct counters {
+  uint64_t stage_cycles[NUM_STAGES] = {};
+  uint64_t stage_calls[NUM_STAGES] = {};
+  uint64_t coding_type_cycles[MAX_CODING_TYPES] = {};
+  uint64_t coding_type_bins[MAX_CODING_TYPES] = {};
+
+  void add(const counters& other) {
+    for (int i = 0; i < NUM_STAGES; i++) {
+      stage_cycles[i] += other.stage_cycles[i];
+      stage_calls[i] += other.stage_calls[i];
+    }
+    for (int i = 0; i < MAX_CODING_TYPES; i++) {
+      coding_type_cycles[i] += other.coding_type_cycles[i];
+      coding_type_bins[i] += other.coding_type_bins[i];
+    }
+  }
+};
+
+struct global_state {
+  std::mutex mutex;
+  // Counters of threads that have exited since the last reset.
+  counters exited;
+  // For converting cycles to seconds.
+  uint64_t start_cycles = cycles();
+  std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+  const char *const *coding_type_names = nullptr;
+  int num_coding_types = 0;
+};
+inline global_state& global() {
+  static global_state state;
+  return state;
+}
+
+struct thread_counters : counters {
+  ~thread_counters() {
+    std::lock_guard<std::mutex> lock(global().mutex);
+    global().exited.add(*this);
+  }
+};
+inline counters& local() {
+  thread_local thread_counters local_counters;
+  return local_counters;
+}
+
+// Names used in the reports, indexed by CodingType.
+inline void set_coding_type_names(const char *const *names, int count) {
+  global().coding_type_names = names;
+  global().num_coding_types = count < MAX_CODING_TYPES ? count : MAX_CODING_TYPES;
+}
+
+// Clear the counters of exited threads and of the calling thread.
+inline void reset() {
+  std::lock_guard<std::mutex> lock(global().mutex);
+  global().exited = counters();
+  local() = counters();
+  global().start_cycles = cycles();
+  global().start_time = std::chrono::steady_clock::now();
+}
+
+class stage_timer {
+ public:
+  explicit stage_timer(stage s) : s(s), start(cycles()) {}
+  ~stage_timer() {
+    counters& c = local();
+    c.stage_cycles[s] += cycles() - start;
+    c.stage_calls[s]++;
+  }
+ private:
+  stage s;
+  uint64_t start;
+};
+
+// Times hook code working on a CodingType, counting one bin unless bin is false.
+class coding_type_timer {
+ public:
+  coding_type_timer(int coding_type, bool bin = true)
+    : coding_type(coding_type >= 0 && coding_type < MAX_CODING_TYPES ? coding_type : 0),
+      bin(bin), start(cycles()) {}
+  ~coding_type_timer() {
+    counters& c = local();
+    c.coding_type_cycles[coding_type] += cycles() - start;
+    c.coding_type_bins[coding_type] += bin;
+  }
+ private:
+  int coding_type;
+  bool bin;
+  uint64_t start;
+};
+
+// Totals of the exited threads and the calling thread, and the cycle rate.
+inline counters snapshot(double *cycles_per_second) {
+  std::lock_guard<std::mutex> lock(global().mutex);
+  counters total = global().exited;
+  total.add(local());
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - global().start_time).count();
+  uint64_t elapsed = cycles() - global().start_cycles;
+  *cycles_per_second = seconds > 0 && elapsed > 0 ? elapsed / seconds : 1e9;
+  return total;
+}
+
+inline std::string coding_type_name(int i) {
+  if (i < global().num_coding_types && global().coding_type_names) {
+    return global().coding_type_names[i];
+  }
+  return std::to_string(i);
+}
+
+inline void write_json(std::ostream& out) {
+  double hz;
+  counters c = snapshot(&hz);
+  double decode_seconds = c.stage_cycles[DECODE] / hz;
+  uint64_t bins = 0;
+  for (int i = 0; i < MAX_CODING_TYPES; i++) {
+    bins += c.coding_type_bins[i];
+  }
+  out << "{\n  \"cycles_per_second\": " << hz << ",\n";
+  out << "  \"slices_per_second\": " << (decode_seconds > 0 ? c.stage_calls[SLICE] / decode_seconds : 0) << ",\n";
+  out << "  \"bins_per_second\": " << (decode_seconds > 0 ? bins / decode_seconds : 0) << ",\n";
+  out << "  \"stages\": {";
+  for (int i = 0; i < NUM_STAGES; i++) {
+    out << (i ? ",\n" : "\n") << "    \"" << stage_names[i] << "\": {\"calls\": " << c.stage_calls[i]
+        << ", \"cycles\": " << c.stage_cycles[i] << ", \"seconds\": " << c.stage_cycles[i] / hz << "}";
+  }
+  out << "\n  },\n  \"coding_types\": {";
+  bool first = true;
+  for (int i = 0; i < MAX_CODING_TYPES; i++) {
+    if (!c.coding_type_cycles[i]) continue;
+    double seconds = c.coding_type_cycles[i] / hz;
+    out << (first ? "\n" : ",\n") << "    \"" << coding_type_name(i) << "\": {\"bins\": "
+        << c.coding_type_bins[i] << ", \"cycles\": " << c.coding_type_cycles[i]
+        << ", \"seconds\": " << seconds
+        << ", \"bins_per_second\": " << (seconds > 0 ? c.coding_type_bins[i] / seconds : 0) << "}";
+    first = false;
+  }
+  out << "\n  }\n}\n";
+}
+
+// One row per stage and CodingType: name, calls (or bins), cycles, seconds.
+inline void write_csv_header(std::ostream& out) {
+  out << "File,Kind,Name,Count,Cycles,Seconds,Per second" << std::endl;
+}
+inline void write_csv(std::ostream& out, const std::string& file) {
+  double hz;
+  counters c = snapshot(&hz);
+  for (int i = 0; i < NUM_STAGES; i++) {
+    double seconds = c.stage_cycles[i] / hz;
+    out << "\"" << file << "\",stage," << stage_names[i] << "," << c.stage_calls[i] << ","
+        << c.stage_cycles[i] << "," << seconds << "," << (seconds > 0 ? c.stage_calls[i] / seconds : 0) << "\n";
+  }
+  for (int i = 0; i < MAX_CODING_TYPES; i++) {
+    if (!c.coding_type_cycles[i]) continue;
+    double seconds = c.coding_type_cycles[i] / hz;
+    out << "\"" << file << "\",coding_type," << coding_type_name(i) << "," << c.coding_type_bins[i] << ","
+        << c.coding_type_cycles[i] << "," << seconds << ","
+        << (seconds > 0 ? c.coding_type_bins[i] / seconds : 0) << "\n";
+  }
+  out.flush();
+}
+
+}  // namespace profile
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#ifndef AVRECODE_NO_PROFILE
+// Time the rest of the enclosing scope as a pipeline stage.
+#define PROFILE_STAGE(s) profile::stage_timer PROFILE_CONCAT(profile_stage_, __LINE__)(profile::s)
+// Time the rest of the enclosing scope as one bin of a CodingType.
+#define PROFILE_BIN(coding_type) \
+  profile::coding_type_timer PROFILE_CONCAT(profile_bin_, __LINE__)(coding_type)
+// Time the rest of the enclosing scope as work on a CodingType, not a bin.
+#define PROFILE_CODING_TYPE(coding_type) \
+  profile::coding_type_timer PROFILE_CONCAT(profile_bin_, __LINE__)(coding_type, false)
+#else
+#define PROFILE_STAGE(s) do {} while (0)
+#define PROFILE_BIN(coding_type) do {} while (0)
+#define PROFILE_CODING_TYPE(coding_type) do {} while (0)
+#endif
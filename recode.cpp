@@ -1,6 +1,7 @@
 /* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 #include <fstream>
 #include <iostream>
+#include <deque>
 #include <list>
 #include <map>
 #include <memory>
@@ -11,6 +12,20 @@
 #include <string>
 #include <chrono>
 #include <tuple>
+#include <random>
+#include <type_traits>
+#include <variant>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include <csignal>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 extern "C" {
 #include "libavcodec/avcodec.h"
@@ -23,7 +38,17 @@ extern "C" {
 }
 
 #include "arithmetic_code.h"
+#include "bin_trace.h"
 #include "cabac_code.h"
+#include "estimator_prior.h"
+#include "estimator_table.h"
+#include "io_pipeline.h"
+#include "literal_codec.h"
+#include "literal_store.h"
+#include "memory_budget.h"
+#include "mixer.h"
+#include "nal_locator.h"
+#include "profile.h"
 #include "recode.pb.h"
 #include "framebuffer.h"
 
@@ -75,14 +100,189 @@ bool av_check(int return_value, const std::string& message = "") {
   return av_check(return_value, 0, message);
 }
 
+// Runs task(i) for each i in [0, count) on up to num_threads threads. The first
+// exception thrown by a task is rethrown after all threads have finished.
+template <typename Task>
+void run_on_threads(size_t count, int num_threads, const Task& task) {
+  std::atomic<size_t> next(0);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < count; ) {
+      try {
+        task(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) error = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads && size_t(t) < count; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (error) std::rethrow_exception(error);
+}
+
+
+// Streamed container: STREAM_MAGIC, then length-prefixed records holding a
+// Recoded::Metadata, then one Recoded::Block each, then an empty record.
+// Unlike a serialized Recoded message, it can be written and read a block at
+// a time. A Recoded message never starts with a zero byte.
+const char STREAM_MAGIC[8] = {'\0', 'A', 'V', 'R', 'S', 'T', 'R', 'M'};
+
+void write_varint(std::ostream& out, uint64_t n) {
+  char bytes[10];
+  int size = 0;
+  for (; n >= 0x80; n >>= 7) {
+    bytes[size++] = (n & 0x7f) | 0x80;
+  }
+  bytes[size++] = n;
+  out.write(bytes, size);
+}
+
+size_t varint_size(uint64_t n) {
+  size_t size = 1;
+  for (; n >= 0x80; n >>= 7) size++;
+  return size;
+}
+
+void write_record(std::ostream& out, const std::string& record) {
+  write_varint(out, record.size());
+  out << record;
+}
+
+// Write a length-prefixed Recoded::Block holding only a literal, straight
+// from data. This is both a stream record and, after the tag of
+// Recoded::block, a field of a serialized Recoded message.
+const char LITERAL_TAG = (Recoded::Block::kLiteralFieldNumber << 3) | 2;
+void write_literal_block(std::ostream& out, const uint8_t *data, size_t size) {
+  write_varint(out, 1 + varint_size(size) + size);
+  out.put(LITERAL_TAG);
+  write_varint(out, size);
+  out.write(reinterpret_cast<const char*>(data), size);
+}
+
+// Read the record at *pos, advancing *pos past it. Returns false if the
+// record is truncated.
+bool read_record(const uint8_t **pos, const uint8_t *end, const uint8_t **record, size_t *size) {
+  uint64_t n = 0;
+  for (int shift = 0; ; shift += 7) {
+    if (*pos == end || shift > 63) return false;
+    uint8_t byte = *(*pos)++;
+    n |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) break;
+  }
+  if (n > uint64_t(end - *pos)) return false;
+  *record = *pos;
+  *size = n;
+  *pos += n;
+  return true;
+}
+
+// Parse compressed bytes in either the message or the streamed format.
+void parse_recoded(const std::string& bytes, Recoded *recoded) {
+  if (bytes.compare(0, sizeof(STREAM_MAGIC), STREAM_MAGIC, sizeof(STREAM_MAGIC)) != 0) {
+    if (!recoded->ParseFromString(bytes)) {
+      throw std::runtime_error("Invalid compressed data.");
+    }
+    return;
+  }
+  const uint8_t *pos = reinterpret_cast<const uint8_t*>(bytes.data()) + sizeof(STREAM_MAGIC);
+  const uint8_t *end = reinterpret_cast<const uint8_t*>(bytes.data()) + bytes.size();
+  const uint8_t *record;
+  size_t size;
+  if (!read_record(&pos, end, &record, &size) ||
+      !recoded->mutable_metadata()->ParseFromArray(record, size)) {
+    throw std::runtime_error("Invalid stream header.");
+  }
+  while (true) {
+    if (!read_record(&pos, end, &record, &size)) {
+      throw std::runtime_error("Truncated stream.");
+    }
+    if (size == 0) break;
+    if (!recoded->add_block()->ParseFromArray(record, size)) {
+      throw std::runtime_error("Invalid stream block.");
+    }
+  }
+}
+
+
+// The context states passed to the CABAC get() hook live in
+// H264SliceContext::cabac_state, which immediately follows the slice's
+// CABACContext. Pointers outside this array still work, they just take the
+// slower keyed path in the estimator table.
+inline const uint8_t* cabac_state_array(const CABACContext *ctx) {
+  return reinterpret_cast<const uint8_t*>(ctx + 1);
+}
+
+// The input video, as shown by av_dump_format.
+struct video_info {
+  std::string stream;  // Codec and profile, e.g. "h264 (High) (avc1 / 0x31637661)".
+  double duration_seconds = 0;
+  double fps = 0;
+};
+
+// The demuxer's I/O buffer, kept from one av_decoder to the next so that a
+// process recoding many small files (see recode_worker) doesn't allocate
+// and fault in a new one for each. Accounted as memory::IO_BUFFERS while it
+// is lent out or kept.
+class av_io_buffer {
+ public:
+  // Size of new buffers (--io-buffer-size).
+  static inline size_t size = 1024*1024;
+
+  av_io_buffer() = default;
+  av_io_buffer(const av_io_buffer&) = delete;
+  av_io_buffer& operator=(const av_io_buffer&) = delete;
+  ~av_io_buffer() {
+    av_free(buffer);
+  }
+
+  // The kept buffer, or a new one. *size is its size.
+  uint8_t *acquire(size_t *size) {
+    uint8_t *acquired = buffer;
+    *size = buffer_size;
+    buffer = nullptr;
+    if (acquired == nullptr) {
+      acquired = static_cast<uint8_t*>( av_malloc(av_io_buffer::size) );
+      *size = av_io_buffer::size;
+    }
+    footprint.set(*size);
+    return acquired;
+  }
+  // Takes back the AVIOContext's buffer, which libavformat may have swapped
+  // for one of its own while probing.
+  void release(uint8_t *released, size_t size) {
+    if (buffer != nullptr || size < av_io_buffer::size) {
+      av_free(released);
+      footprint.set(buffer ? buffer_size : 0);
+      return;
+    }
+    buffer = released;
+    buffer_size = size;
+    footprint.set(buffer_size);
+  }
+
+ private:
+  uint8_t *buffer = nullptr;
+  size_t buffer_size = 0;
+  memory::account footprint{memory::IO_BUFFERS};
+};
 
-// Sets up a libavcodec decoder with I/O and decoding hooks.
+// Sets up a libavcodec decoder with I/O and decoding hooks. The I/O buffer
+// comes from io if given.
 template <typename Driver>
 class av_decoder {
  public:
-  av_decoder(Driver *driver, const std::string& input_filename) : driver(driver) {
-    const size_t avio_ctx_buffer_size = 1024*1024;
-    uint8_t *avio_ctx_buffer = static_cast<uint8_t*>( av_malloc(avio_ctx_buffer_size) );
+  av_decoder(Driver *driver, const std::string& input_filename, av_io_buffer *io = nullptr)
+    : driver(driver), io(io ? io : &own_io) {
+    size_t avio_ctx_buffer_size;
+    uint8_t *avio_ctx_buffer = this->io->acquire(&avio_ctx_buffer_size);
 
     format_ctx = avformat_alloc_context();
     if (avio_ctx_buffer == nullptr || format_ctx == nullptr) throw std::bad_alloc();
@@ -103,7 +303,8 @@ class av_decoder {
     for (size_t i = 0; i < format_ctx->nb_streams; i++) {
       avcodec_close(format_ctx->streams[i]->codec);
     }
-    av_freep(&format_ctx->pb->buffer);  // May no longer be the same buffer we initially malloced.
+    io->release(format_ctx->pb->buffer, format_ctx->pb->buffer_size);  // May no longer be the one acquired.
+    format_ctx->pb->buffer = nullptr;
     av_freep(&format_ctx->pb);
     avformat_close_input(&format_ctx);
   }
@@ -111,36 +312,147 @@ class av_decoder {
   // Read enough frames to display stream diagnostics. Only used by compressor,
   // because hooks are not yet set. Reads from already in-memory blocks.
   void dump_stream_info(const int index = 0) {
+    find_stream_info();
+    av_dump_format(format_ctx, index, format_ctx->filename, 0);
+  }
+  void find_stream_info() {
     av_check( avformat_find_stream_info(format_ctx, nullptr),
         "Invalid input stream information" );
-    av_dump_format(format_ctx, index, format_ctx->filename, 0);
+  }
+  // Describes the first video stream. Call after find_stream_info.
+  video_info get_video_info() const {
+    video_info info;
+    if (format_ctx->duration != AV_NOPTS_VALUE) {
+      info.duration_seconds = format_ctx->duration / double(AV_TIME_BASE);
+    }
+    for (size_t i = 0; i < format_ctx->nb_streams; i++) {
+      AVStream *stream = format_ctx->streams[i];
+      if (stream->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+        char description[256];
+        avcodec_string(description, sizeof(description), stream->codec, 0);
+        // "Video: <codec>, <pixel format>, ..."
+        std::string codec = description;
+        size_t begin = codec.find(": ");
+        begin = begin == std::string::npos ? 0 : begin + 2;
+        info.stream = codec.substr(begin, codec.find(", ", begin) - begin);
+        if (stream->avg_frame_rate.den != 0) {
+          info.fps = av_q2d(stream->avg_frame_rate);
+        }
+        break;
+      }
+    }
+    return info;
+  }
+
+  struct keyframe {
+    int64_t packet;  // Index among the video packets of the file.
+    int64_t pos;     // Byte offset of the packet in the file.
+  };
+  // Demux, without decoding, the rest of the file. Returns the video keyframes.
+  std::vector<keyframe> find_keyframes() {
+    std::vector<keyframe> keyframes;
+    AVPacket packet;
+    for (int64_t video_packet = 0;
+         !av_check( av_read_frame(format_ctx, &packet), AVERROR_EOF, "Failed to read frame" ); ) {
+      AVCodecContext *codec = format_ctx->streams[packet.stream_index]->codec;
+      if (codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+        if ((packet.flags & AV_PKT_FLAG_KEY) && packet.pos >= 0) {
+          keyframes.push_back({video_packet, packet.pos});
+        }
+        video_packet++;
+      }
+      av_packet_unref(&packet);
+    }
+    return keyframes;
+  }
+
+  // Decode with n of ffmpeg's frame threads rather than one. The hooks then
+  // only record on ffmpeg's threads, and the driver sees each frame's slices
+  // replayed in bitstream order once the frame is done (see recorded_slice).
+  // That needs a driver whose cabac_decoder can take bins already decoded.
+  void set_decode_threads(int n) {
+    if (n > 1 && !Driver::replays_decoded_bins) {
+      throw std::invalid_argument("This driver can't decode on ffmpeg's threads.");
+    }
+    decode_threads = std::max(1, n);
   }
 
-  // Decode all video frames in the file in single-threaded mode, calling the driver's hooks.
-  void decode_video() {
+  // Decode all video frames in the file, calling the driver's hooks.
+  // Only video packets in [first_packet, end_packet) are decoded, so a segment
+  // must start at a keyframe.
+  void decode_video(int64_t first_packet = 0,
+                    int64_t end_packet = std::numeric_limits<int64_t>::max()) {
     //auto frame = av_unique_ptr(av_frame_alloc(), av_frame_free);
     auto frame = std::unique_ptr<AVFrame, std::function<void(AVFrame*)>>(av_frame_alloc(), [](AVFrame* toDelete) {av_frame_free(&toDelete);});
     AVPacket packet;
     // TODO(ctl) add better diagnostics to error results.
-    while (!av_check( av_read_frame(format_ctx, &packet), AVERROR_EOF, "Failed to read frame" )) {
+    int64_t video_packet = 0;
+    AVCodecContext *threaded_codec = nullptr;
+    while (!read_frame(&packet)) {
       AVCodecContext *codec = format_ctx->streams[packet.stream_index]->codec;
-      if (codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+      if (codec->codec_type == AVMEDIA_TYPE_VIDEO && video_packet++ >= first_packet) {
+        if (video_packet > end_packet) {
+          av_packet_unref(&packet);
+          break;
+        }
         if (!avcodec_is_open(codec)) {
-          codec->thread_count = 1;
-          codec->hooks = &hooks;
+          if (decode_threads > 1) {
+            codec->thread_count = decode_threads;
+            codec->thread_type = FF_THREAD_FRAME;
+            // get_buffer2 runs on the thread decoding the frame.
+            codec->thread_safe_callbacks = 1;
+            codec->get_buffer2 = get_buffer;
+            codec->opaque = this;
+            codec->hooks = &recording_hooks;
+            threaded_codec = codec;
+          } else {
+            codec->thread_count = 1;
+            codec->hooks = &hooks;
+          }
           av_check( avcodec_open2(codec, avcodec_find_decoder(codec->codec_id), nullptr),
             "Failed to open decoder for stream " + std::to_string(packet.stream_index) );
         }
 
         int got_frame = 0;
-        av_check( avcodec_decode_video2(codec, frame.get(), &got_frame, &packet),
-            "Failed to decode video frame" );
+        {
+          PROFILE_STAGE(DECODE);
+          codec->reordered_opaque = video_packet - 1;
+          av_check( avcodec_decode_video2(codec, frame.get(), &got_frame, &packet),
+              "Failed to decode video frame" );
+        }
+        if (codec == threaded_codec) {
+          // Frame threading returns each frame thread_count - 1 packets late,
+          // and only once its thread has finished.
+          int delay = (codec->active_thread_type & FF_THREAD_FRAME) ? codec->thread_count - 1 : 0;
+          replay_recorded(video_packet - 1 - delay);
+        }
       }
       av_packet_unref(&packet);
     }
+    if (threaded_codec) {
+      // Drain the frame threads, then replay what's left.
+      AVPacket drain;
+      av_init_packet(&drain);
+      drain.data = nullptr;
+      drain.size = 0;
+      int got_frame = 1;
+      while (got_frame) {
+        PROFILE_STAGE(DECODE);
+        av_check( avcodec_decode_video2(threaded_codec, frame.get(), &got_frame, &drain),
+            "Failed to decode video frame" );
+      }
+      replay_recorded(std::numeric_limits<int64_t>::max());
+      cabac_contexts.clear();
+    }
   }
 
  private:
+  // Returns true at the end of the file.
+  bool read_frame(AVPacket *packet) {
+    PROFILE_STAGE(DEMUX);
+    return av_check( av_read_frame(format_ctx, packet), AVERROR_EOF, "Failed to read frame" );
+  }
+
   // Hook stubs - wrap driver into opaque pointers.
   static int read_packet(void *opaque, uint8_t *buffer_out, int size) {
     av_decoder *self = static_cast<av_decoder*>(opaque);
@@ -148,6 +460,7 @@ class av_decoder {
   }
   struct cabac {
     static void* init_decoder(void *opaque, CABACContext *ctx, const uint8_t *buf, int size) {
+      PROFILE_STAGE(SLICE);
       av_decoder *self = static_cast<av_decoder*>(opaque);
       auto *cabac_decoder = new typename Driver::cabac_decoder(self->driver, ctx, buf, size);
       self->cabac_contexts[ctx].reset(cabac_decoder);
@@ -155,14 +468,17 @@ class av_decoder {
     }
     static int get(void *opaque, uint8_t *state) {
       auto *self = static_cast<typename Driver::cabac_decoder*>(opaque);
+      PROFILE_BIN(self->coding_type());
       return self->get(state);
     }
     static int get_bypass(void *opaque) {
       auto *self = static_cast<typename Driver::cabac_decoder*>(opaque);
+      PROFILE_BIN(self->coding_type());
       return self->get_bypass();
     }
     static int get_terminate(void *opaque) {
       auto *self = static_cast<typename Driver::cabac_decoder*>(opaque);
+      PROFILE_BIN(self->coding_type());
       return self->get_terminate();
     }
     static const uint8_t* skip_bytes(void *opaque, int n) {
@@ -211,10 +527,270 @@ class av_decoder {
       auto &cabac_contexts = static_cast<av_decoder*>(opaque)->cabac_contexts;
       assert(cabac_contexts.size() == 1);
       typename Driver::cabac_decoder*self = cabac_contexts.begin()->second.get();
+      // Queued significance bins are coded here.
+      PROFILE_CODING_TYPE(ct);
       self->end_coding_type(ct);
     }
   };
+
+  // With frame threads, each slice's hook calls are recorded on the thread
+  // decoding it, bins coded as CABAC decodes them, and replayed through the
+  // driver from decode_video once ffmpeg is done with the frame. Frames are
+  // ordered by the video packet index that decode_video passes as
+  // reordered_opaque, which get_buffer2 sees for each new frame; slices within
+  // a frame are decoded by one thread, in order.
+  enum recorded_call_kind {
+    CALL_INIT, CALL_GET, CALL_BYPASS, CALL_TERMINATE,
+    CALL_FRAME_SPEC, CALL_MB_XY, CALL_BEGIN_SUB_MB, CALL_END_SUB_MB,
+    CALL_BEGIN_CODING_TYPE, CALL_END_CODING_TYPE,
+  };
+  struct recorded_slice {
+    int64_t packet = -1;  // The frame's video packet index.
+    uint64_t serial = 0;  // Order of init_decoder calls.
+    // A copy of the CABACContext given to init_decoder, followed by CABAC
+    // states as in H264SliceContext, so that replayed bins have the same
+    // offsets from cabac_state_array.
+    struct {
+      CABACContext cabac;
+      uint8_t cabac_state[estimator_slots::CABAC_STATE_SLOTS];
+    } context;
+    std::vector<uint8_t> data;  // The slice data given to init_decoder.
+    // Each call is (value << 4) | recorded_call_kind, then any arguments.
+    // Calls before CALL_INIT were made between the previous slice and this one.
+    std::vector<int32_t> calls;
+    bool started = false;
+
+    void record(recorded_call_kind kind, int32_t value = 0) {
+      calls.push_back((value << 4) | kind);
+    }
+  };
+  // What one of ffmpeg's threads is recording.
+  struct recording_thread {
+    av_decoder *decoder;
+    int64_t packet = -1;  // Of the frame being decoded, from get_buffer2.
+    std::unique_ptr<recorded_slice> slice{new recorded_slice};
+    CABACContext cabac;  // Decodes the bins of the slice.
+    const uint8_t *cabac_state = nullptr;
+  };
+
+  recording_thread *current_recording_thread() {
+    thread_local std::pair<uint64_t, recording_thread*> cached = {0, nullptr};
+    if (cached.first != recorder_id) {
+      std::lock_guard<std::mutex> lock(recording_mutex);
+      std::unique_ptr<recording_thread>& thread = recording_threads[std::this_thread::get_id()];
+      if (!thread) {
+        thread.reset(new recording_thread);
+        thread->decoder = this;
+      }
+      cached = {recorder_id, thread.get()};
+    }
+    return cached.second;
+  }
+  // Hooks can't throw on ffmpeg's threads; replay_recorded throws instead.
+  void recording_failed(const std::string& error) {
+    std::lock_guard<std::mutex> lock(recording_mutex);
+    if (recording_error.empty()) {
+      recording_error = error;
+    }
+  }
+  void finish_recorded_slice(recording_thread *thread) {
+    std::lock_guard<std::mutex> lock(recording_mutex);
+    recorded_slices.push_back(std::move(thread->slice));
+    thread->slice.reset(new recorded_slice);
+  }
+
+  static int get_buffer(AVCodecContext *codec, AVFrame *frame, int flags) {
+    av_decoder *self = static_cast<av_decoder*>(codec->opaque);
+    self->current_recording_thread()->packet = frame->reordered_opaque;
+    return avcodec_default_get_buffer2(codec, frame, flags);
+  }
+
+  struct recording {
+    static void* init_decoder(void *opaque, CABACContext *ctx, const uint8_t *buf, int size) {
+      av_decoder *self = static_cast<av_decoder*>(opaque);
+      recording_thread *thread = self->current_recording_thread();
+      if (thread->slice->started) {
+        // The previous slice didn't end with a terminate bin.
+        self->finish_recorded_slice(thread);
+      }
+      recorded_slice *slice = thread->slice.get();
+      slice->started = true;
+      slice->packet = thread->packet;
+      slice->serial = self->next_slice_serial++;
+      slice->context.cabac = *ctx;
+      slice->data.assign(buf, buf + size);
+      slice->record(CALL_INIT);
+
+      thread->cabac = *ctx;
+      thread->cabac.coding_hooks = nullptr;
+      thread->cabac.coding_hooks_opaque = nullptr;
+      ::ff_reset_cabac_decoder(&thread->cabac, buf, size);
+      thread->cabac_state = cabac_state_array(ctx);
+      return thread;
+    }
+    static int get(void *opaque, uint8_t *state) {
+      auto *thread = static_cast<recording_thread*>(opaque);
+      int symbol = ::ff_get_cabac(&thread->cabac, state);
+      uintptr_t offset = uintptr_t(state) - uintptr_t(thread->cabac_state);
+      if (offset >= estimator_slots::CABAC_STATE_SLOTS) {
+        thread->decoder->recording_failed("CABAC state outside the slice's states; decode on one thread.");
+      }
+      thread->slice->record(CALL_GET, int32_t(offset << 1) | symbol);
+      return symbol;
+    }
+    static int get_bypass(void *opaque) {
+      auto *thread = static_cast<recording_thread*>(opaque);
+      int symbol = ::ff_get_cabac_bypass(&thread->cabac);
+      thread->slice->record(CALL_BYPASS, symbol);
+      return symbol;
+    }
+    static int get_terminate(void *opaque) {
+      auto *thread = static_cast<recording_thread*>(opaque);
+      int symbol = ::ff_get_cabac_terminate(&thread->cabac) != 0;
+      thread->slice->record(CALL_TERMINATE, symbol);
+      if (symbol) {
+        thread->decoder->finish_recorded_slice(thread);
+      }
+      return symbol;
+    }
+    static const uint8_t* skip_bytes(void *opaque, int n) {
+      auto *thread = static_cast<recording_thread*>(opaque);
+      thread->decoder->recording_failed("Not implemented: CABAC decoder doesn't use skip_bytes.");
+      return nullptr;
+    }
+
+    static void frame_spec(void *opaque, int frame_num, int mb_width, int mb_height) {
+      recorded_slice *slice = static_cast<av_decoder*>(opaque)->current_recording_thread()->slice.get();
+      slice->record(CALL_FRAME_SPEC);
+      slice->calls.insert(slice->calls.end(), {frame_num, mb_width, mb_height});
+    }
+    static void mb_xy(void *opaque, int x, int y) {
+      recorded_slice *slice = static_cast<av_decoder*>(opaque)->current_recording_thread()->slice.get();
+      slice->record(CALL_MB_XY);
+      slice->calls.insert(slice->calls.end(), {x, y});
+    }
+    static void begin_sub_mb(void *opaque, int cat, int scan8index, int max_coeff, int is_dc, int chroma422) {
+      recorded_slice *slice = static_cast<av_decoder*>(opaque)->current_recording_thread()->slice.get();
+      slice->record(CALL_BEGIN_SUB_MB);
+      slice->calls.insert(slice->calls.end(), {cat, scan8index, max_coeff, is_dc, chroma422});
+    }
+    static void end_sub_mb(void *opaque, int cat, int scan8index, int max_coeff, int is_dc, int chroma422) {
+      recorded_slice *slice = static_cast<av_decoder*>(opaque)->current_recording_thread()->slice.get();
+      slice->record(CALL_END_SUB_MB);
+      slice->calls.insert(slice->calls.end(), {cat, scan8index, max_coeff, is_dc, chroma422});
+    }
+    static void begin_coding_type(void *opaque, CodingType ct, int zigzag_index, int param0, int param1) {
+      recorded_slice *slice = static_cast<av_decoder*>(opaque)->current_recording_thread()->slice.get();
+      slice->record(CALL_BEGIN_CODING_TYPE, ct);
+      slice->calls.insert(slice->calls.end(), {zigzag_index, param0, param1});
+    }
+    static void end_coding_type(void *opaque, CodingType ct) {
+      static_cast<av_decoder*>(opaque)->current_recording_thread()->slice->record(CALL_END_CODING_TYPE, ct);
+    }
+  };
+
+  // Replays the recorded slices of the frames of packets up to last_packet,
+  // in order. Once ffmpeg has returned a frame, it has no more slices.
+  void replay_recorded(int64_t last_packet) {
+    std::vector<std::unique_ptr<recorded_slice>> ready;
+    {
+      std::lock_guard<std::mutex> lock(recording_mutex);
+      if (!recording_error.empty()) {
+        throw std::runtime_error(recording_error);
+      }
+      if (last_packet == std::numeric_limits<int64_t>::max()) {
+        // Everything is decoded, so slices still open won't be finished.
+        for (auto& thread : recording_threads) {
+          if (thread.second->slice->started) {
+            recorded_slices.push_back(std::move(thread.second->slice));
+            thread.second->slice.reset(new recorded_slice);
+          }
+        }
+      }
+      for (auto& slice : recorded_slices) {
+        if (slice->packet <= last_packet) {
+          ready.push_back(std::move(slice));
+        }
+      }
+      recorded_slices.erase(std::remove(recorded_slices.begin(), recorded_slices.end(), nullptr),
+                            recorded_slices.end());
+    }
+    std::sort(ready.begin(), ready.end(), [](const std::unique_ptr<recorded_slice>& a,
+                                             const std::unique_ptr<recorded_slice>& b) {
+      return std::tie(a->packet, a->serial) < std::tie(b->packet, b->serial);
+    });
+    for (auto& slice : ready) {
+      if (slice->packet < 0 || slice->packet <= replayed_through) {
+        // A frame without a get_buffer2 call of its own (e.g. a second field
+        // in a packet of its own) is taken for an earlier one.
+        throw std::runtime_error("Can't order the slices of this stream; decode on one thread.");
+      }
+      replay(slice.get());
+      replayed_slice = std::move(slice);
+    }
+    replayed_through = std::max(replayed_through, last_packet);
+  }
+
+  void replay(recorded_slice *slice) {
+    if constexpr (Driver::replays_decoded_bins) {
+      typename Driver::cabac_decoder *decoder = nullptr;
+      bool coding = false;
+      const std::vector<int32_t>& calls = slice->calls;
+      for (size_t i = 0; i < calls.size(); ) {
+        int kind = calls[i] & 0xf;
+        int32_t value = calls[i] >> 4;
+        const int32_t *args = &calls[i + 1];
+        switch (kind) {
+          case CALL_INIT:
+            // As when the hooks are called directly: one decoder at a time,
+            // which may turn the hooks off for its slice.
+            cabac_contexts.clear();
+            slice->context.cabac.coding_hooks = &hooks;
+            decoder = static_cast<typename Driver::cabac_decoder*>(cabac::init_decoder(
+                this, &slice->context.cabac, slice->data.data(), slice->data.size()));
+            coding = slice->context.cabac.coding_hooks != nullptr;
+            break;
+          case CALL_GET:
+            if (coding) decoder->put(value & 1, &slice->context.cabac_state[value >> 1]);
+            break;
+          case CALL_BYPASS:
+            if (coding) decoder->put_bypass(value);
+            break;
+          case CALL_TERMINATE:
+            if (coding) decoder->put_terminate(value);
+            break;
+          case CALL_FRAME_SPEC:
+            model_hooks::frame_spec(this, args[0], args[1], args[2]);
+            i += 3;
+            break;
+          case CALL_MB_XY:
+            model_hooks::mb_xy(this, args[0], args[1]);
+            i += 2;
+            break;
+          case CALL_BEGIN_SUB_MB:
+            model_hooks::begin_sub_mb(this, args[0], args[1], args[2], args[3], args[4]);
+            i += 5;
+            break;
+          case CALL_END_SUB_MB:
+            model_hooks::end_sub_mb(this, args[0], args[1], args[2], args[3], args[4]);
+            i += 5;
+            break;
+          case CALL_BEGIN_CODING_TYPE:
+            model_hooks::begin_coding_type(this, CodingType(value), args[0], args[1], args[2]);
+            i += 3;
+            break;
+          case CALL_END_CODING_TYPE:
+            model_hooks::end_coding_type(this, CodingType(value));
+            break;
+        }
+        i++;
+      }
+    }
+  }
+
   Driver *driver;
+  av_io_buffer own_io;
+  av_io_buffer *io;
   AVFormatContext *format_ctx;
   AVCodecHooks hooks = { this, {
       cabac::init_decoder,
@@ -234,6 +810,38 @@ class av_decoder {
     },
   };
   std::map<CABACContext*, std::unique_ptr<typename Driver::cabac_decoder>> cabac_contexts;
+
+  int decode_threads = 1;
+  AVCodecHooks recording_hooks = { this, {
+      recording::init_decoder,
+      recording::get,
+      recording::get_bypass,
+      recording::get_terminate,
+      recording::skip_bytes,
+    },
+    {
+      recording::frame_spec,
+      recording::mb_xy,
+      recording::begin_sub_mb,
+      recording::end_sub_mb,
+      recording::begin_coding_type,
+      recording::end_coding_type,
+    },
+  };
+  // Tells this decoder's recording threads apart from an earlier decoder's
+  // at the same address.
+  static inline std::atomic<uint64_t> next_recorder_id{1};
+  const uint64_t recorder_id = next_recorder_id++;
+  std::atomic<uint64_t> next_slice_serial{0};
+  std::mutex recording_mutex;
+  std::map<std::thread::id, std::unique_ptr<recording_thread>> recording_threads;
+  std::vector<std::unique_ptr<recorded_slice>> recorded_slices;
+  std::string recording_error;
+  // Packets whose frames have been replayed: no more slices can follow.
+  int64_t replayed_through = -1;
+  // Kept until the next slice is replayed, since the driver's model keeps
+  // pointers into it.
+  std::unique_ptr<recorded_slice> replayed_slice;
 };
 
 
@@ -321,8 +929,69 @@ constexpr r_scan8 reverse_scan_8[15][8] = {
 // Encoder / decoder for recoded CABAC blocks.
 typedef uint64_t range_t;
 typedef arithmetic_code<range_t, uint8_t> recoded_code;
+// With 32-bit digits: renormalizes less often, and the decoder loads a word
+// at a time. Metadata::coder_version 1.
+typedef arithmetic_code<range_t, uint32_t> wide_recoded_code;
+
+constexpr uint32_t NARROW_CODER_VERSION = 0;
+constexpr uint32_t WIDE_CODER_VERSION = 1;
+
+// The recoded coder in the digit size of the file, chosen once per block.
+template <typename OutputIterator>
+class recoded_encoder {
+ public:
+  recoded_encoder(OutputIterator out, bool wide) {
+    if (wide) {
+      coder.template emplace<2>(out);
+    } else {
+      coder.template emplace<1>(out);
+    }
+  }
+  template <typename ProbabilityFunction>
+  size_t put(int symbol, const ProbabilityFunction& probability_of_1) {
+    if (auto *wide = std::get_if<2>(&coder)) {
+      return wide->put(symbol, probability_of_1);
+    }
+    return std::get_if<1>(&coder)->put(symbol, probability_of_1);
+  }
+  void finish() {
+    if (auto *wide = std::get_if<2>(&coder)) {
+      wide->finish();
+    } else {
+      std::get_if<1>(&coder)->finish();
+    }
+  }
+
+ private:
+  // Built in place: a moved-from encoder would still finish into `out`.
+  std::variant<std::monostate,
+               recoded_code::encoder<OutputIterator, uint8_t>,
+               wide_recoded_code::encoder<OutputIterator, uint8_t>> coder;
+};
+
+class recoded_decoder {
+ public:
+  recoded_decoder(const uint8_t *begin, const uint8_t *end, bool wide) {
+    if (wide) {
+      coder.emplace<2>(begin, end);
+    } else {
+      coder.emplace<1>(begin, end);
+    }
+  }
+  template <typename ProbabilityFunction>
+  int get(const ProbabilityFunction& probability_of_1) {
+    if (auto *wide = std::get_if<2>(&coder)) {
+      return wide->get(probability_of_1);
+    }
+    return std::get_if<1>(&coder)->get(probability_of_1);
+  }
+
+ private:
+  std::variant<std::monostate,
+               recoded_code::decoder<const uint8_t*, uint8_t>,
+               wide_recoded_code::decoder<const uint8_t*, uint8_t>> coder;
+};
 
-typedef std::tuple<const void*, int, int> model_key;
 /*
 not sure these tables are the ones we want to use
 constexpr uint8_t unzigzag16[16] = {
@@ -423,7 +1092,7 @@ struct CoefficientCoord {
     int zigzag_index;
 };
 
-bool get_neighbor_sub_mb(bool above, int sub_mb_size,
+constexpr bool get_neighbor_sub_mb(bool above, int sub_mb_size,
                   CoefficientCoord input,
                   CoefficientCoord *output) {
     int mb_x = input.mb_x;
@@ -484,7 +1153,7 @@ int log2(int y) {
     }
     return x;
 }
-bool get_neighbor(bool above, int sub_mb_size,
+constexpr bool get_neighbor(bool above, int sub_mb_size,
                   CoefficientCoord input,
                   CoefficientCoord *output) {
     int mb_x = input.mb_x;
@@ -575,7 +1244,7 @@ bool get_neighbor(bool above, int sub_mb_size,
     return true;
 }
 
-bool get_neighbor_coefficient(bool above,
+constexpr bool get_neighbor_coefficient(bool above,
                               int sub_mb_size,
                               CoefficientCoord input,
                               CoefficientCoord *output) {
@@ -619,11 +1288,170 @@ bool get_neighbor_coefficient(bool above,
     output->zigzag_index = raster_to_zigzag[raster_coord] - zigzag_addition;
     return true;
 }
+
+// The neighbors above and left of every coefficient, precomputed from the
+// functions above. A step is relative to the current macroblock; whether the
+// neighboring macroblock exists is checked on lookup.
+struct neighbor_step {
+    int8_t dx;
+    int8_t dy;
+    uint8_t scan8_index;  // NO_NEIGHBOR if there is none inside the frame.
+    int8_t zigzag_index;  // -1 for the DC of an AC block.
+};
+constexpr uint8_t NO_NEIGHBOR = 0xff;
+constexpr int NEIGHBOR_SCAN8 = sizeof(scan_8) / sizeof(scan_8[0]);
+// The sub_mb_size of each table, and how many zigzag indices it covers.
+constexpr int NEIGHBOR_SIZES[4] = {4, 15, 16, 64};
+
+constexpr int neighbor_size_class(int sub_mb_size) {
+    for (int i = 0; i < 4; ++i) {
+        if (NEIGHBOR_SIZES[i] == sub_mb_size) {
+            return i;
+        }
+    }
+    return -1;
+}
+// DC blocks are only defined for 2x2 and 4x4.
+constexpr bool neighbor_tabulated(int size_class, int scan8_index, int zigzag_index) {
+    return size_class >= 0 && zigzag_index >= 0 && zigzag_index < NEIGHBOR_SIZES[size_class]
+        && scan8_index >= 0 && scan8_index < NEIGHBOR_SCAN8
+        && (scan8_index < 16 * 3 || NEIGHBOR_SIZES[size_class] == 4 || NEIGHBOR_SIZES[size_class] == 16);
+}
+
+template <bool Coefficient>
+struct neighbor_table {
+    neighbor_step steps[2][4][NEIGHBOR_SCAN8][64];
+    constexpr neighbor_table() : steps() {
+        for (int above = 0; above < 2; ++above) {
+            for (int size_class = 0; size_class < 4; ++size_class) {
+                for (int scan8_index = 0; scan8_index < NEIGHBOR_SCAN8; ++scan8_index) {
+                    for (int zigzag_index = 0; zigzag_index < 64; ++zigzag_index) {
+                        neighbor_step &step = steps[above][size_class][scan8_index][zigzag_index];
+                        step = {0, 0, NO_NEIGHBOR, 0};
+                        if (!neighbor_tabulated(size_class, scan8_index, zigzag_index)) {
+                            continue;
+                        }
+                        // From macroblock (1, 1) every neighboring macroblock exists.
+                        CoefficientCoord input = {1, 1, scan8_index, zigzag_index};
+                        CoefficientCoord output = {0, 0, 0, 0};
+                        bool found = Coefficient
+                            ? get_neighbor_coefficient(above, NEIGHBOR_SIZES[size_class], input, &output)
+                            : get_neighbor(above, NEIGHBOR_SIZES[size_class], input, &output);
+                        if (found) {
+                            step = {int8_t(output.mb_x - 1), int8_t(output.mb_y - 1),
+                                    uint8_t(output.scan8_index), int8_t(output.zigzag_index)};
+                        }
+                    }
+                }
+            }
+        }
+    }
+};
+constexpr neighbor_table<false> block_neighbors;
+constexpr neighbor_table<true> coefficient_neighbors;
+
+// Same as get_neighbor (or get_neighbor_coefficient, if coefficient is set),
+// using the tables for all the sizes they cover.
+inline bool lookup_neighbor(bool coefficient, bool above, int sub_mb_size,
+                            CoefficientCoord input, CoefficientCoord *output) {
+    int size_class = neighbor_size_class(sub_mb_size);
+    if (!neighbor_tabulated(size_class, input.scan8_index, input.zigzag_index)) {
+        return coefficient ? get_neighbor_coefficient(above, sub_mb_size, input, output)
+                           : get_neighbor(above, sub_mb_size, input, output);
+    }
+    const neighbor_step &step = (coefficient ? coefficient_neighbors.steps : block_neighbors.steps)
+        [above][size_class][input.scan8_index][input.zigzag_index];
+    if (step.scan8_index == NO_NEIGHBOR || input.mb_x + step.dx < 0 || input.mb_y + step.dy < 0) {
+        return false;
+    }
+    *output = {input.mb_x + step.dx, input.mb_y + step.dy, step.scan8_index, step.zigzag_index};
+    return true;
+}
+
+int test_neighbor_tables() {
+    for (int coefficient = 0; coefficient < 2; ++coefficient) {
+        for (int above = 0; above < 2; ++above) {
+            for (int size_class = 0; size_class < 4; ++size_class) {
+                for (int scan8_index = 0; scan8_index < NEIGHBOR_SCAN8; ++scan8_index) {
+                    for (int zigzag_index = 0; zigzag_index < NEIGHBOR_SIZES[size_class]; ++zigzag_index) {
+                        if (!neighbor_tabulated(size_class, scan8_index, zigzag_index)) {
+                            continue;
+                        }
+                        for (int mb = 0; mb < 4; ++mb) {
+                            CoefficientCoord input = {mb & 1, mb >> 1, scan8_index, zigzag_index};
+                            CoefficientCoord expected = {-1, -1, -1, -1}, actual = {-1, -1, -1, -1};
+                            int sub_mb_size = NEIGHBOR_SIZES[size_class];
+                            bool found = coefficient
+                                ? get_neighbor_coefficient(above, sub_mb_size, input, &expected)
+                                : get_neighbor(above, sub_mb_size, input, &expected);
+                            bool looked_up = lookup_neighbor(coefficient, above, sub_mb_size, input, &actual);
+                            assert(found == looked_up);
+                            if (found != looked_up || (found && (
+                                    expected.mb_x != actual.mb_x || expected.mb_y != actual.mb_y ||
+                                    expected.scan8_index != actual.scan8_index ||
+                                    expected.zigzag_index != actual.zigzag_index))) {
+                                assert(false && "neighbor table mismatch");
+                                return 1;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+int make_sure_neighbor_tables = test_neighbor_tables();
 #define STRINGIFY_COMMA(s) #s ,
 const char * billing_names [] = {EACH_PIP_CODING_TYPE(STRINGIFY_COMMA)};
 #undef STRINGIFY_COMMA
-class h264_model {
+
+// The estimator policy of the recoder (estimators.h). The default codes the
+// same files as count_estimator without its division; build with e.g.
+// -DAVRECODE_ESTIMATOR=shift_estimator to trade compression for speed.
+#ifndef AVRECODE_ESTIMATOR
+#define AVRECODE_ESTIMATOR reciprocal_count_estimator
+#endif
+// Build with -DAVRECODE_MIXING=1 to code the significance map with a mix of
+// several estimators' predictions (mixer.h): smaller files, more CPU.
+#ifndef AVRECODE_MIXING
+#define AVRECODE_MIXING 0
+#endif
+
+// How a sub-block's zigzag indices map to significance contexts, fixed for
+// the whole sub-block: the model's significance map key is specialized for
+// each, and the one a sub-block needs is chosen in begin_coding_type.
+enum significance_layout {
+  SIGNIFICANCE_4X4,          // One context per coefficient.
+  SIGNIFICANCE_8X8,          // Shared by the coefficients of 8x8 blocks.
+  SIGNIFICANCE_CHROMA422_DC, // 4:2:2 chroma DC.
+};
+constexpr uint8_t significance_offset_8x8[2][63] = {
+    { 0, 1, 2, 3, 4, 5, 5, 4, 4, 3, 3, 4, 4, 4, 5, 5,
+      4, 4, 4, 4, 3, 3, 6, 7, 7, 7, 8, 9,10, 9, 8, 7,
+      7, 6,11,12,13,11, 6, 7, 8, 9,14,10, 9, 8, 6,11,
+      12,13,11, 6, 9,14,10, 9,11,12,13,11,14,10,12 },
+    { 0, 1, 1, 2, 2, 3, 3, 4, 5, 6, 7, 7, 7, 8, 4, 5,
+      6, 9,10,10, 8,11,12,11, 9, 9,10,10, 8,11,12,11,
+      9, 9,10,10, 8,11,12,11, 9, 9,10,10, 8,13,13, 9,
+      9,10,10, 8,13,13, 9, 9,10,10,14,14,14,14,14 }
+};
+constexpr uint8_t significance_offset_chroma422_dc[7] = { 0, 0, 1, 1, 2, 2, 2 };
+// The first significance context of each sub_mb_cat.
+constexpr int significance_cat_offset[14] = {
+    105+0, 105+15, 105+29, 105+44, 105+47, 402, 484+0, 484+15, 484+29, 660, 528+0, 528+15, 528+29, 718 };
+// A significance map bin queued by the compressor, with the tracking state
+// it was seen in.
+struct significance_bin {
+  uint8_t symbol, zigzag_index, nonzeros_observed;
+};
+
+template <typename Estimator, bool Mixing = false>
+class basic_h264_model {
   public:
+  typedef Estimator estimator_policy;
+  static constexpr bool mixing = Mixing;
+  typedef estimator_prior<Estimator> prior_type;
   CodingType coding_type = PIP_UNKNOWN;
   size_t bill[sizeof(billing_names)/sizeof(billing_names[0])];
   size_t cabac_bill[sizeof(billing_names)/sizeof(billing_names[0])];
@@ -632,14 +1460,17 @@ class h264_model {
   uint8_t STATE_FOR_NUM_NONZERO_BIT[6];
   bool do_print;
  public:
-  h264_model() { reset(); do_print = false; memset(bill, 0, sizeof(bill)); memset(cabac_bill, 0, sizeof(cabac_bill));}
+  basic_h264_model() { reset(); do_print = false; memset(bill, 0, sizeof(bill)); memset(cabac_bill, 0, sizeof(cabac_bill));}
   void enable_debug() {
     do_print = true;
   }
   void disable_debug() {
     do_print = false;
   }
-  ~h264_model() {
+  ~basic_h264_model() {
+      print_bills();
+  }
+  void print_bills() const {
       bool first = true;
       for (size_t i = 0; i < sizeof(billing_names)/sizeof(billing_names[i]); ++i) {
           if (bill[i]) {
@@ -666,10 +1497,120 @@ class h264_model {
   void billable_cabac_bytes(size_t num_bytes_emitted) {
       cabac_bill[coding_type] += num_bytes_emitted;
   }
+  // Move another model's bills into this one, e.g. from a segment worker.
+  void absorb_bill(basic_h264_model *other) {
+      for (size_t i = 0; i < sizeof(billing_names)/sizeof(billing_names[i]); ++i) {
+          bill[i] += other->bill[i];
+          cabac_bill[i] += other->cabac_bill[i];
+      }
+      memset(other->bill, 0, sizeof(other->bill));
+      memset(other->cabac_bill, 0, sizeof(other->cabac_bill));
+  }
   void reset() {
       // reset should do nothing as we wish to remember what we've learned
     memset(STATE_FOR_NUM_NONZERO_BIT, 0, sizeof(STATE_FOR_NUM_NONZERO_BIT));
   }
+  // Forget everything learned so far, at the start of an independently coded
+  // segment. The estimators and both frames end up as in a new model.
+  void reset_segment() {
+    reset();
+    estimators.clear();
+    mixer.reset();
+    for (FrameBuffer &frame : frames) {
+      if (frame.width() && frame.height()) {
+        frame.bzero();
+      }
+    }
+  }
+  // Start over for another file, as a new model but keeping the allocations
+  // of the estimators and frames. The bills of the last file are printed.
+  void reset_file() {
+    print_bills();
+    memset(bill, 0, sizeof(bill));
+    memset(cabac_bill, 0, sizeof(cabac_bill));
+    reset();
+    estimators.clear();
+    mixer.reset();
+    for (FrameBuffer &frame : frames) {
+      frame.forget();
+    }
+    cur_frame = 0;
+    coding_type = PIP_UNKNOWN;
+    mb_coord = CoefficientCoord();
+    nonzeros_observed = 0;
+    sub_mb_cat = -1;
+    sub_mb_size = -1;
+    sub_mb_is_dc = 0;
+    sub_mb_chroma422 = 0;
+    cabac_state_base = nullptr;
+    trace = nullptr;
+    set_prior(nullptr);
+    slot_counts.clear();
+    counting = false;
+  }
+  // Give back the storage of the frames and estimators, keeping the bills:
+  // e.g. a segment worker's once its segment is done. The model can go on
+  // as after reset_segment().
+  void release_storage() {
+    reset();
+    estimators.release();
+    mixer.reset();
+    for (FrameBuffer &frame : frames) {
+      frame.release();
+    }
+  }
+  // Allocate no more estimators than there are now, until the next
+  // reset_segment() (estimator_table.h). Returns the slot limit, which the
+  // decompressor has to set at the same bin.
+  uint32_t cap_estimators() {
+    estimators.set_slot_limit(estimators.size());
+    return uint32_t(estimators.slot_limit());
+  }
+  void set_estimator_limit(uint32_t slots) {
+    estimators.set_slot_limit(slots);
+  }
+  bool estimators_capped() const {
+    return estimators.slot_limit() != 0;
+  }
+  // Start the estimators from a prior (or new ones, if null), from now on.
+  void set_prior(const prior_type *prior) {
+    this->prior = prior;
+    estimators.set_initial_states(prior ? prior->fixed_states() : nullptr);
+  }
+  // Count the symbols coded with each estimator, for training a prior.
+  void count_symbols() {
+    counting = true;
+  }
+  // Adds the counts to those of a corpus, by prior key.
+  void add_symbol_counts(prior_counts *counts) const {
+    for (uint32_t slot = 0; slot < estimator_slots::DYNAMIC_BASE && slot < slot_counts.size(); slot++) {
+      counts->fixed[slot][0] += slot_counts[slot][0];
+      counts->fixed[slot][1] += slot_counts[slot][1];
+    }
+    estimators.for_each_dynamic_key([&](const void *context, int param1, int param2, uint32_t slot) {
+      int id = context_id(context);
+      if (id >= 0 && slot < slot_counts.size()) {
+        symbol_counts& c = counts->dynamic[{id, param1, param2}];
+        c[0] += slot_counts[slot][0];
+        c[1] += slot_counts[slot][1];
+      }
+    });
+  }
+  // Identifies the contexts of dynamic keys from one run to the next, where
+  // their addresses differ: -1 for those a prior can't hold.
+  int context_id(const void *context) const {
+    if (context == &significance_context) {
+      return 0;
+    }
+    const uint8_t *bit = static_cast<const uint8_t*>(context);
+    if (bit >= STATE_FOR_NUM_NONZERO_BIT && bit < STATE_FOR_NUM_NONZERO_BIT + sizeof(STATE_FOR_NUM_NONZERO_BIT)) {
+      return 1 + int(bit - STATE_FOR_NUM_NONZERO_BIT);
+    }
+    if (bit >= mix_contexts && bit < mix_contexts + sizeof(mix_contexts)) {
+      return 1 + int(sizeof(STATE_FOR_NUM_NONZERO_BIT)) + int(bit - mix_contexts);
+    }
+    return -1;
+  }
   bool fetch(bool previous, bool match_type, CoefficientCoord coord, int16_t*output) const{
       if (match_type && (previous || coord.mb_x != mb_coord.mb_x || coord.mb_y != mb_coord.mb_y)) {
           BlockMeta meta = frames[previous ? !cur_frame : cur_frame].meta_at(coord.mb_x, coord.mb_y);
@@ -677,160 +1618,258 @@ class h264_model {
               return false;
           }
       }
-      *output = frames[previous ? !cur_frame : cur_frame].at(coord.mb_x, coord.mb_y).residual[coord.scan8_index * 16 + coord.zigzag_index];
+      *output = frames[previous ? !cur_frame : cur_frame].significance(
+          coord.mb_x, coord.mb_y, coord.scan8_index * 16 + coord.zigzag_index);
       return true;
   }
-  model_key get_model_key(const void *context)const {
-      switch(coding_type) {
-        case PIP_SIGNIFICANCE_NZ:
-          return model_key(context, 0, 0);
-        case PIP_UNKNOWN:
-        case PIP_UNREACHABLE:
-        case PIP_RESIDUALS:
-          return model_key(context, 0, 0);
-        case PIP_SIGNIFICANCE_MAP:
-          {
-              static const uint8_t sig_coeff_flag_offset_8x8[2][63] = {
-                  { 0, 1, 2, 3, 4, 5, 5, 4, 4, 3, 3, 4, 4, 4, 5, 5,
-                    4, 4, 4, 4, 3, 3, 6, 7, 7, 7, 8, 9,10, 9, 8, 7,
-                    7, 6,11,12,13,11, 6, 7, 8, 9,14,10, 9, 8, 6,11,
-                    12,13,11, 6, 9,14,10, 9,11,12,13,11,14,10,12 },
-                  { 0, 1, 1, 2, 2, 3, 3, 4, 5, 6, 7, 7, 7, 8, 4, 5,
-                    6, 9,10,10, 8,11,12,11, 9, 9,10,10, 8,11,12,11,
-                    9, 9,10,10, 8,11,12,11, 9, 9,10,10, 8,13,13, 9,
-                    9,10,10, 8,13,13, 9, 9,10,10,14,14,14,14,14 }
-              };
-              int cat_lookup[14] = { 105+0, 105+15, 105+29, 105+44, 105+47, 402, 484+0, 484+15, 484+29, 660, 528+0, 528+15, 528+29, 718 };
-              static const uint8_t sig_coeff_offset_dc[7] = { 0, 0, 1, 1, 2, 2, 2 };
-              int zigzag_offset = mb_coord.zigzag_index;
-              if (sub_mb_is_dc && sub_mb_chroma422) {
-                  assert(mb_coord.zigzag_index < 7);
-                  zigzag_offset = sig_coeff_offset_dc[mb_coord.zigzag_index];
-              } else {
-                  if (sub_mb_size > 32) {                      assert(mb_coord.zigzag_index < 63);
-                      zigzag_offset = sig_coeff_flag_offset_8x8[0][mb_coord.zigzag_index];
-                  }
-              }
-              assert(sub_mb_cat < (int)(sizeof(cat_lookup)/sizeof(cat_lookup[0])));
-              int neighbor_above = 2;
-              int neighbor_left = 2;
-              int coeff_neighbor_above = 2;
-              int coeff_neighbor_left = 2;
-              if (do_print) {
-                  LOG_NEIGHBORS("[");
-              }
-              {
-                  CoefficientCoord neighbor_left_coord = {0, 0, 0, 0};
-                  if (get_neighbor(false, sub_mb_size, mb_coord, &neighbor_left_coord)) {
-                      int16_t tmp = 0;
-                      if (fetch(false, true, neighbor_left_coord, &tmp)){
-                          neighbor_left = !!tmp;
-                          if (do_print) {
-                              LOG_NEIGHBORS("%d,", tmp);
-                          }
-                      } else {
-                          neighbor_left = 3;
-                          if (do_print) {
-                              LOG_NEIGHBORS("_,");
-                          }
-                      }
-                  } else {
-                      if (do_print) {
-                          LOG_NEIGHBORS("x,");
-                      }
-                  }
-              }
-              {
-                  CoefficientCoord neighbor_above_coord = {0, 0, 0, 0};
-                  if (get_neighbor(true, sub_mb_size, mb_coord, &neighbor_above_coord)) {
-                      int16_t tmp = 0;
-                      if (fetch(false, true, neighbor_above_coord, &tmp)){
-                          neighbor_above = !!tmp;
-                          if (do_print) {
-                              LOG_NEIGHBORS("%d,", tmp);
-                          }
-                      } else {
-                          neighbor_above = 3;
-                          if (do_print) {
-                              LOG_NEIGHBORS("_,");
-                          }
-                      }
-                  } else {
-                      if (do_print) {
-                          LOG_NEIGHBORS("x,");
-                      }
-                  }
-
-              }
-              {
-                  CoefficientCoord neighbor_left_coord = {0, 0, 0, 0};
-                  if (get_neighbor_coefficient(false, sub_mb_size, mb_coord, &neighbor_left_coord)) {
-                      int16_t tmp = 0;
-                      if (fetch(false, true, neighbor_left_coord, &tmp)){
-                          coeff_neighbor_left = !!tmp;
-                      } else {
-                          coeff_neighbor_left = 3;
-                      }
-                  } else {
-                  }
-              }
-              {
-                  CoefficientCoord neighbor_above_coord = {0, 0, 0, 0};
-                  if (get_neighbor_coefficient(true, sub_mb_size, mb_coord, &neighbor_above_coord)) {
-                      int16_t tmp = 0;
-                      if (fetch(false, true, neighbor_above_coord, &tmp)){
-                          coeff_neighbor_above = !!tmp;
-                      } else {
-                          coeff_neighbor_above = 3;
-                      }
-                  } else {
-                  }
-              }
-              
-              // FIXM: why doesn't this prior help at all
-              {
-                  int16_t output = 0;
-                  if (fetch(true, true, mb_coord, &output)) {
-                      if (do_print) LOG_NEIGHBORS("%d] ", output);
-                  } else {
-                      if (do_print) LOG_NEIGHBORS("x] ");
-                  }
-              }
-              //const BlockMeta &meta = frames[!cur_frame].meta_at(mb_x, mb_y);
-              int num_nonzeros = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index];
-              (void)neighbor_above;
-              (void)neighbor_left;
-              (void)coeff_neighbor_above;
-              (void)coeff_neighbor_left;//haven't found a good way to utilize these priors to make the results better
-              return model_key(&significance_context,
-                               64 * num_nonzeros + nonzeros_observed,
-                               sub_mb_is_dc + zigzag_offset * 2 + 16 * 2 * cat_lookup[sub_mb_cat]);
-          }
-        case PIP_SIGNIFICANCE_EOB:
-          {
-            // FIXME: why doesn't this prior help at all
-            static int fake_context = 0;
-            int num_nonzeros = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index];
-            
-            return model_key(&fake_context, num_nonzeros == nonzeros_observed, 0);
-          }
-        default:
-          break;
+  // Whether coord is decoded before the current coefficient: the compressor
+  // tracks a whole map before coding it, so the rest of the current block
+  // (which an 8x8 block's neighbors reach into) is known to it alone.
+  bool decoded_before_current(const CoefficientCoord& coord) const {
+      if (coord.mb_x != mb_coord.mb_x || coord.mb_y != mb_coord.mb_y) {
+          return true;
       }
-      assert(false && "Unreachable");
-      abort();
-  }
-  range_t probability_for_model_key(range_t range, model_key key) {
-    auto* e = &estimators[key];
-    int total = e->pos + e->neg;
-    return (range/total) * e->pos;
-  }
-  range_t probability_for_state(range_t range, const void *context) {
-    return probability_for_model_key(range, get_model_key(context));
+      int index = coord.scan8_index * 16 + coord.zigzag_index;
+      int block_begin = mb_coord.scan8_index * 16;
+      return index < block_begin + mb_coord.zigzag_index || index >= block_begin + sub_mb_size;
   }
-  void update_frame_spec(int frame_num, int mb_width, int mb_height) {
-    if (frames[cur_frame].width() != (uint32_t)mb_width
-        || frames[cur_frame].height() != (uint32_t)mb_height
+  // What is known around a significance map bin: its coefficient's left and
+  // above neighbors in the block (left, above), the same coefficient in the
+  // neighboring blocks (coeff_left, coeff_above) and in the previous frame.
+  // 0 or 1 for a coefficient's significance, 2 if there is no such
+  // coefficient and 3 if its block wasn't coded; previous is 2 if unknown.
+  struct significance_neighbors {
+    int left = 2, above = 2, coeff_left = 2, coeff_above = 2, previous = 2;
+  };
+  significance_neighbors fetch_significance_neighbors() const {
+    significance_neighbors n;
+    if (do_print) {
+        LOG_NEIGHBORS("[");
+    }
+    {
+        CoefficientCoord neighbor_left_coord = {0, 0, 0, 0};
+        if (lookup_neighbor(false, false, sub_mb_size, mb_coord, &neighbor_left_coord) &&
+            decoded_before_current(neighbor_left_coord)) {
+            int16_t tmp = 0;
+            if (fetch(false, true, neighbor_left_coord, &tmp)){
+                n.left = !!tmp;
+                if (do_print) {
+                    LOG_NEIGHBORS("%d,", tmp);
+                }
+            } else {
+                n.left = 3;
+                if (do_print) {
+                    LOG_NEIGHBORS("_,");
+                }
+            }
+        } else {
+            if (do_print) {
+                LOG_NEIGHBORS("x,");
+            }
+        }
+    }
+    {
+        CoefficientCoord neighbor_above_coord = {0, 0, 0, 0};
+        if (lookup_neighbor(false, true, sub_mb_size, mb_coord, &neighbor_above_coord) &&
+            decoded_before_current(neighbor_above_coord)) {
+            int16_t tmp = 0;
+            if (fetch(false, true, neighbor_above_coord, &tmp)){
+                n.above = !!tmp;
+                if (do_print) {
+                    LOG_NEIGHBORS("%d,", tmp);
+                }
+            } else {
+                n.above = 3;
+                if (do_print) {
+                    LOG_NEIGHBORS("_,");
+                }
+            }
+        } else {
+            if (do_print) {
+                LOG_NEIGHBORS("x,");
+            }
+        }
+    }
+    {
+        CoefficientCoord neighbor_left_coord = {0, 0, 0, 0};
+        if (lookup_neighbor(true, false, sub_mb_size, mb_coord, &neighbor_left_coord) &&
+            decoded_before_current(neighbor_left_coord)) {
+            int16_t tmp = 0;
+            if (fetch(false, true, neighbor_left_coord, &tmp)){
+                n.coeff_left = !!tmp;
+            } else {
+                n.coeff_left = 3;
+            }
+        }
+    }
+    {
+        CoefficientCoord neighbor_above_coord = {0, 0, 0, 0};
+        if (lookup_neighbor(true, true, sub_mb_size, mb_coord, &neighbor_above_coord) &&
+            decoded_before_current(neighbor_above_coord)) {
+            int16_t tmp = 0;
+            if (fetch(false, true, neighbor_above_coord, &tmp)){
+                n.coeff_above = !!tmp;
+            } else {
+                n.coeff_above = 3;
+            }
+        }
+    }
+    {
+        int16_t output = 0;
+        if (fetch(true, true, mb_coord, &output)) {
+            n.previous = !!output;
+            if (do_print) LOG_NEIGHBORS("%d] ", output);
+        } else {
+            if (do_print) LOG_NEIGHBORS("x] ");
+        }
+    }
+    return n;
+  }
+  // The CABAC states passed to the get() hook are offsets into this array;
+  // they index the estimator table directly.
+  void set_cabac_state_base(const uint8_t *base) {
+    cabac_state_base = base;
+  }
+  model_key make_model_key(const void *context, int param1, int param2) {
+    if (prior) {
+      return {context, param1, param2, estimators.dynamic_slot(context, param1, param2, [&]() {
+            return prior->dynamic_state(context_id(context), param1, param2); })};
+    }
+    return {context, param1, param2, estimators.dynamic_slot(context, param1, param2)};
+  }
+  model_key key_for_context(const void *context) {
+    if (context == &bypass_context) {
+      return {context, 0, 0, estimator_table::BYPASS_SLOT};
+    }
+    if (context == &terminate_context) {
+      return {context, 0, 0, estimator_table::TERMINATE_SLOT};
+    }
+    uintptr_t offset = uintptr_t(context) - uintptr_t(cabac_state_base);
+    if (cabac_state_base != nullptr && offset < estimator_table::CABAC_STATE_SLOTS) {
+      return {context, 0, 0, uint32_t(offset)};
+    }
+    return make_model_key(context, 0, 0);
+  }
+  // The per-bin code of the model comes in two forms: specialized for a
+  // CodingType known at compile time, for callers that know what they are
+  // coding (e.g. a queued significance map), and dispatching on coding_type.
+  // Bins of CodingTypes coded with CABAC's own contexts (PIP_UNKNOWN,
+  // PIP_RESIDUALS, ...) all specialize the same way. Significance map bins
+  // are further specialized on their layout by significance_key<Layout>().
+  template <CodingType CT>
+  model_key get_model_key(const void *context) {
+    if constexpr (CT == PIP_SIGNIFICANCE_MAP) {
+      return dispatch_significance_layout([&](auto layout) {
+        return significance_key<decltype(layout)::value>();
+      });
+    } else if constexpr (CT == PIP_SIGNIFICANCE_EOB) {
+      PROFILE_STAGE(MODEL_KEY);
+      // FIXME: why doesn't this prior help at all
+      static int fake_context = 0;
+      int is_eob = significance_eob_symbol();
+      return {&fake_context, is_eob, 0, estimator_table::EOB_SLOT + is_eob};
+    } else {
+      PROFILE_STAGE(MODEL_KEY);
+      return key_for_context(context);
+    }
+  }
+  model_key get_model_key(const void *context) {
+      switch(coding_type) {
+        case PIP_SIGNIFICANCE_NZ:
+        case PIP_UNKNOWN:
+        case PIP_UNREACHABLE:
+        case PIP_RESIDUALS:
+          return get_model_key<PIP_UNKNOWN>(context);
+        case PIP_SIGNIFICANCE_MAP:
+          return get_model_key<PIP_SIGNIFICANCE_MAP>(context);
+        case PIP_SIGNIFICANCE_EOB:
+          return get_model_key<PIP_SIGNIFICANCE_EOB>(context);
+        default:
+          break;
+      }
+      assert(false && "Unreachable");
+      abort();
+  }
+  // The key of the significance map bin at mb_coord.zigzag_index, for a
+  // sub-block of the given layout.
+  template <significance_layout Layout>
+  model_key significance_key() {
+    PROFILE_STAGE(MODEL_KEY);
+    int zigzag_offset = mb_coord.zigzag_index;
+    if constexpr (Layout == SIGNIFICANCE_CHROMA422_DC) {
+      assert(mb_coord.zigzag_index < 7);
+      zigzag_offset = significance_offset_chroma422_dc[mb_coord.zigzag_index];
+    } else if constexpr (Layout == SIGNIFICANCE_8X8) {
+      assert(mb_coord.zigzag_index < 63);
+      zigzag_offset = significance_offset_8x8[0][mb_coord.zigzag_index];
+    }
+    int zigzag_param = significance_param_base + zigzag_offset * 2;
+    // The neighbors are only used by the mixing stage (and the debug log).
+    // get_neighbor has no 4:2:2 chroma DC blocks, which go without.
+    significance_neighbors neighbors;
+    if ((Mixing || do_print) && Layout != SIGNIFICANCE_CHROMA422_DC) {
+      neighbors = fetch_significance_neighbors();
+    }
+    model_key key = make_model_key(&significance_context,
+                                   64 * significance_nonzeros + nonzeros_observed, zigzag_param);
+    if constexpr (Mixing) {
+      mix_significance(key, neighbors, significance_nonzeros - nonzeros_observed, zigzag_param);
+    }
+    return key;
+  }
+  // Returns f called with the current sub-block's layout, as a
+  // std::integral_constant. The switch is the only dispatch: f's calls into
+  // the model are direct, so they inline.
+  template <class Functor>
+  auto dispatch_significance_layout(const Functor &f) const {
+    switch (sub_mb_layout) {
+      case SIGNIFICANCE_8X8:
+        return f(std::integral_constant<significance_layout, SIGNIFICANCE_8X8>());
+      case SIGNIFICANCE_CHROMA422_DC:
+        return f(std::integral_constant<significance_layout, SIGNIFICANCE_CHROMA422_DC>());
+      case SIGNIFICANCE_4X4:
+      default:
+        return f(std::integral_constant<significance_layout, SIGNIFICANCE_4X4>());
+    }
+  }
+  template <CodingType CT>
+  range_t probability_for_model_key(range_t range, const model_key &key) const {
+    PROFILE_STAGE(ESTIMATOR);
+    if constexpr (Mixing && CT == PIP_SIGNIFICANCE_MAP) {
+      return (range >> logistic_tables::PROBABILITY_BITS) * mixed_probability;
+    }
+    return Estimator::probability(range, estimators[key.slot]);
+  }
+  range_t probability_for_model_key(range_t range, const model_key &key) const {
+    if (Mixing && key.context == &significance_context) {
+      return probability_for_model_key<PIP_SIGNIFICANCE_MAP>(range, key);
+    }
+    return probability_for_model_key<PIP_UNKNOWN>(range, key);
+  }
+  // The mixing stage of a significance map bin with the given key: mixes the
+  // predictions of its own estimator, of one keyed by its neighbors in the
+  // block and of one keyed by the neighboring blocks and the previous frame.
+  // The other two estimators are trained along with the key's.
+  void mix_significance(const model_key &key, const significance_neighbors &n, int remaining, int zigzag_param) {
+    remaining = std::max(0, std::min(remaining, 7));
+    mix_slots[0] = make_model_key(&mix_contexts[0], n.left + 4 * n.above + 16 * remaining, zigzag_param).slot;
+    mix_slots[1] = make_model_key(&mix_contexts[1],
+                                  n.coeff_left + 4 * n.coeff_above + 16 * n.previous + 48 * remaining,
+                                  zigzag_param).slot;
+    int p[MIX_INPUTS] = {mix_input(key.slot), mix_input(mix_slots[0]), mix_input(mix_slots[1]), MIX_BIAS};
+    mixed_probability = mixer.mix(p, sub_mb_cat);
+  }
+  // An estimator's probability of a 1 as a mixer input.
+  int mix_input(uint32_t slot) const {
+    int p = int(Estimator::probability(uint64_t(1) << 32, estimators[slot]) >> (32 - logistic_tables::PROBABILITY_BITS));
+    return std::max(1, std::min(p, (1 << logistic_tables::PROBABILITY_BITS) - 1));
+  }
+  range_t probability_for_state(range_t range, const void *context) {
+    return probability_for_model_key(range, get_model_key(context));
+  }
+  void update_frame_spec(int frame_num, int mb_width, int mb_height) {
+    if (frames[cur_frame].width() != (uint32_t)mb_width
+        || frames[cur_frame].height() != (uint32_t)mb_height
         || !frames[cur_frame].is_same_frame(frame_num)) {
       cur_frame = !cur_frame;
       if (frames[cur_frame].width() != (uint32_t)mb_width
@@ -860,6 +1899,9 @@ class h264_model {
       for (int i= 0; i < 6; ++i) {
           nonzero_bits[i] = (meta.num_nonzeros[mb_coord.scan8_index] & (1 << i)) >> i;
       }
+      // The compressor has ended the sub-block already, the decompressor
+      // hasn't begun decoding it: is_8x8 matches for both only with this one.
+      const bool is_8x8 = meta.is_8x8 || sub_mb_size > 32;
 #define QUEUE_MODE
 #ifdef QUEUE_MODE
       const uint32_t serialized_bits = sub_mb_size > 16 ? 6 : sub_mb_size > 4 ? 4 : 2;
@@ -888,7 +1930,7 @@ class h264_model {
               if (above_nonzero) {
                   above_nonzero_bit = (above_nonzero >= cur_bit);
               }
-              put_or_get(model_key(&(STATE_FOR_NUM_NONZERO_BIT[i]), serialized_so_far + 64 * (frames[!cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index] >= cur_bit) + 128 * left_nonzero_bit + 384 * above_nonzero_bit, meta.is_8x8 + sub_mb_is_dc * 2 + sub_mb_chroma422 + sub_mb_cat * 4), &nonzero_bits[i]);
+              put_or_get(make_model_key(&(STATE_FOR_NUM_NONZERO_BIT[i]), serialized_so_far + 64 * (frames[!cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index] >= cur_bit) + 128 * left_nonzero_bit + 384 * above_nonzero_bit, is_8x8 + sub_mb_is_dc * 2 + sub_mb_chroma422 + sub_mb_cat * 4), &nonzero_bits[i]);
               if (nonzero_bits[i]) {
                   serialized_so_far |= cur_bit;
               }
@@ -932,6 +1974,10 @@ class h264_model {
       if (block_of_interest) {
           LOG_NEIGHBORS("} %d> ",meta.num_nonzeros[mb_coord.scan8_index]);
       }
+      // Only the serialized bits, as the decompressor gets no others. A count
+      // that doesn't fit is a block with every coefficient nonzero, whose
+      // map ends without an EOB bin anyway.
+      significance_nonzeros = meta.num_nonzeros[mb_coord.scan8_index] & ((1 << serialized_bits) - 1);
       coding_type = last;
     }
   }
@@ -939,14 +1985,8 @@ class h264_model {
       if (ct == PIP_SIGNIFICANCE_MAP) {
         assert(coding_type == PIP_UNREACHABLE
                || (coding_type == PIP_SIGNIFICANCE_MAP && mb_coord.zigzag_index == 0));
-        uint8_t num_nonzeros = 0;
-        for (int i = 0; i < sub_mb_size; ++i) {
-            int16_t res = frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + i];
-            assert(res == 1 || res == 0);
-            if (res != 0) {
-                num_nonzeros += 1;
-            }
-        }
+        uint8_t num_nonzeros = frames[cur_frame].count_significance(
+            mb_coord.mb_x, mb_coord.mb_y, mb_coord.scan8_index * 16, sub_mb_size);
         BlockMeta &meta = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y);
         meta.is_8x8 = meta.is_8x8 || (sub_mb_size > 32); // 8x8 will have DC be 2x2
         meta.coded = true;
@@ -972,6 +2012,10 @@ class h264_model {
       } else {
         mb_coord.zigzag_index = 0;
       }
+      assert(sub_mb_cat < (int)(sizeof(significance_cat_offset)/sizeof(significance_cat_offset[0])));
+      significance_param_base = sub_mb_is_dc + 16 * 2 * significance_cat_offset[sub_mb_cat];
+      sub_mb_layout = sub_mb_is_dc && sub_mb_chroma422 ? SIGNIFICANCE_CHROMA422_DC
+          : sub_mb_size > 32 ? SIGNIFICANCE_8X8 : SIGNIFICANCE_4X4;
       begin_queueing = true;
       break;
     default:
@@ -984,12 +2028,10 @@ class h264_model {
       nonzeros_observed = 0;
       coding_type = PIP_SIGNIFICANCE_MAP;
   }
+  template <CodingType CT>
   void update_state_tracking(int symbol) {
-    switch (coding_type) {
-    case PIP_SIGNIFICANCE_NZ:
-      break;
-    case PIP_SIGNIFICANCE_MAP:
-      frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + mb_coord.zigzag_index] = symbol;
+    if constexpr (CT == PIP_SIGNIFICANCE_MAP) {
+      frames[cur_frame].set_significance(mb_coord.mb_x, mb_coord.mb_y, mb_coord.scan8_index * 16 + mb_coord.zigzag_index, symbol);
       nonzeros_observed += symbol;
       if (mb_coord.zigzag_index + 1 == sub_mb_size) {
         coding_type = PIP_UNREACHABLE;
@@ -1002,25 +2044,37 @@ class h264_model {
           if (mb_coord.zigzag_index + 1 == sub_mb_size) {
               // if we were a zero and we haven't eob'd then the
               // next and last must be a one
-              frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + mb_coord.zigzag_index] = 1;
+              frames[cur_frame].set_significance(mb_coord.mb_x, mb_coord.mb_y, mb_coord.scan8_index * 16 + mb_coord.zigzag_index, 1);
               ++nonzeros_observed;
               coding_type = PIP_UNREACHABLE;
               mb_coord.zigzag_index = 0;
           }
         }
       }
-      break;
-    case PIP_SIGNIFICANCE_EOB:
+    } else if constexpr (CT == PIP_SIGNIFICANCE_EOB) {
       if (symbol) {
         mb_coord.zigzag_index = 0;
         coding_type = PIP_UNREACHABLE;
       } else if (mb_coord.zigzag_index + 2 == sub_mb_size) {
-        frames[cur_frame].at(mb_coord.mb_x, mb_coord.mb_y).residual[mb_coord.scan8_index * 16 + mb_coord.zigzag_index + 1] = 1;
+        frames[cur_frame].set_significance(mb_coord.mb_x, mb_coord.mb_y, mb_coord.scan8_index * 16 + mb_coord.zigzag_index + 1, 1);
         coding_type = PIP_UNREACHABLE;  
       } else {
         coding_type = PIP_SIGNIFICANCE_MAP;
         ++mb_coord.zigzag_index;
       }
+    } else {
+      static_assert(CT != PIP_UNREACHABLE, "No bins are coded in PIP_UNREACHABLE.");
+    }
+  }
+  void update_state_tracking(int symbol) {
+    switch (coding_type) {
+    case PIP_SIGNIFICANCE_NZ:
+      break;
+    case PIP_SIGNIFICANCE_MAP:
+      update_state_tracking<PIP_SIGNIFICANCE_MAP>(symbol);
+      break;
+    case PIP_SIGNIFICANCE_EOB:
+      update_state_tracking<PIP_SIGNIFICANCE_EOB>(symbol);
       break;
     case PIP_RESIDUALS:
     case PIP_UNKNOWN:
@@ -1031,29 +2085,88 @@ class h264_model {
       assert(false);
     }
   }
+  // The significance map's end-of-block bins aren't coded: the nonzero count
+  // is coded before the map, and each one is whether that many coefficients
+  // have been seen.
+  int significance_eob_symbol() const {
+    return significance_nonzeros == nonzeros_observed;
+  }
   void update_state(int symbol, const void *context) {
       update_state_for_model_key(symbol, get_model_key(context));
   }
-  void update_state_for_model_key(int symbol, model_key key) {
-    if (coding_type == PIP_SIGNIFICANCE_EOB) {
-        int num_nonzeros = frames[cur_frame].meta_at(mb_coord.mb_x, mb_coord.mb_y).num_nonzeros[mb_coord.scan8_index];
-        assert(symbol == (num_nonzeros == nonzeros_observed));
+  template <CodingType CT>
+  void update_state_for_model_key(int symbol, const model_key &key) {
+    if constexpr (CT == PIP_SIGNIFICANCE_EOB) {
+        assert(symbol == significance_eob_symbol());
     }
-    auto* e = &estimators[key];
-    if (symbol) {
-      e->pos++;
-    } else {
-      e->neg++;
+    update_estimator_for_model_key<CT>(symbol, key);
+    update_state_tracking<CT>(symbol);
+  }
+  void update_state_for_model_key(int symbol, const model_key &key) {
+    switch (coding_type) {
+    case PIP_SIGNIFICANCE_MAP:
+      return update_state_for_model_key<PIP_SIGNIFICANCE_MAP>(symbol, key);
+    case PIP_SIGNIFICANCE_EOB:
+      return update_state_for_model_key<PIP_SIGNIFICANCE_EOB>(symbol, key);
+    default:
+      update_estimator_for_model_key<PIP_UNKNOWN>(symbol, key);
+      update_state_tracking(symbol);
+    }
+  }
+  // Only the estimator, for bins whose state tracking has already been done.
+  template <CodingType CT>
+  void update_estimator_for_model_key(int symbol, const model_key &key) {
+    constexpr bool mixed = Mixing && CT == PIP_SIGNIFICANCE_MAP;
+    {
+      PROFILE_STAGE(ESTIMATOR);
+      Estimator::update(estimators[key.slot], symbol, CT == PIP_SIGNIFICANCE_MAP);
+      if constexpr (mixed) {
+        for (uint32_t slot : mix_slots) {
+          Estimator::update(estimators[slot], symbol, true);
+        }
+        mixer.update(symbol);
+      }
+    }
+    if (counting) {
+      count_symbol(key.slot, symbol);
+      if constexpr (mixed) {
+        for (uint32_t slot : mix_slots) {
+          count_symbol(slot, symbol);
+        }
+      }
     }
-    if ((coding_type != PIP_SIGNIFICANCE_MAP && e->pos + e->neg > 0x60)
-        || (coding_type == PIP_SIGNIFICANCE_MAP && e->pos + e->neg > 0x50)) {
-      e->pos = (e->pos + 1) / 2;
-      e->neg = (e->neg + 1) / 2;
+  }
+  // Codes the queued bins of a significance map whose state tracking has
+  // been done, with the tracking state each was seen in: put(key, symbol)
+  // codes a bin with probability_for_model_key<PIP_SIGNIFICANCE_MAP>. The
+  // layout is dispatched on once, for the whole map.
+  template <class Functor>
+  void code_queued_significance(const significance_bin *bins, size_t count, const Functor &put) {
+    CoefficientCoord coord = mb_coord;
+    int observed = nonzeros_observed;
+    reset_mb_significance_state_tracking();
+    dispatch_significance_layout([&](auto layout) {
+      for (size_t i = 0; i < count; i++) {
+        mb_coord.zigzag_index = bins[i].zigzag_index;
+        nonzeros_observed = bins[i].nonzeros_observed;
+        model_key key = significance_key<decltype(layout)::value>();
+        put(key, bins[i].symbol);
+        update_estimator_for_model_key<PIP_SIGNIFICANCE_MAP>(bins[i].symbol, key);
+      }
+    });
+    mb_coord = coord;
+    nonzeros_observed = observed;
+  }
+  void count_symbol(uint32_t slot, int symbol) {
+    if (slot >= slot_counts.size()) {
+      slot_counts.resize(slot + 1);
     }
-    update_state_tracking(symbol);
+    slot_counts[slot][symbol]++;
   }
 
   const uint8_t bypass_context = 0, terminate_context = 0, significance_context = 0;
+  // If set, the compressor records each coded bin here.
+  bin_trace_writer *trace = nullptr;
   CoefficientCoord mb_coord;
   int nonzeros_observed = 0;
   int sub_mb_cat = -1;
@@ -1061,12 +2174,37 @@ class h264_model {
   int sub_mb_is_dc = 0;
   int sub_mb_chroma422 = 0;
  private:
-  struct estimator { int pos = 1, neg = 1; };
-  std::map<model_key, estimator> estimators;
+  // Fixed for the current sub-block's significance map by begin_coding_type
+  // (and significance_nonzeros, its nonzero count, once that is coded).
+  significance_layout sub_mb_layout = SIGNIFICANCE_4X4;
+  int significance_param_base = 0;
+  int significance_nonzeros = 0;
+  const uint8_t *cabac_state_base = nullptr;
+  basic_estimator_table<typename Estimator::state> estimators;
+  // The mixing stage (Mixing only): one weight set per sub_mb_cat, for the
+  // inputs of mix_significance and a constant bias.
+  static constexpr int MIX_INPUTS = 4;
+  static constexpr int MIX_BIAS = logistic_tables::squash(256);
+  const uint8_t mix_contexts[2] = {};
+  uint32_t mix_slots[2] = {};
+  int mixed_probability = 0;
+  logistic_mixer<MIX_INPUTS, 14> mixer;
+  const prior_type *prior = nullptr;
+  bool counting = false;
+  std::vector<symbol_counts> slot_counts;
+};
+typedef basic_h264_model<AVRECODE_ESTIMATOR, AVRECODE_MIXING> h264_model;
+
+// What a worker recoding one file after another keeps between them: the
+// demuxer's I/O buffer, and the model with its estimator and frame storage.
+struct recode_context {
+  av_io_buffer io;
+  h264_model model;
 };
 
 class h264_symbol {
 public:
+  h264_symbol() = default;
   h264_symbol(int symbol, const void*state)
     : symbol(symbol), state(state) {
   }
@@ -1074,73 +2212,247 @@ public:
   template <class T>
   void execute(T &encoder, h264_model *model,
       Recoded::Block *out, std::vector<uint8_t> &encoder_out) {
-    bool in_significance_map = (model->coding_type == PIP_SIGNIFICANCE_MAP);
-    bool block_of_interest = (model->sub_mb_cat == 1 || model->sub_mb_cat == 2);
-    bool print_priors = in_significance_map && block_of_interest;
-    if (model->coding_type != PIP_SIGNIFICANCE_EOB) {
+    // The compressor queues the significance map's bins and codes them
+    // itself, so these are all bins of CABAC's own contexts.
+    assert(model->coding_type != PIP_SIGNIFICANCE_MAP && model->coding_type != PIP_SIGNIFICANCE_EOB);
+    model_key key = model->get_model_key<PIP_UNKNOWN>(state);
+    {
+      PROFILE_STAGE(ARITHMETIC);
+      if (model->trace) {
+        model->trace->put(symbol, model->coding_type, key.slot);
+      }
       size_t billable_bytes = encoder.put(symbol, [&](range_t range){
-          return model->probability_for_state(range, state); });
+          return model->probability_for_model_key<PIP_UNKNOWN>(range, key); });
       if (billable_bytes) {
         model->billable_bytes(billable_bytes);
       }
-    }else if (block_of_interest) {
-        if (symbol) {
-            LOG_NEIGHBORS("\n");
-        }
-    }
-    if (print_priors) {
-        model->enable_debug();
-    }
-    model->update_state(symbol, state);
-    if (print_priors) {
-        LOG_NEIGHBORS("%d ", symbol);
-        model->disable_debug();
     }
+    model->update_state_for_model_key<PIP_UNKNOWN>(symbol, key);
     if (state == &model->terminate_context && symbol) {
       encoder.finish();
       out->set_cabac(&encoder_out[0], encoder_out.size());
     }
   }
 private:
-  int symbol;
-  const void* state;
+  int symbol = 0;
+  const void* state = nullptr;
 };
 
 class compressor {
  public:
-  compressor(const std::string& input_filename, std::ostream& out_stream)
+  // With a context, its I/O buffer and model are used instead of new ones.
+  compressor(const std::string& input_filename, std::ostream& out_stream, recode_context *context = nullptr)
     : input_filename(input_filename), out_stream(out_stream) {
     if (av_file_map(input_filename.c_str(), &original_bytes, &original_size, 0, NULL) < 0) {
       throw std::invalid_argument("Failed to open file: " + input_filename);
     }
+    use_context(context);
+    range.end = original_size;
+    if (h264_model::estimator_policy::ID) {
+      out.mutable_metadata()->set_estimator(h264_model::estimator_policy::ID);
+    }
+    if (h264_model::mixing) {
+      out.mutable_metadata()->set_mixing(1);
+    }
   }
 
   ~compressor() {
-    av_file_unmap(original_bytes, original_size);
+    if (owns_mapping) {
+      av_file_unmap(original_bytes, original_size);
+    }
+  }
+
+  // Write the streamed container, flushing blocks as they are recoded,
+  // rather than one message at the end.
+  void set_streaming(bool streaming) {
+    this->streaming = streaming;
+  }
+
+  // Recode NAL-escaped slices too, recording where their emulation
+  // prevention bytes go. Otherwise they are skipped.
+  void set_recode_escaped(bool recode_escaped) {
+    this->recode_escaped = recode_escaped;
+  }
+
+  // Recode with 32-bit arithmetic code digits (coder_version 1).
+  void set_wide_digits(bool wide_digits) {
+    this->wide_digits = wide_digits;
+    if (wide_digits) {
+      out.mutable_metadata()->set_coder_version(WIDE_CODER_VERSION);
+    } else if (out.has_metadata()) {
+      out.mutable_metadata()->clear_coder_version();
+    }
+  }
+
+  // Start the estimators from a prior (none if null), recorded by its hash.
+  void set_prior(const h264_model::prior_type *prior) {
+    this->prior = prior;
+    model->set_prior(prior);
+    if (prior) {
+      out.mutable_metadata()->set_prior_hash(prior->hash());
+    } else if (out.has_metadata()) {
+      out.mutable_metadata()->clear_prior_hash();
+    }
+  }
+
+  // Compress literal blocks that are estimated to compress well with a
+  // general-purpose codec (literal_codec.h).
+  void set_compress_literals(bool compress_literals) {
+    this->compress_literals = compress_literals;
+  }
+
+  // Keep literal blocks of at least min_size bytes in a literal store (none
+  // if null), referenced by their hash.
+  void set_literal_store(const literal_store *store, size_t min_size) {
+    this->store = store;
+    store_min_size = std::max<size_t>(min_size, 1);
+  }
+
+  // Record the coded bins for the replay benchmark.
+  void set_trace(bin_trace_writer *trace) {
+    model->trace = trace;
+  }
+
+  // Fault in the input up to window bytes ahead of the decoder, on a thread
+  // of its own (0: don't).
+  void set_readahead(size_t window) {
+    readahead_window = window;
+  }
+
+  // Let ffmpeg decode on this many frame threads (av_decoder::set_decode_threads).
+  // The output is the same as with one.
+  void set_decode_threads(int decode_threads) {
+    this->decode_threads = decode_threads;
+  }
+
+  // Bytes of literal and recoded CABAC data written so far. The rest of the
+  // output is the container's overhead.
+  size_t block_payload_bytes() const {
+    return payload_bytes;
+  }
+
+  // The input video, once run has started.
+  const video_info& input_video() const {
+    return video;
   }
 
   void run(const int input_index = 0) {
+    if (streaming) {
+      out_stream.write(STREAM_MAGIC, sizeof(STREAM_MAGIC));
+      write_record(out_stream, out.metadata().SerializeAsString());
+    } else {
+      // Blocks are written as they are done, as fields of the message.
+      write_metadata();
+    }
+    flushing = true;
+
     // Run through all the frames in the file, building the output using our hooks.
-    av_decoder<compressor> d(this, input_filename);
+    av_decoder<compressor> d(this, input_filename, io());
     d.dump_stream_info(input_index);
+    video = d.get_video_info();
+    d.set_decode_threads(decode_threads);
     d.decode_video();
+    print_slice_counts();
+
+    // Flush the final block to the output.
+    add_literal(prev_coded_block_end, original_size - prev_coded_block_end);
+    flush_blocks();
+    flushing = false;
+    if (out.block_size() != 0) {
+      throw std::runtime_error("Coded block was never finished.");
+    }
+    if (streaming) {
+      write_record(out_stream, "");
+    }
+  }
+
+  // Split the input at video keyframes into segments of at least
+  // segment_bytes, and recode the segments on num_threads threads. Each
+  // segment has its own model, so some compression is lost to relearning;
+  // the per-segment bill shows how much.
+  void run_segmented(size_t segment_bytes, int num_threads, const int input_index = 0) {
+    if (streaming) {
+      throw std::invalid_argument("Segmented output can't be streamed.");
+    }
+    if (model->trace) {
+      throw std::invalid_argument("Segmented compression can't record a bin trace.");
+    }
+    std::vector<segment_range> ranges;
+    {
+      av_decoder<compressor> d(this, input_filename, io());
+      d.dump_stream_info(input_index);
+      video = d.get_video_info();
+      ranges = split_at_keyframes(d.find_keyframes(), segment_bytes);
+    }
+
+    std::vector<std::unique_ptr<compressor>> workers;
+    for (const segment_range& range : ranges) {
+      workers.emplace_back(new compressor(*this, range));
+    }
+    run_on_threads(workers.size(), num_threads, [&](size_t i) {
+      workers[i]->run_segment();
+    });
 
-    // Flush the final block to the output and write to stdout.
-    out.add_block()->set_literal(
-        &original_bytes[prev_coded_block_end], original_size - prev_coded_block_end);
-    out_stream << out.SerializeAsString();
+    fprintf(stderr, "Avrecode Segments\n=================\n");
+    size_t total_cabac = 0, total_recoded = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+      compressor *worker = workers[i].get();
+      Recoded::Segment *segment = out.add_segment();
+      segment->set_first_block(out.block_size());
+      segment->set_num_blocks(worker->out.block_size());
+      segment->set_original_offset(worker->range.begin);
+      segment->set_original_size(worker->range.end - worker->range.begin);
+      segment->set_first_packet(worker->range.first_packet);
+      size_t cabac = 0, recoded = 0;
+      for (Recoded::Block& block : *worker->out.mutable_block()) {
+        if (block.has_cabac()) {
+          if (!segment->has_model_reset_block()) {
+            segment->set_model_reset_block(out.block_size());
+          }
+          cabac += block.size();
+          recoded += block.cabac().size();
+        }
+        out.add_block()->Swap(&block);
+      }
+      literals.insert(literals.end(), worker->literals.begin(), worker->literals.end());
+      block_memory.add(worker->block_memory.bytes());
+      worker->block_memory.set(0);
+      slices.recoded += worker->slices.recoded;
+      slices.skipped_escaped += worker->slices.skipped_escaped;
+      slices.skipped_small += worker->slices.skipped_small;
+      slices.recoded_escaped += worker->slices.recoded_escaped;
+      slices.recoded_by_search += worker->slices.recoded_by_search;
+      model->absorb_bill(worker->model);
+      fprintf(stderr, "segment %zu : %zu bytes, CABAC %zu -> %zu (%.2f%%)\n",
+              i, worker->range.end - worker->range.begin, cabac, recoded,
+              cabac ? recoded * 100. / cabac : 100.);
+      total_cabac += cabac;
+      total_recoded += recoded;
+    }
+    fprintf(stderr, "total : %zu segments, CABAC %zu -> %zu (%.2f%%)\n",
+            workers.size(), total_cabac, total_recoded,
+            total_cabac ? total_recoded * 100. / total_cabac : 100.);
+    print_slice_counts();
+    write_output();
   }
 
   int read_packet(uint8_t *buffer_out, int size) {
-    size = std::min(size, int(original_size - read_offset));
+    if (readahead_window && !prefetch) {
+      prefetch.reset(new prefetcher(original_bytes, original_size, readahead_window));
+    }
+    size = int(std::min<size_t>(size, original_size - read_offset));
     memcpy(buffer_out, &original_bytes[read_offset], size);
     read_offset += size;
+    if (prefetch) {
+      prefetch->consumed(read_offset);
+    }
+    slice_locator.scan(original_bytes, read_offset);
     return size;
   }
 
   class cabac_decoder {
    public:
-    cabac_decoder(compressor *c, CABACContext *ctx_in, const uint8_t *buf, int size) {
+    cabac_decoder(compressor *c, CABACContext *ctx_in, const uint8_t *buf, int size) : c(c) {
       out = c->find_next_coded_block_and_emit_literal(buf, size);
       model = nullptr;
       if (out == nullptr) {
@@ -1158,27 +2470,59 @@ class compressor {
       ctx.coding_hooks_opaque = nullptr;
       ::ff_reset_cabac_decoder(&ctx, buf, size);
 
-      this->c = c;
-      model = &c->model;
+      model = c->model;
       model->reset();
+      model->set_cabac_state_base(cabac_state_array(ctx_in));
+      // Near the memory budget, the estimator table stops growing from this
+      // block on, as the decompressor will see.
+      if (memory::under_pressure() && !model->estimators_capped()) {
+        out->set_estimator_slot_limit(model->cap_estimators());
+      }
+
+      // Reuse the output buffer of an earlier slice. The recoded slice is
+      // normally smaller than the original.
+      encoder_out.swap(c->spare_encoder_out);
+      encoder_out.clear();
+      encoder_out.reserve(size);
+    }
+    ~cabac_decoder() {
+      assert(out == nullptr || out->has_cabac());
+      if (encoder_out.capacity() > c->spare_encoder_out.capacity()) {
+        encoder_out.swap(c->spare_encoder_out);
+      }
     }
-    ~cabac_decoder() { assert(out == nullptr || out->has_cabac()); }
 
     void execute_symbol(int symbol, const void* state) {
-      h264_symbol sym(symbol, state);
 #define QUEUE_MODE
 #ifdef QUEUE_MODE
-      if (queueing_symbols == PIP_SIGNIFICANCE_MAP || queueing_symbols == PIP_SIGNIFICANCE_EOB || !symbol_buffer.empty()) {
-        symbol_buffer.push_back(sym);
+      if (queueing_symbols == PIP_SIGNIFICANCE_MAP || queueing_symbols == PIP_SIGNIFICANCE_EOB) {
+        // The map is coded after the nonzero count, which is only known at
+        // its end. Its state tracking (and frame buffer) is done now, once,
+        // keeping what the map bin's model key needs; EOB bins aren't coded.
+        if (model->coding_type == PIP_SIGNIFICANCE_MAP) {
+          if (queued_symbols == MAX_QUEUED_SYMBOLS) {
+            throw std::runtime_error("Too many queued symbols.");
+          }
+          symbol_buffer[queued_symbols++] = {
+            uint8_t(symbol), uint8_t(model->mb_coord.zigzag_index), uint8_t(model->nonzeros_observed)};
+        }
         model->update_state_tracking(symbol);
       } else {
 #endif
-        sym.execute(encoder, model, out, encoder_out);
+        h264_symbol(symbol, state).execute(encoder, model, out, encoder_out);
+        if (state == &model->terminate_context && symbol) {
+          c->block_memory.add(out->cabac().size());
+        }
 #ifdef QUEUE_MODE
       }
 #endif
     }
 
+    // For billing the time spent in the hooks.
+    CodingType coding_type() const {
+      return model ? model->coding_type : PIP_UNKNOWN;
+    }
+
     int get(uint8_t *state) {
       int symbol = ::ff_get_cabac(&ctx, state);
       execute_symbol(symbol, state);
@@ -1198,6 +2542,18 @@ class compressor {
       return symbol;
     }
 
+    // Bins that were decoded on one of ffmpeg's frame threads, replayed by
+    // av_decoder.
+    void put(int symbol, const uint8_t *state) {
+      execute_symbol(symbol, state);
+    }
+    void put_bypass(int symbol) {
+      execute_symbol(symbol, &model->bypass_context);
+    }
+    void put_terminate(int symbol) {
+      execute_symbol(symbol, &model->terminate_context);
+    }
+
     void begin_coding_type(
         CodingType ct, int zigzag_index, int param0, int param1) {
       if (!model) {
@@ -1217,20 +2573,23 @@ class compressor {
       if ((ct == PIP_SIGNIFICANCE_MAP || ct == PIP_SIGNIFICANCE_EOB)) {
         stop_queueing_symbols();
         model->finished_queueing(ct,
-               [&](model_key key, int*symbol) {
-               size_t billable_bytes = encoder.put(*symbol, [&](range_t range){
-                   return model->probability_for_model_key(range, key);
-               });
-               model->update_state_for_model_key(*symbol, key);
+               [&](const model_key &key, int*symbol) {
+               size_t billable_bytes;
+               if (model->trace) {
+                 model->trace->put(*symbol, model->coding_type, key.slot);
+               }
+               {
+                 PROFILE_STAGE(ARITHMETIC);
+                 billable_bytes = encoder.put(*symbol, [&](range_t range){
+                     return model->probability_for_model_key<PIP_SIGNIFICANCE_NZ>(range, key);
+                 });
+               }
+               model->update_state_for_model_key<PIP_SIGNIFICANCE_NZ>(*symbol, key);
                if (billable_bytes) {
                    model->billable_bytes(billable_bytes);
                }
             });
-        static int i = 0;
-        if (i++ < 10) {
-        std::cerr << "FINISHED QUEUING DECODE: " << (int)(model->frames[model->cur_frame].meta_at(model->mb_coord.mb_x, model->mb_coord.mb_y).num_nonzeros[model->mb_coord.scan8_index]) << std::endl;
-        }
-        pop_queueing_symbols(ct);
+        pop_queueing_symbols();
         model->coding_type = PIP_UNKNOWN;
       }
     }
@@ -1239,7 +2598,7 @@ class compressor {
     void push_queueing_symbols(CodingType ct) {
       // Does not currently support nested queues.
       assert (queueing_symbols == PIP_UNKNOWN);
-      assert (symbol_buffer.empty());
+      assert (queued_symbols == 0);
       queueing_symbols = ct;
     }
 
@@ -1248,46 +2607,127 @@ class compressor {
       queueing_symbols = PIP_UNKNOWN;
     }
 
-    void pop_queueing_symbols(CodingType ct) {
-        //std::cerr<< "FINISHED QUEUEING "<< symbol_buffer.size()<<std::endl;
-      if (ct == PIP_SIGNIFICANCE_MAP || ct == PIP_SIGNIFICANCE_EOB) {
-        if (model) {
-          model->reset_mb_significance_state_tracking();
+    // Codes the queued map bins, now that the nonzero count is coded.
+    void pop_queueing_symbols() {
+      model->code_queued_significance(symbol_buffer, queued_symbols, [&](const model_key &key, int symbol) {
+        if (model->trace) {
+          model->trace->put(symbol, PIP_SIGNIFICANCE_MAP, key.slot);
         }
-      }
-      for (auto &sym : symbol_buffer) {
-        sym.execute(encoder, model, out, encoder_out);
-      }
-      symbol_buffer.clear();
+        size_t billable_bytes;
+        {
+          PROFILE_STAGE(ARITHMETIC);
+          billable_bytes = encoder.put(symbol, [&](range_t range){
+              return model->probability_for_model_key<PIP_SIGNIFICANCE_MAP>(range, key); });
+        }
+        if (billable_bytes) {
+          model->billable_bytes(billable_bytes);
+        }
+      });
+      queued_symbols = 0;
     }
 
+    compressor *c;
     Recoded::Block *out;
     CABACContext ctx;
 
-    compressor *c;
     h264_model *model;
     std::vector<uint8_t> encoder_out;
-    recoded_code::encoder<std::back_insert_iterator<std::vector<uint8_t>>, uint8_t> encoder{
-      std::back_inserter(encoder_out)};
+    recoded_encoder<std::back_insert_iterator<std::vector<uint8_t>>> encoder{
+      std::back_inserter(encoder_out), c->wide_digits};
 
     CodingType queueing_symbols = PIP_UNKNOWN;
-    std::vector<h264_symbol> symbol_buffer;
+    // The map bins of one block: at most 64.
+    static constexpr size_t MAX_QUEUED_SYMBOLS = 64;
+    significance_bin symbol_buffer[MAX_QUEUED_SYMBOLS];
+    size_t queued_symbols = 0;
   };
+  // Its cabac_decoder takes bins decoded elsewhere (put), since they come
+  // from the original CABAC data, not the model.
+  static constexpr bool replays_decoded_bins = true;
   h264_model *get_model() {
-    return &model;
+    return model;
   }
 
  private:
 
+  // A run of video packets and the bytes of the original file they cover.
+  struct segment_range {
+    int64_t first_packet, end_packet;
+    size_t begin, end;
+  };
+
+  // Segment worker: shares the parent's mapping of the input, but has its own
+  // decoder, model and output blocks.
+  compressor(const compressor& parent, const segment_range& range)
+    : input_filename(parent.input_filename), out_stream(parent.out_stream),
+      original_bytes(parent.original_bytes), original_size(parent.original_size),
+      owns_mapping(false), recode_escaped(parent.recode_escaped), wide_digits(parent.wide_digits),
+      compress_literals(parent.compress_literals),
+      decode_threads(parent.decode_threads), readahead_window(parent.readahead_window), range(range),
+      prev_coded_block_end(range.begin), prior(parent.prior), store(parent.store),
+      store_min_size(parent.store_min_size) {
+    use_context(nullptr);
+    model->set_prior(prior);
+  }
+
+  void run_segment() {
+    av_decoder<compressor> d(this, input_filename);
+    d.find_stream_info();
+    d.set_decode_threads(decode_threads);
+    d.decode_video(range.first_packet, range.end_packet);
+    add_literal(prev_coded_block_end, range.end - prev_coded_block_end);
+    // Only the blocks and bills are needed from here on.
+    model->release_storage();
+  }
+
+  std::vector<segment_range> split_at_keyframes(
+      const std::vector<av_decoder<compressor>::keyframe>& keyframes, size_t segment_bytes) const {
+    const int64_t last_packet = std::numeric_limits<int64_t>::max();
+    std::vector<segment_range> ranges = {{0, last_packet, 0, original_size}};
+    for (const auto& keyframe : keyframes) {
+      size_t pos = keyframe.pos;
+      if (pos >= ranges.back().begin + segment_bytes && pos < original_size) {
+        ranges.back().end_packet = keyframe.packet;
+        ranges.back().end = pos;
+        ranges.push_back({keyframe.packet, last_packet, pos, original_size});
+      }
+    }
+    return ranges;
+  }
+
   Recoded::Block* find_next_coded_block_and_emit_literal(const uint8_t *buf, int size) {
-    uint8_t *found = static_cast<uint8_t*>( memmem(
-        &original_bytes[prev_coded_block_end], read_offset - prev_coded_block_end,
-        buf, size) );
-    if (found && size >= SURROGATE_MARKER_BYTES) {
+    flush_blocks();
+    size_t search_end = std::max(std::min(read_offset, range.end), prev_coded_block_end);
+    uint8_t *found = nullptr;
+    size_t found_size = size;
+    std::vector<uint32_t> escapes;
+    if (size >= SURROGATE_MARKER_BYTES) {
+      bool searched = false;
+      int64_t offset = slice_locator.find_or_search(
+          original_bytes, prev_coded_block_end, search_end, buf, size, &searched);
+      if (offset >= 0) {
+        found = &original_bytes[offset];
+        slices.recoded_by_search += searched;
+      }
+      if (!found && recode_escaped) {
+        offset = slice_locator.find_escaped(
+            original_bytes, prev_coded_block_end, search_end, buf, size,
+            &found_size, &escapes);
+        if (offset >= 0) {
+          found = &original_bytes[offset];
+          slices.recoded_escaped++;
+        }
+      }
+    }
+    if (found) {
+      slices.recoded++;
       size_t gap = found - &original_bytes[prev_coded_block_end];
-      out.add_block()->set_literal(&original_bytes[prev_coded_block_end], gap);
-      prev_coded_block_end += gap + size;
+      add_literal(prev_coded_block_end, gap);
+      prev_coded_block_end += gap + found_size;
       Recoded::Block *newBlock = out.add_block();
+      for (size_t i = 0; i < escapes.size(); i++) {
+        newBlock->add_escape(escapes[i] - (i ? escapes[i - 1] : 0));
+      }
       newBlock->set_length_parity(size & 1);
       if (size > 1) {
         newBlock->set_last_byte(&(buf[size - 1]), 1);
@@ -1296,6 +2736,11 @@ class compressor {
     } else {
       // Can't recode this block, probably because it was NAL-escaped. Place
       // a skip marker in the block list.
+      if (size >= SURROGATE_MARKER_BYTES) {
+        slices.skipped_escaped++;
+      } else {
+        slices.skipped_small++;
+      }
       Recoded::Block* block = out.add_block();
       block->set_skip_coded(true);
       block->set_size(size);
@@ -1303,111 +2748,457 @@ class compressor {
     }
   }
 
+  void print_slice_counts() const {
+    fprintf(stderr, "Avrecode Slices\n===============\n");
+    fprintf(stderr, "recoded : %d\n", slices.recoded);
+    fprintf(stderr, "recoded (NAL-escaped) : %d\n", slices.recoded_escaped);
+    fprintf(stderr, "recoded (missed by the locator) : %d\n", slices.recoded_by_search);
+    fprintf(stderr, "skipped (NAL-escaped) : %d\n", slices.skipped_escaped);
+    fprintf(stderr, "skipped (too small) : %d\n", slices.skipped_small);
+  }
+
+  // While run() is writing the output, write out and drop the leading
+  // blocks that are complete: as records when streaming, otherwise as
+  // fields of the Recoded message. A CABAC block is complete once the
+  // recoder has filled it in.
+  void flush_blocks() {
+    if (!flushing) {
+      return;
+    }
+    PROFILE_STAGE(SERIALIZE);
+    int n = 0;
+    for (; n < out.block_size(); n++) {
+      const Recoded::Block& block = out.block(n);
+      if (!block.has_literal() && !block.has_literal_sha256() && !block.has_cabac() && !block.has_skip_coded()) {
+        break;
+      }
+      if (!streaming) {
+        out_stream.put((Recoded::kBlockFieldNumber << 3) | 2);
+      }
+      write_block(block);
+      block_memory.add(-int64_t(block.cabac().size() + block.literal().size()));
+    }
+    // The remaining blocks keep their addresses.
+    out.mutable_block()->DeleteSubrange(0, n);
+  }
+
+  // Literal blocks are left empty in `out`, and their bytes are written
+  // straight from the mapped input when the block is written out. Large ones
+  // go to the literal store instead, if there is one, and those that
+  // compress well are kept compressed (on segment workers, in parallel).
+  void add_literal(size_t offset, size_t size) {
+    if (store && size >= store_min_size) {
+      std::string hash = literal_store::content_hash(&original_bytes[offset], size);
+      if (store->put(hash, &original_bytes[offset], size)) {
+        Recoded::Block *block = out.add_block();
+        block->set_size(size);
+        block->set_literal_sha256(hash);
+        return;
+      }
+    }
+    if (compress_literals) {
+      std::string compressed;
+      literal_codec codec = literal_compression::compress(&original_bytes[offset], size, &compressed);
+      if (codec != LITERAL_RAW) {
+        Recoded::Block *block = out.add_block();
+        block->set_size(size);
+        block->set_literal_codec(codec);
+        block->mutable_literal()->swap(compressed);
+        block_memory.add(block->literal().size());
+        return;
+      }
+    }
+    out.add_block()->mutable_literal();
+    literals.push_back({offset, size});
+  }
+
+  // Write a length-prefixed block, taking literals from the input.
+  void write_block(const Recoded::Block& block) {
+    if (block.has_literal() && !block.has_literal_codec()) {
+      const literal_range& literal = literals.front();
+      write_literal_block(out_stream, &original_bytes[literal.offset], literal.size);
+      payload_bytes += literal.size;
+      literals.pop_front();
+    } else {
+      write_record(out_stream, block.SerializeAsString());
+      payload_bytes += block.cabac().size() + block.literal().size();
+    }
+  }
+
+  // The metadata field of the Recoded message, which comes first.
+  void write_metadata() {
+    if (out.has_metadata()) {
+      out_stream.put((Recoded::kMetadataFieldNumber << 3) | 2);
+      write_record(out_stream, out.metadata().SerializeAsString());
+    }
+  }
+
+  // Write `out` as a serialized Recoded message, field by field.
+  void write_output() {
+    PROFILE_STAGE(SERIALIZE);
+    write_metadata();
+    for (const Recoded::Block& block : out.block()) {
+      out_stream.put((Recoded::kBlockFieldNumber << 3) | 2);
+      write_block(block);
+    }
+    for (const Recoded::Segment& segment : out.segment()) {
+      out_stream.put((Recoded::kSegmentFieldNumber << 3) | 2);
+      write_record(out_stream, segment.SerializeAsString());
+    }
+  }
+
   std::string input_filename;
   std::ostream& out_stream;
 
   uint8_t *original_bytes = nullptr;
   size_t original_size = 0;
-  int read_offset = 0;
-  int prev_coded_block_end = 0;
+  bool owns_mapping = true;
+  bool streaming = false;
+  bool recode_escaped = false;
+  bool wide_digits = false;
+  bool compress_literals = false;
+  int decode_threads = 1;
+  size_t readahead_window = 0;
+  std::unique_ptr<prefetcher> prefetch;
+  // Whether flush_blocks writes out the blocks done so far.
+  bool flushing = false;
+  // The part of the file this compressor recodes: all of it, unless this is a
+  // segment worker.
+  segment_range range = {0, std::numeric_limits<int64_t>::max(), 0, 0};
+  size_t read_offset = 0;
+  size_t prev_coded_block_end = 0;
+  size_t payload_bytes = 0;
+  const h264_model::prior_type *prior = nullptr;
+  const literal_store *store = nullptr;
+  size_t store_min_size = 1;
+  // The recoded bytes of the blocks in `out`, until they are written.
+  memory::account block_memory{memory::BLOCKS};
 
-  h264_model model;
+  void use_context(recode_context *context) {
+    this->context = context;
+    if (context) {
+      context->model.reset_file();
+      model = &context->model;
+    } else {
+      own_model.reset(new h264_model);
+      model = own_model.get();
+    }
+  }
+  av_io_buffer *io() {
+    return context ? &context->io : nullptr;
+  }
+
+  // A worker's reused I/O buffer and model, or null for our own.
+  recode_context *context = nullptr;
+  std::unique_ptr<h264_model> own_model;
+  h264_model *model = nullptr;
+  // Recoded output buffer for the next cabac_decoder, kept between slices.
+  std::vector<uint8_t> spare_encoder_out;
+  nal_locator slice_locator;
+  video_info video;
+  struct slice_counts {
+    int recoded = 0, skipped_escaped = 0, skipped_small = 0;
+    // Recoded slices that were NAL-escaped, included in `recoded`.
+    int recoded_escaped = 0;
+    // Recoded slices the locator missed and the full search found.
+    int recoded_by_search = 0;
+  } slices;
   Recoded out;
+  // The input bytes of each literal block in `out`, in order.
+  struct literal_range { size_t offset, size; };
+  std::deque<literal_range> literals;
 };
 
 
 class decompressor {
   // Used to track the decoding state of each block.
   struct block_state {
+    // The input block, in the parsed Recoded message or in `streamed`.
+    const Recoded::Block *block = nullptr;
+    Recoded::Block streamed;
+    // A literal block's bytes, in the parsed message or the mapped stream,
+    // or decompressed.
+    bool literal = false;
+    const char *literal_data = nullptr;
+    size_t literal_size = 0;
     bool coded = false;
     std::string surrogate_marker;
     std::string out_bytes;
     bool done = false;
     int8_t length_parity = -1;
     uint8_t last_byte;
+    // First CABAC block of a segment: start over with a new model.
+    bool reset_model = false;
   };
 
  public:
-  decompressor(const std::string& input_filename, std::ostream& out_stream)
-    : input_filename(input_filename), out_stream(out_stream) {
-    uint8_t *bytes;
-    size_t size;
-    if (av_file_map(input_filename.c_str(), &bytes, &size, 0, NULL) < 0) {
+  // With a context, its I/O buffer and model are used instead of new ones.
+  decompressor(const std::string& input_filename, std::ostream& out_stream, recode_context *context = nullptr)
+    : input_filename(input_filename), out_stream(out_stream), in(own_in) {
+    if (av_file_map(input_filename.c_str(), &mapped_bytes, &mapped_size, 0, NULL) < 0) {
       throw std::invalid_argument("Failed to open file: " + input_filename);
     }
-    in.ParseFromArray(bytes, size);
+    use_context(context);
+    open_input(mapped_bytes, mapped_size);
+    literals = std::make_shared<literal_cache>(in.block_size());
+    if (!streaming) {
+      // Everything has been parsed out of the mapping.
+      av_file_unmap(mapped_bytes, mapped_size);
+      mapped_bytes = nullptr;
+    }
   }
-  decompressor(const std::string& input_filename, const std::string& in_bytes, std::ostream& out_stream)
-    : input_filename(input_filename), out_stream(out_stream) {
-    in.ParseFromString(in_bytes);
+  // Decompress in_bytes, which must outlive the decompressor.
+  decompressor(const std::string& input_filename, const std::string& in_bytes, std::ostream& out_stream,
+               recode_context *context = nullptr)
+    : input_filename(input_filename), out_stream(out_stream), in(own_in) {
+    use_context(context);
+    if (is_stream(reinterpret_cast<const uint8_t*>(in_bytes.data()), in_bytes.size())) {
+      open_input(reinterpret_cast<const uint8_t*>(in_bytes.data()), in_bytes.size());
+    } else {
+      own_in.ParseFromString(in_bytes);
+      check_metadata();
+    }
+    literals = std::make_shared<literal_cache>(in.block_size());
   }
-
-  void run() {
-    blocks.clear();
-    blocks.resize(in.block_size());
-
-    av_decoder<decompressor> d(this, input_filename);
-    d.decode_video();
-
-    for (auto& block : blocks) {
-      if (!block.done) throw std::runtime_error("Not all blocks were decoded.");
-      if (block.length_parity != -1) {
-        // Correct for x264 padding: replace last byte or add an extra byte.
-        if (block.length_parity != (int)(block.out_bytes.size() & 1)) {
-          block.out_bytes.insert(block.out_bytes.end(), block.last_byte);
-        } else {
-          block.out_bytes[block.out_bytes.size() - 1] = block.last_byte;
-        }
-      }
-      out_stream << block.out_bytes;
+  ~decompressor() {
+    if (mapped_bytes) {
+      av_file_unmap(mapped_bytes, mapped_size);
     }
   }
 
+  // Make available the prior files may have been compressed with. A file
+  // that names a prior can only be decompressed with that one.
+  void set_prior(const h264_model::prior_type *prior) {
+    this->prior = prior;
+  }
+
+  // For a streamed file, fault in the input up to window bytes ahead of the
+  // block being read, on a thread of its own. A parsed file is read whole
+  // before decoding starts.
+  void set_readahead(size_t window) {
+    if (streaming && mapped_bytes && window) {
+      prefetch = std::make_shared<prefetcher>(mapped_base, stream_end - mapped_base, window);
+    }
+  }
+
+  // Write the output of a file without segments on a writer thread, handing
+  // it buffer_size bytes at a time with up to queue_depth buffers waiting
+  // (0: write it on the decoding thread).
+  void set_write_queue(size_t buffer_size, int queue_depth) {
+    write_buffer_size = buffer_size;
+    write_queue_depth = queue_depth;
+  }
+
+  // Where to find the literal blocks the file keeps in a literal store.
+  void set_literal_store(const literal_store *store) {
+    this->store = store;
+  }
+
+  // Decode the whole file, writing each block to out_stream as soon as it
+  // and all blocks before it are done.
+  void run() {
+    mark_model_resets();
+    use_file_prior();
+
+    try {
+      av_decoder<decompressor> d(this, input_filename, io());
+      d.decode_video();
+    } catch (const output_range_done&) {
+      return;
+    }
+
+    emit_done_blocks();
+    if (!blocks.empty() || read_next_block()) {
+      throw std::runtime_error("Not all blocks were decoded.");
+    }
+  }
+
+  // Write bytes [offset, offset + length) of the original, decoding only
+  // what they need: nothing if they are in literal blocks, otherwise the
+  // segments that cover them (on up to num_threads threads), or the file up
+  // to the end of the range if it isn't segmented.
+  void run_range(size_t offset, size_t length, int num_threads) {
+    output_begin = offset;
+    output_end = offset + std::min(length, std::numeric_limits<size_t>::max() - offset);
+    if (output_begin == output_end) {
+      return;
+    }
+    if (streaming) {
+      // No block index to skip with.
+      run();
+      return;
+    }
+    if (in.segment_size() == 0) {
+      if (!write_literal_range(0, in.block_size(), 0)) {
+        run();
+      }
+      return;
+    }
+    std::vector<int> covering;
+    for (int i = 0; i < in.segment_size(); i++) {
+      const Recoded::Segment& segment = in.segment(i);
+      size_t begin = segment.original_offset(), end = begin + segment.original_size();
+      if (begin < output_end && end > output_begin) {
+        covering.push_back(i);
+      }
+    }
+    std::vector<std::string> outputs(covering.size());
+    std::vector<bool> done(covering.size());
+    std::mutex output_mutex;
+    size_t next_output = 0;
+    run_on_threads(covering.size(), num_threads, [&](size_t i) {
+      const Recoded::Segment& segment = in.segment(covering[i]);
+      decompressor worker(*this, covering[i]);
+      worker.output_begin = output_begin;
+      worker.output_end = output_end;
+      worker.output_pos = segment.original_offset();
+      worker.segment_output = &outputs[i];
+      if (!worker.write_literal_range(segment.first_block(), segment.first_block() + segment.num_blocks(),
+                                      segment.original_offset())) {
+        worker.run_segment(&outputs[i]);
+      }
+      std::lock_guard<std::mutex> lock(output_mutex);
+      done[i] = true;
+      for (; next_output < covering.size() && done[next_output]; next_output++) {
+        out_stream << outputs[next_output];
+        std::string().swap(outputs[next_output]);
+      }
+    });
+  }
+
+  // Decode the segments of a segmented file in parallel on num_threads
+  // threads. If output_filename is given, each segment is written to its
+  // offset in that file as soon as it is done; otherwise each is written to
+  // out_stream once it and all segments before it are done.
+  void run_segmented(int num_threads, const std::string& output_filename = "") {
+    if (in.segment_size() == 0 || streaming) {
+      if (!output_filename.empty()) {
+        std::ofstream out_file(output_filename);
+        if (!out_file) {
+          throw std::invalid_argument("Failed to open output file: " + output_filename);
+        }
+        std::unique_ptr<async_writer> writer;
+        if (write_queue_depth > 0) {
+          writer.reset(new async_writer(out_file, write_buffer_size, write_queue_depth));
+        }
+        std::ostream out(writer ? static_cast<std::streambuf*>(writer.get()) : out_file.rdbuf());
+        decompressor d(*this, out);
+        d.run();
+        if (writer) {
+          writer->finish();
+        }
+      } else {
+        run();
+      }
+      return;
+    }
+    int fd = -1;
+    if (!output_filename.empty()) {
+      fd = open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+        throw std::invalid_argument("Failed to open output file: " + output_filename);
+      }
+    }
+    defer<> close_fd([fd]() { if (fd >= 0) close(fd); });
+
+    std::vector<std::string> outputs(in.segment_size());
+    std::vector<bool> done(in.segment_size());
+    std::mutex output_mutex;
+    int next_output = 0;
+    run_on_threads(in.segment_size(), num_threads, [&](size_t i) {
+      decompressor worker(*this, i);
+      worker.run_segment(&outputs[i]);
+      if (fd >= 0) {
+        write_at(fd, in.segment(i).original_offset(), outputs[i]);
+        std::string().swap(outputs[i]);
+        return;
+      }
+      std::lock_guard<std::mutex> lock(output_mutex);
+      done[i] = true;
+      for (; next_output < in.segment_size() && done[next_output]; next_output++) {
+        out_stream << outputs[next_output];
+        std::string().swap(outputs[next_output]);
+      }
+    });
+  }
+
   int read_packet(uint8_t *buffer_out, int size) {
+    emit_done_blocks();
+    if (output_pos >= output_end) {
+      // Everything asked for is written: stop demuxing.
+      throw output_range_done();
+    }
     uint8_t *p = buffer_out;
-    while (size > 0 && read_index < in.block_size()) {
-      if (read_block.empty()) {
-        const Recoded::Block& block = in.block(read_index);
-        if (int(block.has_literal()) + int(block.has_cabac()) + int(block.has_skip_coded()) != 1) {
+    while (size > 0) {
+      if (!read_block) {
+        if (!read_next_block()) {
+          break;
+        }
+        block_state& state = blocks.back();
+        const Recoded::Block& block = *state.block;
+        bool in_range = (read_index >= range.first_block && read_index < range.end_block);
+        if (int(state.literal || is_literal(block)) + int(block.has_cabac()) +
+            int(block.has_skip_coded()) != 1) {
           throw std::runtime_error("Invalid input block: must have exactly one type");
         }
-        if (block.has_literal()) {
+        state.reset_model = (size_t(read_index) < model_reset_blocks.size() &&
+                             model_reset_blocks[read_index]);
+        if (state.literal || is_literal(block)) {
           // This block is passed through without any re-coding.
-          blocks[read_index].out_bytes = block.literal();
-          blocks[read_index].done = true;
-          read_block = block.literal();
+          if (!state.literal && streaming && block.has_literal_codec()) {
+            // Streamed blocks aren't indexed: decompress into the block's state.
+            state.out_bytes = literal_compression::decompress(block.literal_codec(), block.literal(),
+                                                              block.size());
+            state.literal_data = state.out_bytes.data();
+            state.literal_size = state.out_bytes.size();
+          } else if (!state.literal) {
+            std::pair<const char*, size_t> bytes = literal_bytes(read_index, block);
+            state.literal_data = bytes.first;
+            state.literal_size = bytes.second;
+          }
+          state.literal = true;
+          state.done = true;
+          read_block = state.literal_data;
+          read_size = state.literal_size;
         } else if (block.has_cabac()) {
           // Re-coded CABAC coded block. out_bytes will be filled by cabac_decoder.
-          blocks[read_index].coded = true;
-          blocks[read_index].surrogate_marker = next_surrogate_marker();
-          blocks[read_index].done = false;
+          state.coded = true;
+          state.surrogate_marker = next_surrogate_marker();
+          // Blocks outside a worker's segment are never decoded.
+          state.done = !in_range;
           if (!block.has_size()) {
             throw std::runtime_error("CABAC block requires size field.");
           }
           if (block.has_length_parity() && block.has_last_byte() &&
               !block.last_byte().empty()) {
-            blocks[read_index].length_parity = block.length_parity();
-            blocks[read_index].last_byte = block.last_byte()[0];
+            state.length_parity = block.length_parity();
+            state.last_byte = block.last_byte()[0];
           }
-          read_block = make_surrogate_block(blocks[read_index].surrogate_marker, block.size());
+          // The surrogate replaces the slice data as stored, escapes included.
+          surrogate_block = make_surrogate_block(state.surrogate_marker, block.size() + block.escape_size());
+          read_block = surrogate_block.data();
+          read_size = surrogate_block.size();
         } else if (block.has_skip_coded() && block.skip_coded()) {
           // Non-re-coded CABAC coded block. The bytes of this block are
           // emitted in a literal block following this one. This block is
           // a flag to expect a cabac_decoder without a surrogate marker.
-          blocks[read_index].coded = true;
-          blocks[read_index].done = true;
+          state.coded = true;
+          state.done = true;
+          read_block = "";
+          read_size = 0;
         } else {
           throw std::runtime_error("Unknown input block type");
         }
       }
-      if ((size_t)read_offset < read_block.size()) {
-        int n = read_block.copy(reinterpret_cast<char*>(p), size, read_offset);
+      if (read_offset < read_size) {
+        int n = std::min(size_t(size), read_size - read_offset);
+        memcpy(p, read_block + read_offset, n);
         read_offset += n;
         p += n;
         size -= n;
       }
-      if ((size_t)read_offset >= read_block.size()) {
-        read_block.clear();
+      if (read_offset >= read_size) {
+        read_block = nullptr;
         read_offset = 0;
         read_index++;
       }
@@ -1417,48 +3208,110 @@ class decompressor {
 
   class cabac_decoder {
    public:
-    cabac_decoder(decompressor *d, CABACContext *ctx_in, const uint8_t *buf, int size) {
+    cabac_decoder(decompressor *d, CABACContext *ctx_in, const uint8_t *buf, int size) : d(d) {
       index = d->recognize_coded_block(buf, size);
-      block = &d->in.block(index);
-      out = &d->blocks[index];
+      out = &d->state(index);
+      block = out->block;
       model = nullptr;
 
       if (block->has_cabac()) {
-        model = &d->model;
+        model = d->model;
+        if (out->reset_model) {
+          model->reset_segment();
+        }
         model->reset();
-        decoder.reset(new recoded_code::decoder<const char*, uint8_t>(
-            block->cabac().data(), block->cabac().data() + block->cabac().size()));
+        model->set_cabac_state_base(cabac_state_array(ctx_in));
+        if (block->has_estimator_slot_limit()) {
+          model->set_estimator_limit(block->estimator_slot_limit());
+        }
+        const uint8_t *cabac = reinterpret_cast<const uint8_t*>(block->cabac().data());
+        decoder.reset(new recoded_decoder(cabac, cabac + block->cabac().size(), d->wide_digits()));
+        cabac_out.reserve(block->size());
       } else if (block->has_skip_coded() && block->skip_coded()) {
         // We're skipping this block, so disable calls to our hooks.
         ctx_in->coding_hooks = nullptr;
         ctx_in->coding_hooks_opaque = nullptr;
         ::ff_reset_cabac_decoder(ctx_in, buf, size);
+        finished = true;
       } else {
         throw std::runtime_error("Expected CABAC block.");
       }
     }
-    ~cabac_decoder() { assert(out->done); }
+    // The block state may already have been emitted and released.
+    ~cabac_decoder() { assert(finished); }
+
+    CodingType coding_type() const {
+      return model ? model->coding_type : PIP_UNKNOWN;
+    }
 
     int get(uint8_t *state) {
-     int symbol;
-      if (model->coding_type == PIP_SIGNIFICANCE_EOB) {
-          symbol = std::get<1>(model->get_model_key(state));
-      } else {
+      switch (model->coding_type) {
+        case PIP_SIGNIFICANCE_EOB: {
+          // Follows from the nonzero count, without a model key or estimator.
+          int symbol = model->significance_eob_symbol();
+          put_cabac(symbol, state);
+          model->update_state_tracking<PIP_SIGNIFICANCE_EOB>(symbol);
+          return symbol;
+        }
+        case PIP_SIGNIFICANCE_MAP:
+          return model->dispatch_significance_layout([&](auto layout) {
+            return get_significance<decltype(layout)::value>(state);
+          });
+        case PIP_UNKNOWN:
+        case PIP_RESIDUALS:
+          return get<PIP_RESIDUALS>(state);
+        default: {
+          int symbol;
+          model_key key = model->get_model_key(state);
+          {
+            PROFILE_STAGE(ARITHMETIC);
+            symbol = decoder->get([&](range_t range){
+               return model->probability_for_model_key(range, key); });
+          }
+          put_cabac(symbol, state);
+          model->update_state_for_model_key(symbol, key);
+          return symbol;
+        }
+      }
+    }
+    // A bin of a CodingType known here, without the model dispatching on it.
+    template <CodingType CT>
+    int get(uint8_t *state) {
+      int symbol;
+      model_key key = model->get_model_key<CT>(state);
+      {
+        PROFILE_STAGE(ARITHMETIC);
         symbol = decoder->get([&](range_t range){
-           return model->probability_for_state(range, state); });
+           return model->probability_for_model_key<CT>(range, key); });
       }
-      size_t billable_bytes = cabac_encoder.put(symbol, state);
-      if (billable_bytes) {
-          model->billable_cabac_bytes(billable_bytes);
+      put_cabac(symbol, state);
+      model->update_state_for_model_key<CT>(symbol, key);
+      return symbol;
+    }
+    // A significance map bin, for a sub-block of the given layout.
+    template <significance_layout Layout>
+    int get_significance(uint8_t *state) {
+      int symbol;
+      model_key key = model->significance_key<Layout>();
+      {
+        PROFILE_STAGE(ARITHMETIC);
+        symbol = decoder->get([&](range_t range){
+           return model->probability_for_model_key<PIP_SIGNIFICANCE_MAP>(range, key); });
       }
-      model->update_state(symbol, state);
+      put_cabac(symbol, state);
+      model->update_state_for_model_key<PIP_SIGNIFICANCE_MAP>(symbol, key);
       return symbol;
     }
 
     int get_bypass() {
-      int symbol = decoder->get([&](range_t range){
-          return model->probability_for_state(range, &model->bypass_context); });
-      model->update_state(symbol, &model->bypass_context);
+      model_key key = model->get_model_key(&model->bypass_context);
+      int symbol;
+      {
+        PROFILE_STAGE(ARITHMETIC);
+        symbol = decoder->get([&](range_t range){
+            return model->probability_for_model_key(range, key); });
+      }
+      model->update_state_for_model_key(symbol, key);
       size_t billable_bytes = cabac_encoder.put_bypass(symbol);
       if (billable_bytes) {
           model->billable_cabac_bytes(billable_bytes);
@@ -1467,9 +3320,14 @@ class decompressor {
     }
 
     int get_terminate() {
-      int symbol = decoder->get([&](range_t range){
-          return model->probability_for_state(range, &model->terminate_context); });
-      model->update_state(symbol, &model->terminate_context);
+      model_key key = model->get_model_key(&model->terminate_context);
+      int symbol;
+      {
+        PROFILE_STAGE(ARITHMETIC);
+        symbol = decoder->get([&](range_t range){
+            return model->probability_for_model_key(range, key); });
+      }
+      model->update_state_for_model_key(symbol, key);
       size_t billable_bytes = cabac_encoder.put_terminate(symbol);
       if (billable_bytes) {
           model->billable_cabac_bytes(billable_bytes);
@@ -1485,16 +3343,15 @@ class decompressor {
       bool begin_queue = model && model->begin_coding_type(ct, zigzag_index, param0, param1);
       if (begin_queue && ct) {
         model->finished_queueing(ct,
-              [&](model_key key, int * symbol) {
-               *symbol = decoder->get([&](range_t range){
-                   return model->probability_for_model_key(range, key);
-               });
-               model->update_state_for_model_key(*symbol, key);
+              [&](const model_key &key, int * symbol) {
+               {
+                 PROFILE_STAGE(ARITHMETIC);
+                 *symbol = decoder->get([&](range_t range){
+                     return model->probability_for_model_key<PIP_SIGNIFICANCE_NZ>(range, key);
+                 });
+               }
+               model->update_state_for_model_key<PIP_SIGNIFICANCE_NZ>(*symbol, key);
             });
-        static int i = 0;
-        if (i++ < 10) {
-          std::cerr << "FINISHED QUEUING RECODE: " << (int)model->frames[model->cur_frame].meta_at(model->mb_coord.mb_x, model->mb_coord.mb_y).num_nonzeros[model->mb_coord.scan8_index] << std::endl;
-        }
       }
     }
     void end_coding_type(CodingType ct) {
@@ -1505,6 +3362,13 @@ class decompressor {
     }
 
    private:
+    void put_cabac(int symbol, uint8_t *state) {
+      size_t billable_bytes = cabac_encoder.put(symbol, state);
+      if (billable_bytes) {
+          model->billable_cabac_bytes(billable_bytes);
+      }
+    }
+
     void finish() {
       // Omit trailing byte if it's only a stop bit.
       if (cabac_out.back() == 0x80) {
@@ -1512,24 +3376,356 @@ class decompressor {
       }
       out->out_bytes.assign(reinterpret_cast<const char*>(cabac_out.data()), cabac_out.size());
       out->done = true;
+      finished = true;
+      std::vector<uint8_t>().swap(cabac_out);
+      d->emit_done_blocks();
     }
 
+    decompressor *d;
     int index;
     const Recoded::Block *block;
     block_state *out = nullptr;
+    bool finished = false;
 
     h264_model *model;
-    std::unique_ptr<recoded_code::decoder<const char*, uint8_t>> decoder;
+    std::unique_ptr<recoded_decoder> decoder;
 
     std::vector<uint8_t> cabac_out;
-    cabac::encoder<std::back_insert_iterator<std::vector<uint8_t>>> cabac_encoder{
+    cabac::fast_encoder<std::back_insert_iterator<std::vector<uint8_t>>> cabac_encoder{
       std::back_inserter(cabac_out)};
   };
+  // Bins come from the model as ffmpeg asks for them, in order.
+  static constexpr bool replays_decoded_bins = false;
   h264_model *get_model() {
-    return &model;
+    return model;
   }
 
  private:
+  // The blocks and video packets handled by a segment worker.
+  struct segment_range {
+    int first_block = 0, end_block = std::numeric_limits<int>::max();
+    int64_t first_packet = 0, end_packet = std::numeric_limits<int64_t>::max();
+  };
+
+  // Segment worker: reads the parent's parsed input, but has its own decoder,
+  // model and block states. All blocks are fed to libavformat so the
+  // container parses as usual, but only the segment's packets are decoded.
+  decompressor(const decompressor& parent, int segment_index)
+    : input_filename(parent.input_filename), out_stream(parent.out_stream), in(parent.in),
+      prior(parent.prior), store(parent.store), literals(parent.literals) {
+    use_context(nullptr);
+    const Recoded::Segment& segment = in.segment(segment_index);
+    range.first_block = segment.first_block();
+    range.end_block = segment.first_block() + segment.num_blocks();
+    range.first_packet = segment.first_packet();
+    if (segment_index + 1 < in.segment_size()) {
+      range.end_packet = in.segment(segment_index + 1).first_packet();
+    }
+    if (range.first_block < 0 || range.end_block > in.block_size() || range.first_block > range.end_block) {
+      throw std::runtime_error("Invalid segment block range.");
+    }
+    next_coded_block = range.first_block;
+  }
+
+  // Serial decompressor writing to another stream, reading the parent's input.
+  decompressor(const decompressor& parent, std::ostream& out_stream)
+    : input_filename(parent.input_filename), out_stream(out_stream), in(parent.in),
+      streaming(parent.streaming), stream_pos(parent.stream_pos), stream_end(parent.stream_end),
+      mapped_base(parent.mapped_base), prefetch(parent.prefetch),
+      prior(parent.prior), store(parent.store), literals(parent.literals) {
+    use_context(parent.context);
+  }
+
+  void run_segment(std::string *output) {
+    segment_output = output;
+    mark_model_resets();
+    use_file_prior();
+    // This segment's compressed literals, decompressed on this thread while
+    // the other workers decode theirs. Other workers' literals come from
+    // the shared cache.
+    for (int i = range.first_block; i < range.end_block; i++) {
+      if (in.block(i).has_literal_codec()) {
+        literal_bytes(i, in.block(i));
+      }
+    }
+
+    try {
+      av_decoder<decompressor> d(this, input_filename);
+      d.decode_video(range.first_packet, range.end_packet);
+    } catch (const output_range_done&) {
+      return;
+    }
+
+    emit_done_blocks();
+    if (first_pending < range.end_block) {
+      throw std::runtime_error("Not all blocks were decoded.");
+    }
+  }
+
+  static bool is_stream(const uint8_t *bytes, size_t size) {
+    return size >= sizeof(STREAM_MAGIC) && memcmp(bytes, STREAM_MAGIC, sizeof(STREAM_MAGIC)) == 0;
+  }
+
+  void open_input(const uint8_t *bytes, size_t size) {
+    PROFILE_STAGE(SERIALIZE);
+    if (!is_stream(bytes, size)) {
+      own_in.ParseFromArray(bytes, size);
+    } else {
+      streaming = true;
+      mapped_base = bytes;
+      stream_pos = bytes + sizeof(STREAM_MAGIC);
+      stream_end = bytes + size;
+      const uint8_t *record;
+      size_t record_size;
+      if (!read_record(&stream_pos, stream_end, &record, &record_size) ||
+          !own_in.mutable_metadata()->ParseFromArray(record, record_size)) {
+        throw std::runtime_error("Invalid stream header.");
+      }
+    }
+    check_metadata();
+  }
+
+  void use_file_prior() {
+    if (!in.metadata().has_prior_hash()) {
+      model->set_prior(nullptr);
+      return;
+    }
+    if (!prior || prior->hash() != in.metadata().prior_hash()) {
+      char hash[17];
+      snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)in.metadata().prior_hash());
+      throw std::runtime_error(std::string("File was compressed with prior ") + hash +
+                               (prior ? ", not the one given." : "; give it with --prior."));
+    }
+    model->set_prior(prior);
+  }
+
+  void check_metadata() const {
+    if (own_in.metadata().coder_version() > WIDE_CODER_VERSION) {
+      throw std::runtime_error("Unsupported coder version " +
+                               std::to_string(own_in.metadata().coder_version()) + ".");
+    }
+    // The probabilities have to be those the file was compressed with.
+    if (own_in.metadata().estimator() != h264_model::estimator_policy::ID) {
+      throw std::runtime_error("File was compressed with estimator " +
+                               std::to_string(own_in.metadata().estimator()) + ", this build uses " +
+                               std::to_string(h264_model::estimator_policy::ID) + ".");
+    }
+    if (own_in.metadata().mixing() != uint32_t(h264_model::mixing)) {
+      throw std::runtime_error(own_in.metadata().mixing() ? "File was compressed with mixing, this build has none."
+                                                          : "File was compressed without mixing, this build mixes.");
+    }
+  }
+
+  bool wide_digits() const {
+    return in.metadata().coder_version() == WIDE_CODER_VERSION;
+  }
+
+  void mark_model_resets() {
+    model_reset_blocks.clear();
+    for (const Recoded::Segment& segment : in.segment()) {
+      if (segment.has_model_reset_block()) {
+        model_reset_blocks.resize(in.block_size());
+        model_reset_blocks.at(segment.model_reset_block()) = true;
+      }
+    }
+  }
+
+  // Append the state for block read_index, or return false at the end of the input.
+  bool read_next_block() {
+    assert(first_pending + int(blocks.size()) == read_index);
+    if (!streaming) {
+      if (read_index >= in.block_size()) {
+        return false;
+      }
+      blocks.emplace_back();
+      blocks.back().block = &in.block(read_index);
+      return true;
+    }
+    if (stream_pos == nullptr) {
+      return false;
+    }
+    const uint8_t *record;
+    size_t record_size;
+    if (!read_record(&stream_pos, stream_end, &record, &record_size)) {
+      throw std::runtime_error("Truncated stream.");
+    }
+    if (prefetch) {
+      prefetch->consumed(stream_pos - mapped_base);
+    }
+    if (record_size == 0) {
+      stream_pos = nullptr;  // End of stream.
+      return false;
+    }
+    blocks.emplace_back();
+    block_state& state = blocks.back();
+    state.block = &state.streamed;
+    // Literal-only blocks are referenced in place rather than parsed.
+    const uint8_t *literal = record + 1;
+    const uint8_t *literal_data;
+    size_t literal_size;
+    if (record[0] == LITERAL_TAG &&
+        read_record(&literal, record + record_size, &literal_data, &literal_size) &&
+        literal == record + record_size) {
+      state.literal = true;
+      state.literal_data = reinterpret_cast<const char*>(literal_data);
+      state.literal_size = literal_size;
+    } else if (!state.streamed.ParseFromArray(record, record_size)) {
+      throw std::runtime_error("Invalid stream block.");
+    }
+    return true;
+  }
+
+  block_state& state(int index) {
+    assert(index >= first_pending && index < first_pending + int(blocks.size()));
+    return blocks[index - first_pending];
+  }
+
+  // Write out and release the done blocks at the front of the queue. Coded
+  // blocks must also have been matched to their decoder.
+  void emit_done_blocks() {
+    PROFILE_STAGE(SERIALIZE);
+    while (!blocks.empty() && first_pending < read_index) {
+      block_state& front = blocks.front();
+      if (!front.done || (front.coded && first_pending >= next_coded_block)) {
+        break;
+      }
+      if (first_pending >= range.first_block && first_pending < range.end_block) {
+        std::pair<const char*, size_t> bytes = finish_block(&front);
+        write_output(bytes.first, bytes.second);
+      }
+      blocks.pop_front();
+      first_pending++;
+    }
+  }
+
+  // Write the part of the next size bytes of the original in the output range.
+  void write_output(const char *data, size_t size) {
+    size_t begin = std::max(output_pos, output_begin), end = std::min(output_pos + size, output_end);
+    if (begin < end) {
+      if (segment_output) {
+        segment_output->append(data + (begin - output_pos), end - begin);
+      } else {
+        out_stream.write(data + (begin - output_pos), end - begin);
+      }
+    }
+    output_pos += size;
+  }
+
+  static bool is_literal(const Recoded::Block& block) {
+    return block.has_literal() || block.has_literal_sha256();
+  }
+
+  // The bytes of literal block `index` of the parsed input: as they are
+  // stored, decompressed, or from the literal store.
+  std::pair<const char*, size_t> literal_bytes(int index, const Recoded::Block& block) {
+    if (block.has_literal_codec()) {
+      std::call_once(literals->once.at(index), [&]() {
+        literals->bytes[index] = literal_compression::decompress(block.literal_codec(), block.literal(),
+                                                                 block.size());
+      });
+      return {literals->bytes[index].data(), literals->bytes[index].size()};
+    }
+    if (block.has_literal()) {
+      return {block.literal().data(), block.literal().size()};
+    }
+    if (!store) {
+      throw std::invalid_argument("File has blocks in a literal store; give it with --literal-store.");
+    }
+    if (block.size() < 0) {
+      throw std::runtime_error("Invalid literal block size.");
+    }
+    auto& stored = stored_literals[block.literal_sha256()];
+    if (!stored) {
+      stored = store->get(block.literal_sha256(), block.size());
+    } else if (stored->size != size_t(block.size())) {
+      throw std::runtime_error("Invalid literal block size.");
+    }
+    return {reinterpret_cast<const char*>(stored->data), stored->size};
+  }
+
+  // Bytes of the original a block decodes to, known without decoding it.
+  static size_t original_size(const Recoded::Block& block) {
+    if (block.has_literal_sha256() || block.has_literal_codec()) {
+      return block.size();
+    }
+    if (block.has_literal()) {
+      return block.literal().size();
+    }
+    if (block.has_cabac()) {
+      return block.size() + block.escape_size();
+    }
+    // A skipped slice's bytes are in the literal block after it.
+    return 0;
+  }
+
+  // If only literal blocks of [first_block, end_block), which start at
+  // original offset `offset`, are in the output range, write their part and
+  // return true. Otherwise there is CABAC data to decode: return false.
+  bool write_literal_range(int first_block, int end_block, size_t offset) {
+    int first = -1, end = first_block;
+    for (; end < end_block && offset < output_end; end++) {
+      const Recoded::Block& block = in.block(end);
+      size_t size = original_size(block);
+      if (offset + size > output_begin && size > 0) {
+        if (!is_literal(block)) {
+          return false;
+        }
+        if (first < 0) {
+          first = end;
+          output_pos = offset;
+        }
+      }
+      offset += size;
+    }
+    for (int i = std::max(first, 0); first >= 0 && i < end; i++) {
+      std::pair<const char*, size_t> bytes = literal_bytes(i, in.block(i));
+      write_output(bytes.first, bytes.second);
+    }
+    return true;
+  }
+
+  // The output bytes of a done block. Literals are not copied out of the input.
+  static std::pair<const char*, size_t> finish_block(block_state *block) {
+    if (block->literal) {
+      return {block->literal_data, block->literal_size};
+    }
+    if (block->length_parity != -1) {
+      // Correct for x264 padding: replace last byte or add an extra byte.
+      if (block->length_parity != (int)(block->out_bytes.size() & 1)) {
+        block->out_bytes.insert(block->out_bytes.end(), block->last_byte);
+      } else {
+        block->out_bytes[block->out_bytes.size() - 1] = block->last_byte;
+      }
+    }
+    if (block->block->escape_size() > 0) {
+      // Re-insert the emulation prevention bytes.
+      std::string escaped;
+      escaped.reserve(block->out_bytes.size() + block->block->escape_size());
+      size_t pos = 0;
+      for (uint32_t delta : block->block->escape()) {
+        if (delta > block->out_bytes.size() - pos) {
+          throw std::runtime_error("Invalid escape offset.");
+        }
+        escaped.append(block->out_bytes, pos, delta);
+        escaped.push_back('\x03');
+        pos += delta;
+      }
+      escaped.append(block->out_bytes, pos, std::string::npos);
+      block->out_bytes.swap(escaped);
+    }
+    return {block->out_bytes.data(), block->out_bytes.size()};
+  }
+
+  static void write_at(int fd, off_t offset, const std::string& bytes) {
+    for (size_t written = 0; written < bytes.size(); ) {
+      ssize_t n = pwrite(fd, bytes.data() + written, bytes.size() - written, offset + written);
+      if (n < 0) {
+        throw std::runtime_error("Failed to write output file.");
+      }
+      written += n;
+    }
+  }
+
   // Return a unique 8-byte string containing no zero bytes (NAL-encoding-safe).
   std::string next_surrogate_marker() {
     uint64_t n = surrogate_marker_sequence_number++;
@@ -1551,22 +3747,25 @@ class decompressor {
   }
 
   int recognize_coded_block(const uint8_t* buf, int size) {
-    while (!blocks[next_coded_block].coded) {
+    while (next_coded_block >= read_index || !state(next_coded_block).coded) {
       if (next_coded_block >= read_index) {
         throw std::runtime_error("Coded block expected, but not recorded in the compressed data.");
       }
       next_coded_block++;
     }
+    if (next_coded_block >= range.end_block) {
+      throw std::runtime_error("Coded block outside of its segment.");
+    }
     int index = next_coded_block++;
     // Validate the decoder init call against the coded block's size and surrogate marker.
-    const Recoded::Block& block = in.block(index);
+    const Recoded::Block& block = *state(index).block;
     if (block.has_cabac()) {
-      if (block.size() != size) {
+      if (block.size() + block.escape_size() != size) {
         throw std::runtime_error("Invalid surrogate block size.");
       }
       std::string buf_header(reinterpret_cast<const char*>(buf),
-          blocks[index].surrogate_marker.size());
-      if (blocks[index].surrogate_marker != buf_header) {
+          state(index).surrogate_marker.size());
+      if (state(index).surrogate_marker != buf_header) {
         throw std::runtime_error("Invalid surrogate marker in coded block.");
       }
     } else if (block.has_skip_coded()) {
@@ -1582,11 +3781,55 @@ class decompressor {
   std::string input_filename;
   std::ostream& out_stream;
 
-  Recoded in;
-  int read_index = 0, read_offset = 0;
-  std::string read_block;
+  Recoded own_in;
+  // The parsed input: own_in, or the parent's for a segment worker. For a
+  // streamed input it only holds the metadata, and blocks are parsed from
+  // the remaining records as they are read.
+  const Recoded& in;
+  bool streaming = false;
+  const uint8_t *stream_pos = nullptr, *stream_end = nullptr;
+  uint8_t *mapped_bytes = nullptr;
+  size_t mapped_size = 0;
+  // Start of the mapping for stream_pos, shared with a serial worker, and
+  // what reads ahead in it.
+  const uint8_t *mapped_base = nullptr;
+  std::shared_ptr<prefetcher> prefetch;
+  size_t write_buffer_size = 0;
+  int write_queue_depth = 0;
+  const h264_model::prior_type *prior = nullptr;
+  const literal_store *store = nullptr;
+  // The literal store blocks read so far, by hash, mapped until we're done.
+  std::map<std::string, std::unique_ptr<literal_store::block>> stored_literals;
+
+  segment_range range;
+  // For a segment worker, where its blocks are written.
+  std::string *segment_output = nullptr;
+  // Decompressed literal blocks of the parsed input, by block index, shared
+  // with segment workers. Each is decompressed once, by whichever worker
+  // needs it first.
+  struct literal_cache {
+    explicit literal_cache(int blocks) : once(blocks), bytes(blocks) {}
+    std::vector<std::once_flag> once;
+    std::vector<std::string> bytes;
+  };
+  std::shared_ptr<literal_cache> literals;
+  // Only bytes [output_begin, output_end) of the original are written, and
+  // decoding stops once they are (output_range_done). output_pos is the
+  // original offset of the next block written.
+  size_t output_begin = 0, output_end = std::numeric_limits<size_t>::max();
+  size_t output_pos = 0;
+  struct output_range_done {};
+  std::vector<bool> model_reset_blocks;
+  // The input block being fed to libavformat: a literal or a surrogate.
+  int read_index = 0;
+  const char *read_block = nullptr;
+  size_t read_size = 0, read_offset = 0;
+  std::string surrogate_block;
 
-  std::vector<block_state> blocks;
+  // Blocks that have been read but not yet written out, starting at index
+  // first_pending. Blocks are written in order as soon as they are done.
+  std::deque<block_state> blocks;
+  int first_pending = 0;
 
   // Counter used to generate surrogate markers for coded blocks.
   uint64_t surrogate_marker_sequence_number = 1;
@@ -1594,81 +3837,810 @@ class decompressor {
   // read_packet but not yet decoded. Tail of the queue is read_index.
   int next_coded_block = 0;
 
-  h264_model model;
+  void use_context(recode_context *context) {
+    this->context = context;
+    if (context) {
+      context->model.reset_file();
+      model = &context->model;
+    } else {
+      own_model.reset(new h264_model);
+      model = own_model.get();
+    }
+  }
+  av_io_buffer *io() {
+    return context ? &context->io : nullptr;
+  }
+
+  // A worker's reused I/O buffer and model, or null for our own.
+  recode_context *context = nullptr;
+  std::unique_ptr<h264_model> own_model;
+  h264_model *model = nullptr;
+};
+
+
+// Settings from command-line flags, shared by all commands.
+struct recode_options {
+  // Recode in independent segments of at least this many bytes (0: one segment).
+  size_t segment_bytes = 0;
+  // Threads for segmented recoding (0: one per core).
+  int threads = 0;
+  // ffmpeg frame threads for decoding the input to compress.
+  int decode_threads = 1;
+  // Files the test command roundtrips at once, each in its own process, or
+  // connections the server handles at once, each on a worker of its own.
+  int jobs = 1;
+  // Write the streamed container instead of one Recoded message.
+  bool stream = false;
+  // Recode NAL-escaped slices instead of skipping them.
+  bool recode_escaped = false;
+  // Recode with 32-bit arithmetic code digits.
+  bool wide_digits = false;
+  // Compress the literal blocks that compress well.
+  bool compress_literals = false;
+  // Write the profile counters as JSON to this file when done.
+  std::string profile_filename;
+  // Record the bins coded by the compressor to this file.
+  std::string trace_filename;
+  // Start the estimators from this prior (see train_prior).
+  std::string prior_filename;
+  // Keep literal blocks of at least literal_store_min_size bytes in this
+  // store directory (see literal_store.h), and find them there.
+  std::string literal_store_directory;
+  size_t literal_store_min_size = 64 * 1024;
+  // Size of the demuxer's I/O buffer and of the output buffers, and how many
+  // of those read ahead of the decoder or wait for the writer.
+  size_t io_buffer_bytes = 1024 * 1024;
+  int io_queue_depth = 4;
+  // Memory the process tries to stay under (see memory_budget.h); 0: no limit.
+  size_t max_memory_bytes = 0;
+} options;
+
+int option_threads() {
+  return options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// The prior given with --prior, mapped on first use and kept for the rest of
+// the process. Null if there is none.
+const h264_model::prior_type *option_prior() {
+  static std::once_flag loaded;
+  static std::unique_ptr<h264_model::prior_type> prior;
+  std::call_once(loaded, []() {
+    if (!options.prior_filename.empty()) {
+      prior.reset(new h264_model::prior_type(options.prior_filename));
+    }
+  });
+  return prior.get();
+}
+
+// The store given with --literal-store, opened on first use. Null if there
+// is none.
+const literal_store *option_literal_store() {
+  static std::once_flag opened;
+  static std::unique_ptr<literal_store> store;
+  std::call_once(opened, []() {
+    if (!options.literal_store_directory.empty()) {
+      store.reset(new literal_store(options.literal_store_directory));
+    }
+  });
+  return store.get();
+}
+
+// Readahead window for the inputs, from --io-buffer-size and --io-queue-depth.
+size_t option_readahead() {
+  return options.io_buffer_bytes * std::max(0, options.io_queue_depth);
+}
+
+// Calls write(out) with an out that writes to `to` on a writer thread (see
+// async_writer), or `to` itself with --io-queue-depth=0.
+template <typename Write>
+void write_async(std::ostream& to, const Write& write) {
+  if (options.io_queue_depth <= 0) {
+    write(to);
+    return;
+  }
+  async_writer writer(to, options.io_buffer_bytes, options.io_queue_depth);
+  std::ostream out(&writer);
+  write(out);
+  writer.finish();
+}
+
+void run_compressor(compressor& c, const int input_index = 0) {
+  PROFILE_STAGE(COMPRESS);
+  c.set_streaming(options.stream);
+  c.set_recode_escaped(options.recode_escaped);
+  c.set_wide_digits(options.wide_digits);
+  c.set_compress_literals(options.compress_literals);
+  c.set_prior(option_prior());
+  c.set_literal_store(option_literal_store(), options.literal_store_min_size);
+  c.set_decode_threads(options.decode_threads);
+  c.set_readahead(option_readahead());
+  std::unique_ptr<bin_trace_writer> trace;
+  if (!options.trace_filename.empty()) {
+    trace.reset(new bin_trace_writer(options.trace_filename));
+    c.set_trace(trace.get());
+  }
+  if (options.segment_bytes > 0) {
+    c.run_segmented(options.segment_bytes, option_threads(), input_index);
+  } else {
+    c.run(input_index);
+  }
+  c.set_trace(nullptr);
+}
+
+void run_decompressor(decompressor& d, const std::string& output_filename = "") {
+  PROFILE_STAGE(DECOMPRESS);
+  d.set_prior(option_prior());
+  d.set_literal_store(option_literal_store());
+  d.set_readahead(option_readahead());
+  d.set_write_queue(options.io_buffer_bytes, options.io_queue_depth);
+  d.run_segmented(option_threads(), output_filename);
+}
+
+void run_decompressor_range(decompressor& d, size_t offset, size_t length) {
+  PROFILE_STAGE(DECOMPRESS);
+  d.set_prior(option_prior());
+  d.set_literal_store(option_literal_store());
+  d.set_readahead(option_readahead());
+  d.run_range(offset, length, option_threads());
+}
+
+void write_profile() {
+  if (options.profile_filename.empty()) {
+    return;
+  }
+  std::ofstream profile_file(options.profile_filename);
+  if (!profile_file) {
+    throw std::runtime_error("Failed to open profile output: " + options.profile_filename);
+  }
+  profile::write_json(profile_file);
+}
+
+// Appends everything written to a string, without the copy that
+// std::stringstream::str() makes.
+class string_appender : public std::streambuf {
+ public:
+  explicit string_appender(std::string *out) : out(out) {}
+ protected:
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    out->append(s, n);
+    return n;
+  }
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      out->push_back(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+  }
+ private:
+  std::string *out;
+};
+
+// Compares everything written against expected bytes as it is written, so
+// output can be checked without being kept.
+class comparing_streambuf : public std::streambuf {
+ public:
+  comparing_streambuf(const uint8_t *expected, size_t size) : expected(expected), size(size) {}
+
+  // Whether exactly the expected bytes have been written.
+  bool matches() const {
+    return !differs && written == size;
+  }
+  // Offset of the first difference, or of the end of the shorter of the two.
+  size_t first_difference() const {
+    return differs ? difference : std::min(written, size);
+  }
+
+ protected:
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    if (!differs) {
+      size_t available = written < size ? size - written : 0;
+      size_t compared = std::min<size_t>(n, available);
+      const uint8_t *bytes = reinterpret_cast<const uint8_t*>(s);
+      if (memcmp(bytes, expected + written, compared) != 0) {
+        differs = true;
+        difference = written;
+        while (bytes[difference - written] == expected[difference]) difference++;
+      } else if (compared < size_t(n)) {
+        differs = true;
+        difference = size;
+      }
+    }
+    written += n;
+    return n;
+  }
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      char byte = traits_type::to_char_type(c);
+      xsputn(&byte, 1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+ private:
+  const uint8_t *expected;
+  size_t size;
+  size_t written = 0;
+  bool differs = false;
+  size_t difference = 0;
 };
 
+// Compresses and decompresses a file, comparing the decompressed bytes
+// against the mapped original as they are produced. Only the compressed file
+// is kept in memory.
+int roundtrip(const std::string& input_filename, std::ostream* out, roundtrip_result* result = NULL, const int input_index = 0) {
+  uint8_t *original_bytes;
+  size_t original_size;
+  if (av_file_map(input_filename.c_str(), &original_bytes, &original_size, 0, NULL) < 0) {
+    throw std::invalid_argument("Failed to open file: " + input_filename);
+  }
+  defer<> unmap([&]() { av_file_unmap(original_bytes, original_size); });
 
-int roundtrip(const std::string& input_filename, std::ostream* out, int* compression_time = NULL, int* decompression_time = NULL, const int input_index = 0) {
-  std::stringstream original, compressed, decompressed;
-  original << std::ifstream(input_filename).rdbuf();
+  std::string compressed;
+  string_appender compressed_buf(&compressed);
+  std::ostream compressed_stream(&compressed_buf);
   auto c1 = std::chrono::high_resolution_clock::now();
-  compressor c(input_filename, compressed);
-  c.run(input_index);
+  compressor c(input_filename, compressed_stream);
+  run_compressor(c, input_index);
   auto c2 = std::chrono::high_resolution_clock::now();
+
+  comparing_streambuf decompressed_buf(original_bytes, original_size);
+  std::ostream decompressed(&decompressed_buf);
   auto d1 = std::chrono::high_resolution_clock::now();
-  decompressor d(input_filename, compressed.str(), decompressed);
-  d.run();
+  decompressor d(input_filename, compressed, decompressed);
+  run_decompressor(d);
   auto d2 = std::chrono::high_resolution_clock::now();
 
-  if (compression_time != NULL && decompression_time != NULL) {
-    *compression_time = std::chrono::duration_cast<std::chrono::milliseconds>(c2 - c1).count();
-    *decompression_time = std::chrono::duration_cast<std::chrono::milliseconds>(d2 - d1).count();
-  }
-  
-  if (original.str() == decompressed.str()) {
-    if (out) {
-      (*out) << compressed.str();
+  bool succeeded = decompressed_buf.matches();
+  if (result != NULL) {
+    const video_info& video = c.input_video();
+    snprintf(result->video_stream, sizeof(result->video_stream), "%s", video.stream.c_str());
+    result->duration_seconds = video.duration_seconds;
+    result->fps = video.fps;
+    result->original_bytes = original_size;
+    result->compressed_bytes = compressed.size();
+    result->compression_ms = std::chrono::duration_cast<std::chrono::milliseconds>(c2 - c1).count();
+    result->decompression_ms = std::chrono::duration_cast<std::chrono::milliseconds>(d2 - d1).count();
+    result->succeeded = succeeded;
+    for (int i = 0; i < memory::NUM_SUBSYSTEMS; i++) {
+      result->peak_bytes[i] = memory::peak(memory::subsystem(i));
     }
-    double ratio = compressed.str().size() * 1.0 / original.str().size();
+  }
 
-    Recoded compressed_proto;
-    compressed_proto.ParseFromString(compressed.str());
-    int proto_block_bytes = 0;
-    for (const auto& block : compressed_proto.block()) {
-      proto_block_bytes += block.literal().size() + block.cabac().size();
+  if (succeeded) {
+    if (out) {
+      out->write(compressed.data(), compressed.size());
     }
-    double proto_overhead = (compressed.str().size() - proto_block_bytes) * 1.0 / compressed.str().size();
+    double ratio = compressed.size() * 1.0 / original_size;
+    double proto_overhead = (compressed.size() - c.block_payload_bytes()) * 1.0 / compressed.size();
 
     std::cerr << "Compress-decompress roundtrip succeeded:" << std::endl;
     std::cerr << " compression ratio: " << ratio*100. << "%" << std::endl;
     std::cerr << " protobuf overhead: " << proto_overhead*100. << "%" << std::endl;
+    std::cerr << " peak accounted memory:";
+    for (int i = 0; i < memory::NUM_SUBSYSTEMS; i++) {
+      std::cerr << " " << memory::subsystem_names[i] << " " << memory::peak(memory::subsystem(i)) / 1000000.0 << " MB";
+    }
+    std::cerr << std::endl;
     return 0;
   } else {
-    std::cerr << "Compress-decompress roundtrip failed." << std::endl;
+    std::cerr << "Compress-decompress roundtrip failed: output differs from byte "
+              << decompressed_buf.first_difference() << "." << std::endl;
     return 1;
   }
 }
 
+// Trains a prior on the video files in corpus_directory: the estimators of
+// each slot start from the ratio of ones and zeros coded with it over the
+// corpus. Files that fail to compress are skipped.
+void train_prior(const std::string& corpus_directory, const std::string& prior_filename) {
+  std::vector<std::string> filenames;
+  for (const auto& entry : std::filesystem::directory_iterator(corpus_directory)) {
+    if (entry.is_regular_file()) {
+      filenames.push_back(entry.path().string());
+    }
+  }
+  std::sort(filenames.begin(), filenames.end());
+  prior_counts counts;
+  int trained = 0;
+  for (const std::string& filename : filenames) {
+    try {
+      // Only the model's counts are wanted.
+      std::ostream discard(nullptr);
+      compressor c(filename, discard);
+      c.get_model()->count_symbols();
+      c.run();
+      c.get_model()->add_symbol_counts(&counts);
+      trained++;
+    } catch (const std::exception& e) {
+      std::cerr << "Skipping " << filename << ": " << e.what() << std::endl;
+    }
+  }
+  if (trained == 0) {
+    throw std::invalid_argument("No files to train a prior on in " + corpus_directory);
+  }
+  uint64_t hash = h264_model::prior_type::write(prior_filename, counts);
+  fprintf(stderr, "Prior %016llx : %d files, %zu dynamic keys\n",
+          (unsigned long long)hash, trained, counts.dynamic.size());
+}
+
+// Codes random significance maps through the model as the compressor does,
+// a map at a time and specialized for its layout, then decodes them as the
+// decompressor does: a bin at a time through the model's generic entry
+// points, which dispatch on coding_type and the layout for each, with each
+// bin's significance known only once it is decoded. Reports the time per
+// map bin of both, and fails unless every bin decodes as it was coded.
+bool benchmark_model(size_t num_maps) {
+  constexpr int MB_WIDTH = 45, MB_HEIGHT = 30;
+  // sub_mb_cat, sub_mb_size, is_dc and chroma422 of the kinds of sub-block.
+  enum { LUMA_DC, LUMA_AC, LUMA_4X4, CHROMA_DC, CHROMA422_DC, CHROMA_AC, LUMA_8X8 };
+  static const int kinds[][4] = {{0, 16, 1, 0}, {1, 15, 0, 0}, {2, 16, 0, 0}, {3, 4, 1, 0},
+                                 {3, 8, 1, 1}, {4, 15, 0, 0}, {5, 64, 0, 0}};
+  struct sub_mb_map {
+    const int *kind;
+    int mb_x, mb_y, scan8_index;
+    bool new_frame;  // The first sub-block of a frame.
+    std::vector<uint8_t> bins;  // Significance and EOB bins, in coding order.
+  };
+  std::mt19937 random(1);
+  std::vector<sub_mb_map> maps;
+  size_t map_bins = 0;
+  // Macroblocks of sub-blocks in the order H.264 codes them, at the scan8
+  // indexes ffmpeg gives them: the luma as a DC and 16 AC blocks, 16 4x4
+  // blocks or four 8x8 ones, then the chroma DC and AC blocks. A few
+  // macroblocks have no coefficients.
+  int last_frame = -1;
+  for (int mb = 0; maps.size() < num_maps; mb++) {
+    if (random() % 8 == 0) {
+      continue;
+    }
+    int frame = mb / (MB_WIDTH * MB_HEIGHT);
+    // The frame's chroma format alternates.
+    bool chroma422 = frame % 2;
+    std::vector<std::pair<int, int>> sub_mbs;  // Kind and scan8 index.
+    switch (random() % 3) {
+      case 0:
+        sub_mbs.push_back({LUMA_DC, 48});
+        for (int i = 0; i < 16; i++) {
+          sub_mbs.push_back({LUMA_AC, i});
+        }
+        break;
+      case 1:
+        for (int i = 0; i < 16; i++) {
+          sub_mbs.push_back({LUMA_4X4, i});
+        }
+        break;
+      default:
+        for (int i = 0; i < 16; i += 4) {
+          sub_mbs.push_back({LUMA_8X8, i});
+        }
+        break;
+    }
+    sub_mbs.push_back({chroma422 ? CHROMA422_DC : CHROMA_DC, 49});
+    sub_mbs.push_back({chroma422 ? CHROMA422_DC : CHROMA_DC, 50});
+    for (int plane = 16; plane <= 32; plane += 16) {
+      for (int i = 0; i < (chroma422 ? 8 : 4); i++) {
+        sub_mbs.push_back({CHROMA_AC, plane + i});
+      }
+    }
+    for (const auto& sub_mb : sub_mbs) {
+      maps.emplace_back();
+      sub_mb_map& map = maps.back();
+      map.kind = kinds[sub_mb.first];
+      map.mb_x = mb % MB_WIDTH;
+      map.mb_y = mb / MB_WIDTH % MB_HEIGHT;
+      map.scan8_index = sub_mb.second;
+      map.new_frame = frame != last_frame;
+      last_frame = frame;
+      int size = map.kind[1];
+      // Mostly sparse, with the low frequencies more likely significant.
+      uint32_t density = random() % 1000;
+      std::vector<int> significant(size);
+      int last = random() % size;
+      significant[last] = 1;
+      for (int j = 0; j < last; j++) {
+        significant[j] = random() % 1000 < density * (size - j) / size;
+      }
+      for (int j = 0; j < size - 1; j++) {
+        map.bins.push_back(significant[j]);
+        map_bins++;
+        if (significant[j]) {
+          map.bins.push_back(j == last);
+          if (j == last) {
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  // Sets the model up for the sub-block of map, as the hooks do.
+  auto begin_map = [&](h264_model *model, const sub_mb_map& map, int *frame_num) {
+    if (map.new_frame) {
+      model->update_frame_spec((*frame_num)++, MB_WIDTH, MB_HEIGHT);
+    }
+    model->mb_coord.mb_x = map.mb_x;
+    model->mb_coord.mb_y = map.mb_y;
+    model->mb_coord.scan8_index = map.scan8_index;
+    model->sub_mb_cat = map.kind[0];
+    model->sub_mb_size = map.kind[1];
+    model->sub_mb_is_dc = map.kind[2];
+    model->sub_mb_chroma422 = map.kind[3];
+    model->begin_coding_type(PIP_SIGNIFICANCE_MAP, 0, 0, 0);
+  };
+
+  // The compressor: the map is queued and tracked, then the nonzero count
+  // and the queued bins are coded.
+  std::vector<uint8_t> coded;
+  double coding_seconds = 0;
+  {
+    std::unique_ptr<h264_model> model(new h264_model);
+    recoded_encoder<std::back_insert_iterator<std::vector<uint8_t>>> encoder(std::back_inserter(coded), false);
+    int frame_num = 0;
+    significance_bin queued[64];
+    for (const sub_mb_map& map : maps) {
+      begin_map(model.get(), map, &frame_num);
+      size_t count = 0;
+      for (uint8_t symbol : map.bins) {
+        if (model->coding_type == PIP_SIGNIFICANCE_MAP) {
+          queued[count++] = {symbol, uint8_t(model->mb_coord.zigzag_index), uint8_t(model->nonzeros_observed)};
+        }
+        model->update_state_tracking(symbol);
+      }
+      model->end_coding_type(PIP_SIGNIFICANCE_MAP);
+      model->finished_queueing(PIP_SIGNIFICANCE_MAP, [&](const model_key &key, int *symbol) {
+        encoder.put(*symbol, [&](range_t range) {
+            return model->probability_for_model_key<PIP_SIGNIFICANCE_NZ>(range, key); });
+        model->update_state_for_model_key<PIP_SIGNIFICANCE_NZ>(*symbol, key);
+      });
+      auto start = std::chrono::steady_clock::now();
+      model->code_queued_significance(queued, count, [&](const model_key &key, int symbol) {
+        encoder.put(symbol, [&](range_t range) {
+            return model->probability_for_model_key<PIP_SIGNIFICANCE_MAP>(range, key); });
+      });
+      coding_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      model->coding_type = PIP_UNKNOWN;
+    }
+    encoder.finish();
+  }
+
+  // The decompressor: the nonzero count is decoded first, then each bin,
+  // tracked as it comes. EOB bins follow from the count.
+  double decoding_seconds = 0;
+  {
+    std::unique_ptr<h264_model> model(new h264_model);
+    recoded_decoder decoder(coded.data(), coded.data() + coded.size(), false);
+    int frame_num = 0;
+    std::vector<uint8_t> decoded;
+    for (size_t i = 0; i < maps.size(); i++) {
+      const sub_mb_map& map = maps[i];
+      begin_map(model.get(), map, &frame_num);
+      model->finished_queueing(PIP_SIGNIFICANCE_MAP, [&](const model_key &key, int *symbol) {
+        *symbol = decoder.get([&](range_t range) {
+            return model->probability_for_model_key<PIP_SIGNIFICANCE_NZ>(range, key); });
+        model->update_state_for_model_key<PIP_SIGNIFICANCE_NZ>(*symbol, key);
+      });
+      decoded.clear();
+      auto start = std::chrono::steady_clock::now();
+      while (model->coding_type == PIP_SIGNIFICANCE_MAP || model->coding_type == PIP_SIGNIFICANCE_EOB) {
+        int symbol;
+        if (model->coding_type == PIP_SIGNIFICANCE_EOB) {
+          symbol = model->significance_eob_symbol();
+          model->update_state_tracking(symbol);
+        } else {
+          model_key key = model->get_model_key(&model->significance_context);
+          symbol = decoder.get([&](range_t range) { return model->probability_for_model_key(range, key); });
+          model->update_state_for_model_key(symbol, key);
+        }
+        decoded.push_back(symbol);
+      }
+      decoding_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      model->end_coding_type(PIP_SIGNIFICANCE_MAP);
+      if (decoded != map.bins) {
+        std::cerr << "Map " << i << " (" << map.kind[1] << " coefficients) decoded differently." << std::endl;
+        return false;
+      }
+    }
+  }
+  std::cout << num_maps << " maps, " << map_bins << " significance bins, " << coded.size() << " bytes" << std::endl;
+  std::cout << "specialized coding: " << coding_seconds * 1e9 / map_bins << " ns/bin" << std::endl;
+  std::cout << "per-bin decoding: " << decoding_seconds * 1e9 / map_bins << " ns/bin" << std::endl;
+  return true;
+}
+
+// Recodes one file after another in a long-running process, reusing the I/O
+// buffer and the model's estimator and frame storage between files. Each
+// file is coded exactly as by a new process.
+class recode_worker {
+ public:
+  struct job_result {
+    size_t input_bytes = 0;
+    size_t output_bytes = 0;
+    double milliseconds = 0;
+  };
+
+  job_result compress(const std::string& input_filename, const std::string& output_filename) {
+    auto start = std::chrono::steady_clock::now();
+    std::ofstream out_file(output_filename, std::ios::binary);
+    if (!out_file) {
+      throw std::invalid_argument("Failed to open output file: " + output_filename);
+    }
+    write_async(out_file, [&](std::ostream& out) {
+      compressor c(input_filename, out, &context);
+      run_compressor(c);
+    });
+    return finish(start, input_filename, out_file);
+  }
+
+  job_result decompress(const std::string& input_filename, const std::string& output_filename) {
+    auto start = std::chrono::steady_clock::now();
+    std::ofstream out_file(output_filename, std::ios::binary);
+    if (!out_file) {
+      throw std::invalid_argument("Failed to open output file: " + output_filename);
+    }
+    write_async(out_file, [&](std::ostream& out) {
+      decompressor d(input_filename, out, &context);
+      run_decompressor(d);
+    });
+    return finish(start, input_filename, out_file);
+  }
+
+ private:
+  static job_result finish(std::chrono::steady_clock::time_point start, const std::string& input_filename,
+                           std::ofstream& out_file) {
+    std::streamoff output_bytes = out_file.tellp();
+    out_file.close();
+    if (!out_file || output_bytes < 0) {
+      throw std::runtime_error("Failed to write output file.");
+    }
+    job_result result;
+    result.input_bytes = std::filesystem::file_size(input_filename);
+    result.output_bytes = output_bytes;
+    result.milliseconds = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    return result;
+  }
+
+  recode_context context;
+};
+
+// Answers requests read line by line from in_fd, one line per request:
+//   compress <input> <output>
+//   decompress <input> <output>
+//   quit
+// with "ok <input bytes> <output bytes> <milliseconds>" or "error <message>"
+// written to out_fd. Paths can't contain whitespace. Returns at quit or at the
+// end of the input.
+void serve_requests(recode_worker& worker, int in_fd, int out_fd) {
+  FILE *in = fdopen(dup(in_fd), "r");
+  if (in == nullptr) {
+    throw std::runtime_error("Failed to read requests.");
+  }
+  defer<> close_in([in]() { fclose(in); });
+  char *line = nullptr;
+  size_t capacity = 0;
+  defer<> free_line([&line]() { free(line); });
+  while (getline(&line, &capacity, in) >= 0) {
+    std::istringstream request(line);
+    std::string command, input_filename, output_filename, extra;
+    request >> command >> input_filename >> output_filename;
+    if (command.empty()) {
+      continue;
+    }
+    if (command == "quit") {
+      break;
+    }
+    std::string response;
+    try {
+      recode_worker::job_result result;
+      if (output_filename.empty() || (request >> extra)) {
+        throw std::invalid_argument("Expected: " + command + " <input> <output>");
+      } else if (command == "compress") {
+        result = worker.compress(input_filename, output_filename);
+      } else if (command == "decompress") {
+        result = worker.decompress(input_filename, output_filename);
+      } else {
+        throw std::invalid_argument("Unknown command: " + command);
+      }
+      response = "ok " + std::to_string(result.input_bytes) + " " + std::to_string(result.output_bytes) + " " +
+                 std::to_string(int64_t(result.milliseconds)) + "\n";
+    } catch (const std::exception& e) {
+      std::string message = e.what();
+      std::replace(message.begin(), message.end(), '\n', ' ');
+      response = "error " + message + "\n";
+    }
+    for (size_t written = 0; written < response.size(); ) {
+      ssize_t n = write(out_fd, response.data() + written, response.size() - written);
+      if (n <= 0) {
+        return;
+      }
+      written += n;
+    }
+  }
+}
+
+// Serves requests from stdin to stdout if socket_path is "-", and otherwise
+// from connections to a Unix domain socket at socket_path, with one worker
+// per concurrent connection, up to the number of jobs.
+void serve(const std::string& socket_path, int jobs) {
+  if (socket_path == "-") {
+    recode_worker worker;
+    serve_requests(worker, STDIN_FILENO, STDOUT_FILENO);
+    return;
+  }
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    throw std::invalid_argument("Socket path too long: " + socket_path);
+  }
+  memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+  // Replace the socket of an earlier server, but nothing else.
+  struct stat existing;
+  if (stat(socket_path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+    unlink(socket_path.c_str());
+  }
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(listen_fd, 64) != 0) {
+    throw std::runtime_error("Failed to listen on " + socket_path);
+  }
+  defer<> close_listen([listen_fd]() { close(listen_fd); });
+  // A client that goes away shouldn't take the server with it.
+  signal(SIGPIPE, SIG_IGN);
+  std::cerr << "Serving on " << socket_path << std::endl;
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < std::max(1, jobs); i++) {
+    threads.emplace_back([listen_fd]() {
+      recode_worker worker;
+      while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+          if (errno == EINTR || errno == ECONNABORTED) continue;
+          return;
+        }
+        try {
+          serve_requests(worker, fd, fd);
+        } catch (const std::exception& e) {
+          std::cerr << "Exception (" << typeid(e).name() << "): " << e.what() << std::endl;
+        }
+        close(fd);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
 int
 main(int argc, char **argv) {
   av_register_all();
+  profile::set_coding_type_names(billing_names, sizeof(billing_names) / sizeof(billing_names[0]));
 
-  if (argc < 3 || argc > 4) {
-    std::cerr << "Usage: " << argv[0] << " [compress|decompress|roundtrip] <input> [output]" << std::endl;
+  std::vector<std::string> args;
+  for (int i = 0; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 15, "--segment-size=") == 0) {
+      options.segment_bytes = std::stoull(arg.substr(15)) * 1024 * 1024;
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      options.threads = std::stoi(arg.substr(10));
+    } else if (arg.compare(0, 17, "--decode-threads=") == 0) {
+      options.decode_threads = std::stoi(arg.substr(17));
+    } else if (arg.compare(0, 7, "--jobs=") == 0) {
+      options.jobs = std::stoi(arg.substr(7));
+    } else if (arg == "--stream") {
+      options.stream = true;
+    } else if (arg == "--recode-escaped") {
+      options.recode_escaped = true;
+    } else if (arg == "--wide-digits") {
+      options.wide_digits = true;
+    } else if (arg == "--compress-literals") {
+      options.compress_literals = true;
+    } else if (arg.compare(0, 10, "--profile=") == 0) {
+      options.profile_filename = arg.substr(10);
+    } else if (arg.compare(0, 8, "--trace=") == 0) {
+      options.trace_filename = arg.substr(8);
+    } else if (arg.compare(0, 8, "--prior=") == 0) {
+      options.prior_filename = arg.substr(8);
+    } else if (arg.compare(0, 17, "--io-buffer-size=") == 0) {
+      options.io_buffer_bytes = std::max<size_t>(std::stoull(arg.substr(17)), 4) * 1024;
+    } else if (arg.compare(0, 17, "--io-queue-depth=") == 0) {
+      options.io_queue_depth = std::stoi(arg.substr(17));
+    } else if (arg.compare(0, 16, "--literal-store=") == 0) {
+      options.literal_store_directory = arg.substr(16);
+    } else if (arg.compare(0, 25, "--literal-store-min-size=") == 0) {
+      options.literal_store_min_size = std::stoull(arg.substr(25));
+    } else if (arg.compare(0, 13, "--max-memory=") == 0) {
+      options.max_memory_bytes = std::stoull(arg.substr(13)) * 1024 * 1024;
+    } else {
+      args.push_back(arg);
+    }
+  }
+  // decompress-range <input> <offset> <length> [output]
+  bool range_command = args.size() > 1 && args[1] == "decompress-range";
+  if (args.size() < (range_command ? 5 : 3) || args.size() > (range_command ? 6 : 4)) {
+    std::cerr << "Usage: " << argv[0] << " [compress|decompress|roundtrip|test] <input> [output]" << std::endl;
+    std::cerr << "       " << argv[0] << " decompress-range <input> <offset> <length> [output]" << std::endl;
+    std::cerr << "       " << argv[0] << " serve <socket|->" << std::endl;
+    std::cerr << "       " << argv[0] << " train-prior <corpus directory> <prior>" << std::endl;
+    std::cerr << "       " << argv[0] << " benchmark-model <significance maps>" << std::endl;
+    std::cerr << "  --segment-size=<MB>  recode independent segments in parallel" << std::endl;
+    std::cerr << "  --threads=<n>        threads for segmented (de)compression (default: all cores)" << std::endl;
+    std::cerr << "  --decode-threads=<n> ffmpeg frame threads decoding the input to compress (default: 1)" << std::endl;
+    std::cerr << "  --jobs=<n>           files test or serve handles in parallel (default: 1)" << std::endl;
+    std::cerr << "  --stream             compress to the streamed container, one block at a time" << std::endl;
+    std::cerr << "  --recode-escaped     recode NAL-escaped slices instead of storing them" << std::endl;
+    std::cerr << "  --wide-digits        recode with 32-bit arithmetic code digits (faster decoding)" << std::endl;
+    std::cerr << "  --compress-literals  deflate the literal blocks that compress well" << std::endl;
+    std::cerr << "  --profile=<file>     write per-stage and per-CodingType timings as JSON" << std::endl;
+    std::cerr << "  --trace=<file>       record the compressor's bins for test/bin_trace_benchmark" << std::endl;
+    std::cerr << "  --prior=<file>       start the estimators from a prior from train-prior" << std::endl;
+    std::cerr << "  --io-buffer-size=<KB> input and output buffer size (default: 1024)" << std::endl;
+    std::cerr << "  --io-queue-depth=<n> buffers read ahead and queued for writing (default: 4; 0: none)"
+              << std::endl;
+    std::cerr << "  --literal-store=<dir> keep large literal blocks in a store shared by many files" << std::endl;
+    std::cerr << "  --literal-store-min-size=<bytes> smallest literal block put in the store (default: 65536)"
+              << std::endl;
+    std::cerr << "  --max-memory=<MB>    degrade gracefully to stay under this much memory (default: no limit)"
+              << std::endl;
     return 1;
   }
-  std::string command = argv[1];
-  std::string input_filename = argv[2];
+  av_io_buffer::size = options.io_buffer_bytes;
+  memory::set_budget(options.max_memory_bytes);
+  std::string command = args[1];
+  std::string input_filename = args[2];
   std::ofstream out_file;
-  if (argc > 3) {
-    out_file.open(argv[3]);
+  // Only for the commands that write to it: opening truncates the file, and
+  // train-prior writes its own, once the prior is trained.
+  bool writes_out_file = command == "compress" || command == "decompress" || range_command ||
+                         command == "roundtrip";
+  if (writes_out_file && args.size() > (range_command ? 5 : 3)) {
+    out_file.open(args.back());
   }
 
   try {
     if (command == "compress") {
-      compressor c(input_filename, out_file.is_open() ? out_file : std::cout);
-      c.run();
+      write_async(out_file.is_open() ? out_file : std::cout, [&](std::ostream& out) {
+        compressor c(input_filename, out);
+        run_compressor(c);
+      });
     } else if (command == "decompress") {
-      decompressor d(input_filename, out_file.is_open() ? out_file : std::cout);
-      d.run();
+      if (args.size() > 3) {
+        // Segments are written straight to their offsets in the output file.
+        out_file.close();
+        decompressor d(input_filename, std::cout);
+        run_decompressor(d, args[3]);
+      } else {
+        write_async(std::cout, [&](std::ostream& out) {
+          decompressor d(input_filename, out);
+          run_decompressor(d);
+        });
+      }
+    } else if (command == "decompress-range") {
+      write_async(out_file.is_open() ? out_file : std::cout, [&](std::ostream& out) {
+        decompressor d(input_filename, out);
+        run_decompressor_range(d, std::stoull(args[3]), std::stoull(args[4]));
+      });
     } else if (command == "roundtrip") {
-      return roundtrip(input_filename, out_file.is_open() ? &out_file : nullptr);
+      int result = roundtrip(input_filename, out_file.is_open() ? &out_file : nullptr);
+      write_profile();
+      return result;
     } else if (command == "test") {
-      perf_test_driver(input_filename, roundtrip);
+      perf_test_driver(input_filename, roundtrip, options.jobs);
       return 0;
+    } else if (command == "serve") {
+      serve(input_filename, options.jobs);
+    } else if (command == "benchmark-model") {
+      return benchmark_model(std::stoull(input_filename)) ? 0 : 1;
+    } else if (command == "train-prior") {
+      if (args.size() < 4) {
+        throw std::invalid_argument("train-prior needs an output file.");
+      }
+      train_prior(input_filename, args[3]);
     } else {
       throw std::invalid_argument("Unknown command: " + command);
     }
+    write_profile();
   } catch (const std::exception& e) {
     std::cerr << "Exception (" << typeid(e).name() << "): " << e.what() << std::endl;
     return 1;
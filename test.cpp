@@ -1,153 +1,209 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <filesystem>
-
+#include <map>
+#include <stdexcept>
+#include <typeinfo>
+#include <vector>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "profile.h"
 #include "test.h"
 
-// Counts the number of files in a given directory, excluding folders/subdirectories
-int count_files(const std::string &directory_path) {
-  int total_files = 0;
+// Lists the files in a given directory, excluding folders/subdirectories
+std::vector<std::string> list_files(const std::string &directory_path) {
+  std::vector<std::string> filepaths;
   for (const auto& entry : std::filesystem::directory_iterator(directory_path)) {
     if (is_regular_file(entry.path())) {
-      ++total_files;
+      filepaths.push_back(entry.path().string());
     }
   }
-  return total_files;
+  return filepaths;
+}
+
+// Formats seconds as HH:MM:SS.cc, the way ffmpeg prints durations
+std::string format_duration(double seconds) {
+  int centiseconds = int(seconds * 100 + 0.5);
+  char formatted[32];
+  snprintf(formatted, sizeof(formatted), "%02d:%02d:%02d.%02d", centiseconds / 360000,
+           centiseconds / 6000 % 60, centiseconds / 100 % 60, centiseconds % 100);
+  return formatted;
 }
 
 // Formats and generates an CSV file of collected metrics and results
-void output_metrics_csv(const std::string &directory_path, 
-                        const int total_files,
-                        std::string filepaths[],
-                        std::string durations[],
-                        std::string video_streams[],
-                        std::string fps[],
-                        int compression_times[],
-                        int decompression_times[],
-                        double compression_rates[]) {
-  // Redirect standard output to csv file
-  freopen((directory_path + "/output/metrics.csv").c_str(), "w", stdout);
+void output_metrics_csv(const std::string &directory_path,
+                        const std::vector<std::string> &filepaths,
+                        const std::vector<roundtrip_result> &results) {
+  std::ofstream csv(directory_path + "/output/metrics.csv");
   // Print out columns
-  std::cout << "File,Duration,Initial size (MB),Compressed size (MB),Compression rate (%),Space saving (%),Total time (ms),Compression time (ms),Compression speed (MB/s),Decompression time (ms),Decompression speed (MB/s),Video stream,Frames per second" << std::endl;
+  csv << "File,Duration,Initial size (MB),Compressed size (MB),Compression rate (%),Space saving (%),Total time (ms),Compression time (ms),Compression speed (MB/s),Decompression time (ms),Decompression speed (MB/s),CPU time (ms),Peak RSS (MB),";
+  for (const char *name : memory::subsystem_names) {
+    csv << "Peak " << name << " (MB),";
+  }
+  csv << "Video stream,Frames per second" << std::endl;
   int fail_count = 0;
-  for (int i = 0; i < total_files; i++) {
+  for (size_t i = 0; i < results.size(); i++) {
+    const roundtrip_result &result = results[i];
     // Count the number of failures from the results
-    if (compression_rates[i] < 0) {
+    if (!result.succeeded) {
       ++fail_count;
       continue;
     }
-    
-    // Calculate the original size of the video in MB
-    double original_size = std::filesystem::file_size(filepaths[i]) / 1000000.0;
+
+    double original_size = result.original_bytes / 1000000.0;
+    double compressed_size = result.compressed_bytes / 1000000.0;
+    double compression_rate = 100. * result.compressed_bytes / result.original_bytes;
     // Print out results and metrics for video
-    std::cout << "\"" + filepaths[i] + "\"" << "," 
-              << durations[i] << "," 
-              << original_size << ","
-              << original_size * (compression_rates[i] / 100) << ","
-              << compression_rates[i] << ","
-              << 100 - compression_rates[i] << ","
-              << compression_times[i] + decompression_times[i] << ","
-              << compression_times[i] << ","
-              << original_size / (compression_times[i] / 1000.0) << ","
-              << decompression_times[i] << ","
-              << original_size / (decompression_times[i] / 1000.0) << ","
-              << video_streams[i] << ","
-              << fps[i] << std::endl;
+    csv << "\"" + filepaths[i] + "\"" << ","
+        << format_duration(result.duration_seconds) << ","
+        << original_size << ","
+        << compressed_size << ","
+        << compression_rate << ","
+        << 100 - compression_rate << ","
+        << result.compression_ms + result.decompression_ms << ","
+        << result.compression_ms << ","
+        << original_size / (result.compression_ms / 1000.0) << ","
+        << result.decompression_ms << ","
+        << original_size / (result.decompression_ms / 1000.0) << ","
+        << result.cpu_seconds * 1000 << ","
+        << result.peak_rss_kb / 1000.0 << ",";
+    for (size_t bytes : result.peak_bytes) {
+      csv << bytes / 1000000.0 << ",";
+    }
+    csv << result.video_stream << ","
+        << result.fps << std::endl;
   }
-  // Redirect output back to command line console
-  freopen("/dev/tty", "w", stdout);
 
   // Output failure count to console
   if (fail_count > 0) {
-    std::cout << "Compress-decompress roundtrip failed on " << fail_count << " / " << total_files << " files" << std::endl;
+    std::cout << "Compress-decompress roundtrip failed on " << fail_count << " / " << results.size() << " files" << std::endl;
   }
 }
 
-// Parses through the text file of runtime results/output in output subdirectory to collect for additional metrics
-void parse_collect_metrics(const std::string &directory_path, const int total_files, int compression_times[], int decompression_times[]) {
-  std::string filepaths[total_files]; // Stores the filepath of every video
-  std::string durations[total_files]; // Stores the duration of every video
-  std::string video_streams[total_files]; // Stores information about the stream on each video
-  std::string fps[total_files]; // Stores the frames per second (FPS) on each video
-  double compression_rates[total_files]; // Stores the resulting compressing rates on each video
-
-  int index = -1; // Keeps track of which video we are collecting metrics on
-  std::string line;
-  std::ifstream log_output(directory_path + "/output/log.txt");
-  if (log_output.is_open()) {
-    while (getline(log_output, line)) {
-      int substr_len;
-      if (line.find("Input #") != std::string::npos && line.find("from '") != std::string::npos) { 
-        // Update video count accordingly
-        ++index; 
-        // Mark initially unsuccessful
-        compression_rates[index] = -1; 
-        // Extract filename
-        substr_len = line.find_last_of("'") - line.find_first_of("'") - 1;
-        filepaths[index] = line.substr(line.find_first_of("'") + 1, substr_len);
-      } else if (line.find("Duration: ") != std::string::npos) { 
-        // Extract duration
-        substr_len = line.find_first_of(",") - line.find_first_of(":") - 2;
-        durations[index] = line.substr(line.find_first_of(":") + 2, substr_len);
-      } else if (line.find("Stream ") != std::string::npos && line.find(":0(") != std::string::npos && line.find("Video: ") != std::string::npos) { 
-        // Extract video stream and FPS
-        substr_len = line.find_first_of(",") - line.find("Video: ") - 7;
-        video_streams[index] = line.substr(line.find("Video: ") + 7, substr_len);
-        substr_len = line.find("fps") - line.find("/s, ") - 5;
-        fps[index] = line.substr(line.find("/s, ") + 4, substr_len);
-      } else if (line.find("compression ratio: ") != std::string::npos) { 
-        // Extract compression ratio
-        substr_len = line.find("%") - line.find(":") - 2;
-        // Mark sucessful if compression ratio was found in output and then record
-        compression_rates[index] = std::stod(line.substr(line.find(":") + 2, substr_len)); 
-      }
+// Appends a job's file to the combined one, and removes it
+void append_and_remove(const std::string &job_path, std::ofstream &combined) {
+  {
+    std::ifstream job_file(job_path);
+    if (job_file.peek() != std::ifstream::traits_type::eof()) {
+      combined << job_file.rdbuf();
     }
-    log_output.close();
   }
+  std::filesystem::remove(job_path);
+}
+
+// Runs in a forked child: roundtrip one file with its output to files of its
+// own, and send the result back through result_fd
+[[noreturn]] void run_job(const std::string &directory_path, const std::string &filepath, int index,
+             roundtrip_function roundtrip, int result_fd) {
+  std::string job_prefix = directory_path + "/output/.job" + std::to_string(index);
+  int log_fd = open((job_prefix + ".log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (log_fd >= 0) {
+    dup2(log_fd, STDERR_FILENO);
+    close(log_fd);
+  }
+
+  roundtrip_result result;
+  try {
+    // Sending the compressed file from roundtrip to the output folder
+    std::ofstream output_file(directory_path + "/output/" + filepath.substr(filepath.find_last_of('/') + 1));
+    profile::reset();
+    memory::reset_peaks();
+    roundtrip(filepath, output_file.is_open() ? &output_file : nullptr, &result, index);
+    std::ofstream profile_csv(job_prefix + ".profile.csv");
+    profile::write_csv(profile_csv, filepath);
+  } catch (const std::exception& e) {
+    std::cerr << "Exception (" << typeid(e).name() << "): " << e.what() << std::endl;
+    result.succeeded = false;
+  }
+  std::cerr << std::endl;
 
-  output_metrics_csv(directory_path, total_files, filepaths, durations, video_streams, fps, compression_times, decompression_times, compression_rates);
+  ssize_t written = write(result_fd, &result, sizeof(result));
+  _exit(written == sizeof(result) ? 0 : 1);
 }
 
-// Iteratively runs avrecode roundtrip on each file in the test directory saving the results and output to a subdirectory
-void perf_test_driver(const std::string &directory_path, int (*roundtrip)(const std::string&, std::ostream*, int*, int*, const int)) {
-  const int total_files = count_files(directory_path);
+// Runs avrecode roundtrip on each file in the test directory saving the results and output to a subdirectory.
+// Each file is run in a child process of its own, up to jobs at a time: ffmpeg
+// keeps global state, and the process boundary gives each file its own CPU
+// time and peak RSS.
+void perf_test_driver(const std::string &directory_path, roundtrip_function roundtrip, int jobs) {
+  const std::vector<std::string> filepaths = list_files(directory_path);
+  const int total_files = filepaths.size();
+  jobs = std::max(1, jobs);
 
   // Create output subdirectory within test directory for decompressed output files and logs/metrics
   std::filesystem::create_directory(directory_path + "/output");
 
-  // Arrays to store the times for compressing and decompressing on each file
-  int compression_times[total_files];
-  int decompression_times[total_files];
-
-  int file_count = 0;
-  for (const auto& entry : std::filesystem::directory_iterator(directory_path)) {
-    if (is_regular_file(entry.path())) {
-      ++file_count;
-      std::cout << file_count << "/" << total_files << "..." << std::endl; // Prints out progress on videos
-
-      freopen((directory_path + "/output/log.txt").c_str(), file_count < 2 ? "w" : "a", stderr); // Open up text file to send command line output from running avrecode
-      try {
-        std::string filepath = entry.path().string();
-        std::ofstream output_file(directory_path + "/output/" + filepath.substr(filepath.find_last_of('/') + 1)); // Sending the decompressed file from roundtrip to the output folder
-        
-        roundtrip(filepath, 
-                  output_file.is_open() ? &output_file : nullptr,  
-                  &compression_times[file_count - 1], 
-                  &decompression_times[file_count - 1],
-                  file_count - 1);
-      } catch (const std::exception& e) {
-        std::cerr << "Exception (" << typeid(e).name() << "): " << e.what() << std::endl;
+  struct running_job {
+    int index;
+    int result_fd;
+  };
+  std::map<pid_t, running_job> running;
+  std::vector<roundtrip_result> results(total_files);
+  int next_file = 0;
+  int finished = 0;
+  while (finished < total_files) {
+    while (next_file < total_files && (int)running.size() < jobs) {
+      int result_pipe[2];
+      if (pipe(result_pipe) != 0) {
+        throw std::runtime_error("Failed to create result pipe.");
       }
-      std::cerr << std::endl;
-      freopen("/dev/tty", "w", stderr); // Redirect standard output back to command line console
+      // Don't let the child inherit buffered output.
+      std::cout.flush();
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid < 0) {
+        throw std::runtime_error("Failed to fork roundtrip job.");
+      }
+      if (pid == 0) {
+        close(result_pipe[0]);
+        run_job(directory_path, filepaths[next_file], next_file, roundtrip, result_pipe[1]);
+      }
+      close(result_pipe[1]);
+      running[pid] = {next_file, result_pipe[0]};
+      next_file++;
     }
-  }
-
-  parse_collect_metrics(directory_path, total_files, compression_times, decompression_times);
-}
-
-
 
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, 0, &usage);
+    if (pid < 0) {
+      throw std::runtime_error("Failed to wait for roundtrip jobs.");
+    }
+    auto job = running.find(pid);
+    if (job == running.end()) {
+      continue;
+    }
+    roundtrip_result &result = results[job->second.index];
+    // The result fits in the pipe buffer, so it is there once the child exits.
+    if (read(job->second.result_fd, &result, sizeof(result)) != sizeof(result)
+        || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      result = roundtrip_result();
+    }
+    close(job->second.result_fd);
+    result.cpu_seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    result.peak_rss_kb = usage.ru_maxrss;
+    running.erase(job);
+    ++finished;
+    std::cout << finished << "/" << total_files << "..." << std::endl; // Prints out progress on videos
+  }
 
+  // Combine the logs and profiles of the jobs, in file order.
+  std::ofstream log(directory_path + "/output/log.txt");
+  std::ofstream profile_csv(directory_path + "/output/profile.csv");
+  profile::write_csv_header(profile_csv);
+  for (int i = 0; i < total_files; i++) {
+    std::string job_prefix = directory_path + "/output/.job" + std::to_string(i);
+    append_and_remove(job_prefix + ".log", log);
+    append_and_remove(job_prefix + ".profile.csv", profile_csv);
+  }
 
+  output_metrics_csv(directory_path, filepaths, results);
+}
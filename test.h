@@ -1,8 +1,34 @@
 #ifndef PERFTEST_H
 #define PERFTEST_H
 
+#include <cstddef>
+#include <ostream>
 #include <string>
 
-void perf_test_driver(const std::string &directory_path, int (*roundtrip)(const std::string&, std::ostream*, int*, int*, const int));
+#include "memory_budget.h"
 
-#endif
\ No newline at end of file
+// Results of one roundtrip, filled in by roundtrip() and by the test driver.
+// Plain data, so that jobs can pass it back through a pipe.
+struct roundtrip_result {
+  bool succeeded = false;
+  char video_stream[128] = "";  // e.g. "h264 (High) (avc1 / 0x31637661)"
+  double duration_seconds = 0;
+  double fps = 0;
+  size_t original_bytes = 0;
+  size_t compressed_bytes = 0;
+  int compression_ms = 0;
+  int decompression_ms = 0;
+  // Measured by the driver over the whole job.
+  double cpu_seconds = 0;
+  long peak_rss_kb = 0;
+  // Peak bytes accounted to each memory::subsystem during the roundtrip.
+  size_t peak_bytes[memory::NUM_SUBSYSTEMS] = {};
+};
+
+typedef int (*roundtrip_function)(const std::string&, std::ostream*, roundtrip_result*, const int);
+
+// Runs roundtrip on each file in directory_path, on up to jobs processes at a
+// time, and writes the results to an output subdirectory.
+void perf_test_driver(const std::string &directory_path, roundtrip_function roundtrip, int jobs = 1);
+
+#endif
@@ -1,15 +1,202 @@
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <string>
 #include <vector>
 
 #include "arithmetic_code.h"
 #include "cabac_code.h"
+#include "estimators.h"
 
 extern "C" {
 #include "libavcodec/cabac.h"
 }
 
 
+// Times one pass of `run` over `bins` symbols and prints the throughput.
+template <typename Function>
+void report_bins_per_second(const std::string& name, size_t bins, Function run) {
+  auto start = std::chrono::steady_clock::now();
+  size_t bytes = run();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << name << ": " << bins / seconds << " bins/sec (" << bytes << " bytes)" << std::endl;
+}
+
+// Compares the std::function probability callback (what every call site paid
+// before the template overloads) against the inlined template and the
+// fixed-probability fast path. The adaptive estimator mirrors h264_model.
+template <typename Code>
+void benchmark(const std::vector<int>& bits, const std::vector<int>& contexts) {
+  struct counts { int pos = 1, neg = 1; };
+  auto encode = [&](bool type_erased) {
+    std::vector<counts> estimators(0x400);
+    std::vector<uint8_t> out;
+    out.reserve(bits.size() / 4);
+    auto encoder = make_encoder<Code>(&out);
+    for (size_t i = 0; i < bits.size(); i++) {
+      counts* e = &estimators[contexts[i]];
+      auto probability_of_1 = [e](uint64_t range) { return (range / (e->pos + e->neg)) * e->pos; };
+      if (type_erased) {
+        encoder.put(bits[i], std::function<uint64_t(uint64_t)>(probability_of_1));
+      } else {
+        encoder.put(bits[i], probability_of_1);
+      }
+      (bits[i] ? e->pos : e->neg)++;
+      if (e->pos + e->neg > 0x60) {
+        e->pos = (e->pos + 1) / 2;
+        e->neg = (e->neg + 1) / 2;
+      }
+    }
+    encoder.finish();
+    return out.size();
+  };
+  report_bins_per_second("put (std::function)", bits.size(), [&]{ return encode(true); });
+  report_bins_per_second("put (template)", bits.size(), [&]{ return encode(false); });
+
+  std::vector<uint8_t> out;
+  report_bins_per_second("put (std::function, 1/2)", bits.size(), [&]{
+    out.clear();
+    auto encoder = make_encoder<Code>(&out);
+    std::function<uint64_t(uint64_t)> half = [](uint64_t range) { return range/2; };
+    for (int bit : bits) encoder.put(bit, half);
+    encoder.finish();
+    return out.size();
+  });
+  report_bins_per_second("put_bypass", bits.size(), [&]{
+    out.clear();
+    auto encoder = make_encoder<Code>(&out);
+    for (int bit : bits) encoder.put_bypass(bit);
+    encoder.finish();
+    return out.size();
+  });
+  report_bins_per_second("get_bypass", bits.size(), [&]{
+    auto decoder = make_decoder<Code>(out);
+    volatile int ones = 0;
+    for (size_t i = 0; i < bits.size(); i++) ones += decoder.get_bypass();
+    return out.size();
+  });
+}
+
+
+// Codes the same random slices (context bins, bypass runs, terminate bins)
+// with cabac::encoder and cabac::fast_encoder. Returns false if the outputs
+// differ. With `bench`, also times both on the same bins.
+bool compare_cabac_encoders(size_t num_bins, bool bench) {
+  typedef std::back_insert_iterator<std::vector<uint8_t>> output;
+  struct bin { int kind; int symbol; int context; };  // kind: 0 context, 1 bypass run, 2 terminate
+  std::vector<std::vector<bin>> slices;
+  std::vector<uint8_t> initial_states(64);
+  for (auto& state : initial_states) state = std::rand() % 126;
+  for (size_t i = 0; i < num_bins; ) {
+    slices.emplace_back();
+    size_t slice_bins = 1 + std::rand() % 2000;
+    for (size_t j = 0; j < slice_bins; j++, i++) {
+      int r = std::rand() % 100;
+      if (r < 70) {
+        int context = std::rand() % 64;
+        slices.back().push_back({0, (std::rand() % 100) < (context % 2 ? 85 : 20), context});
+      } else if (r < 99) {
+        int count = 1 + std::rand() % 16;
+        slices.back().push_back({1, std::rand() & ((1 << count) - 1), count});
+      } else {
+        slices.back().push_back({2, 0, 0});
+      }
+    }
+    slices.back().push_back({2, 1, 0});
+  }
+
+  auto reference = [&](std::vector<uint8_t>* out) {
+    for (const auto& slice : slices) {
+      std::vector<uint8_t> states = initial_states;
+      cabac::encoder<output> encoder(std::back_inserter(*out));
+      for (const bin& b : slice) {
+        if (b.kind == 0) {
+          encoder.put(b.symbol, &states[b.context]);
+        } else if (b.kind == 1) {
+          for (int k = b.context; k-- > 0; ) encoder.put_bypass((b.symbol >> k) & 1);
+        } else {
+          encoder.put_terminate(b.symbol);
+        }
+      }
+    }
+    return out->size();
+  };
+  auto fast = [&](std::vector<uint8_t>* out) {
+    for (const auto& slice : slices) {
+      std::vector<uint8_t> states = initial_states;
+      cabac::fast_encoder<output> encoder(std::back_inserter(*out));
+      for (const bin& b : slice) {
+        if (b.kind == 0) {
+          encoder.put(b.symbol, &states[b.context]);
+        } else if (b.kind == 1) {
+          if (b.context == 1) {
+            encoder.put_bypass(b.symbol);
+          } else {
+            encoder.put_bypass_bins(b.symbol, b.context);
+          }
+        } else {
+          encoder.put_terminate(b.symbol);
+        }
+      }
+    }
+    return out->size();
+  };
+
+  std::vector<uint8_t> reference_out, fast_out;
+  reference(&reference_out);
+  fast(&fast_out);
+  if (reference_out != fast_out) {
+    size_t i = 0;
+    while (i < reference_out.size() && i < fast_out.size() && reference_out[i] == fast_out[i]) i++;
+    std::cerr << "cabac::fast_encoder differs at byte " << i << " of " << reference_out.size()
+              << " (" << fast_out.size() << " bytes)" << std::endl;
+    return false;
+  }
+  if (bench) {
+    report_bins_per_second("cabac::encoder", num_bins, [&]{ reference_out.clear(); return reference(&reference_out); });
+    report_bins_per_second("cabac::fast_encoder", num_bins, [&]{ fast_out.clear(); return fast(&fast_out); });
+  }
+  return true;
+}
+
+// The division-free estimators: reciprocal_count_estimator has to give exactly
+// the probabilities of count_estimator, and shift_estimator has to stay
+// strictly inside the range. Returns false on the first difference.
+bool check_estimators(const std::vector<int>& bits, const std::vector<int>& contexts) {
+  for (int d = 2; d <= reciprocal_table::MAX_DIVISOR; d++) {
+    for (int i = 0; i < 1000; i++) {
+      uint64_t x = (uint64_t(std::rand()) << 42) ^ (uint64_t(std::rand()) << 21) ^ std::rand();
+      x = i < 2 ? ~uint64_t(0) - i : x >> (std::rand() % 64);
+      if (total_reciprocals.divide(x, d) != x / d) {
+        std::cerr << "reciprocal division wrong for " << x << " / " << d << std::endl;
+        return false;
+      }
+    }
+  }
+  std::vector<count_estimator::state> counts(0x400);
+  std::vector<shift_estimator::state> shifts(0x400);
+  typedef arithmetic_code<uint64_t, uint8_t> code;
+  for (size_t i = 0; i < bits.size(); i++) {
+    uint64_t range = code::min_range + uint64_t(std::rand()) * std::rand() % (code::max_range - code::min_range);
+    count_estimator::state& e = counts[contexts[i]];
+    if (count_estimator::probability(range, e) != reciprocal_count_estimator::probability(range, e)) {
+      std::cerr << "reciprocal_count_estimator differs at bin " << i << std::endl;
+      return false;
+    }
+    uint64_t p1 = shift_estimator::probability(range, shifts[contexts[i]]);
+    if (p1 == 0 || p1 >= range) {
+      std::cerr << "shift_estimator out of range at bin " << i << std::endl;
+      return false;
+    }
+    count_estimator::update(e, bits[i], i % 3 == 0);
+    shift_estimator::update(shifts[contexts[i]], bits[i], i % 3 == 0);
+  }
+  return true;
+}
+
+
 int main(int argc, char* argv[]) {
 #if 0
   // Testing a particular input that triggered a CABAC encoder bug.
@@ -108,6 +295,82 @@ int main(int argc, char* argv[]) {
       return 1;
     }
   }
+
+  // The bypass fast path must produce the same stream as put(range/2).
+  std::vector<uint8_t> bypass_out;
+  auto bypass_encoder = make_encoder<code>(&bypass_out);
+  for (size_t i = 0; i < bits.size(); i++) {
+    bypass_encoder.put_bypass(bits[i]);
+  }
+  bypass_encoder.finish();
+  if (bypass_out != out) {
+    std::cerr << "put_bypass output differs from put(range/2)" << std::endl;
+    return 1;
+  }
+  auto bypass_decoder = make_decoder<code>(out);
+  for (size_t i = 0; i < bits.size(); i++) {
+    int bit = bypass_decoder.get_bypass();
+    if (bit != bits[i]) {
+      std::cerr << "get_bypass mismatch at bit: " << i << ", " << bit << " != " << bits[i] << std::endl;
+      return 1;
+    }
+  }
+
+  // Byte digits with skewed probabilities, which leave digits pending in the
+  // encoder's overflow buffer.
+  typedef arithmetic_code<uint64_t, uint8_t> byte_code;
+  auto range_of_1 = [&](size_t i, uint64_t range) {
+    uint64_t range_of_1 = range / 100 * (100 - probabilities[contexts[i]]);
+    return std::min(std::max<uint64_t>(range_of_1, 1), range - 1);
+  };
+  std::vector<uint8_t> skewed_out;
+  auto skewed_encoder = make_encoder<byte_code>(&skewed_out);
+  for (size_t i = 0; i < bits.size(); i++) {
+    skewed_encoder.put(bits[i], [&](uint64_t range){ return range_of_1(i, range); });
+  }
+  skewed_encoder.finish();
+  auto skewed_decoder = make_decoder<byte_code>(skewed_out);
+  for (size_t i = 0; i < bits.size(); i++) {
+    int bit = skewed_decoder.get([&](uint64_t range){ return range_of_1(i, range); });
+    if (bit != bits[i]) {
+      std::cerr << "skewed mismatch at bit: " << i << ", " << bit << " != " << bits[i] << std::endl;
+      return 1;
+    }
+  }
+
+  // 32-bit digits written as bytes, as recode's --wide-digits does, decoded
+  // with word loads from a contiguous buffer.
+  typedef arithmetic_code<uint64_t, uint32_t> wide_code;
+  std::vector<uint8_t> wide_out;
+  {
+    auto it = std::back_inserter(wide_out);
+    wide_code::encoder<decltype(it), uint8_t> wide_encoder(it);
+    for (size_t i = 0; i < bits.size(); i++) {
+      wide_encoder.put(bits[i], [&](uint64_t range){ return range_of_1(i, range); });
+    }
+    wide_encoder.finish();
+  }
+  wide_code::decoder<const uint8_t*, uint8_t> wide_decoder(wide_out.data(), wide_out.data() + wide_out.size());
+  for (size_t i = 0; i < bits.size(); i++) {
+    int bit = wide_decoder.get([&](uint64_t range){ return range_of_1(i, range); });
+    if (bit != bits[i]) {
+      std::cerr << "wide mismatch at bit: " << i << ", " << bit << " != " << bits[i] << std::endl;
+      return 1;
+    }
+  }
+
+  if (!check_estimators(bits, contexts)) {
+    return 1;
+  }
+
+  bool bench = argc > 2 && std::string(argv[2]) == "bench";
+  if (!compare_cabac_encoders(bits.size(), bench)) {
+    return 1;
+  }
+
+  if (bench) {
+    benchmark<code>(bits, contexts);
+  }
   return 0;
 #endif
 #endif
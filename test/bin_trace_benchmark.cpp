@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "arithmetic_code.h"
+#include "bin_trace.h"
+#include "cabac_code.h"
+#include "estimator_table.h"
+
+extern "C" {
+#include "libavcodec/cabac.h"
+#include "libavcodec/coding_hooks.h"
+}
+
+
+// Replays a bin trace recorded with `recode compress --trace=<file>` through
+// the estimators, the recoded arithmetic coder (in a few word sizes) and the
+// CABAC encoder, without ffmpeg:
+//
+//   ./test/bin_trace_benchmark <trace> [repeat]
+
+// The estimators of h264_model, in one of the policies of estimators.h, with
+// dynamic slots looked up through the table's index like the model does.
+template <typename Estimator>
+class trace_estimators {
+ public:
+  typedef typename Estimator::state state;
+
+  trace_estimators() {
+    for (int i = 0; i < 2; i++) {
+      key_context[i] = &key_base[i];
+    }
+  }
+  state& at(const bin_record& bin) {
+    if (bin.slot < estimator_table::DYNAMIC_BASE) {
+      return table[bin.slot];
+    }
+    return table[table.dynamic_slot(key_context[bin.slot & 1], bin.slot, 0)];
+  }
+  template <typename Range>
+  static Range probability(Range range, const state& e) {
+    return Estimator::probability(range, e);
+  }
+  static void update(state& e, const bin_record& bin) {
+    Estimator::update(e, bin.symbol, bin.coding_type == PIP_SIGNIFICANCE_MAP);
+  }
+ private:
+  basic_estimator_table<state> table;
+  char key_base[2];
+  const void *key_context[2];
+};
+
+struct run_result {
+  double seconds;
+  size_t bytes;
+};
+
+// Best of `repeat` runs, to take out some of the noise.
+template <typename Function>
+run_result best_of(int repeat, Function run) {
+  run_result best = {0, 0};
+  for (int i = 0; i < repeat; i++) {
+    auto start = std::chrono::steady_clock::now();
+    size_t bytes = run();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (i == 0 || seconds < best.seconds) {
+      best = {seconds, bytes};
+    }
+  }
+  return best;
+}
+
+void report(const std::string& name, const std::vector<bin_record>& bins, run_result result, size_t cabac_bytes) {
+  std::cout << name << ": " << result.seconds * 1e9 / bins.size() << " ns/bin, "
+            << result.bytes << " bytes";
+  if (cabac_bytes) {
+    std::cout << " (" << 100. * result.bytes / cabac_bytes << "% of CABAC)";
+  }
+  std::cout << std::endl;
+}
+
+// Estimators alone. Bytes are the ideal code length under the model.
+template <typename Estimator>
+run_result replay_estimators(const std::vector<bin_record>& bins, int repeat) {
+  typedef trace_estimators<Estimator> estimators_type;
+  return best_of(repeat, [&]{
+    estimators_type estimators;
+    double bits = 0;
+    for (const bin_record& bin : bins) {
+      auto& e = estimators.at(bin);
+      double p1 = estimators_type::probability(uint64_t(1) << 62, e) / double(uint64_t(1) << 62);
+      bits -= std::log2(bin.symbol ? p1 : 1 - p1);
+      estimators_type::update(e, bin);
+    }
+    return size_t(bits / 8);
+  });
+}
+
+// A CABAC encoder, with one state per CABAC slot. Every slice (ended by a
+// terminate bin) starts a new encoder.
+template <template <typename> class Encoder>
+run_result replay_cabac(const std::vector<bin_record>& bins, int repeat) {
+  typedef std::back_insert_iterator<std::vector<uint8_t>> output;
+  return best_of(repeat, [&]{
+    std::vector<uint8_t> out;
+    out.reserve(bins.size() / 4);
+    std::vector<uint8_t> states(estimator_table::CABAC_STATE_SLOTS);
+    std::unique_ptr<Encoder<output>> encoder(new Encoder<output>(std::back_inserter(out)));
+    for (const bin_record& bin : bins) {
+      if (bin.slot == estimator_table::BYPASS_SLOT) {
+        encoder->put_bypass(bin.symbol);
+      } else if (bin.slot == estimator_table::TERMINATE_SLOT) {
+        encoder->put_terminate(bin.symbol);
+        if (bin.symbol) {
+          encoder.reset(new Encoder<output>(std::back_inserter(out)));
+        }
+      } else if (bin.slot < estimator_table::CABAC_STATE_SLOTS) {
+        encoder->put(bin.symbol, &states[bin.slot]);
+      } else {
+        // Model-only slots (e.g. significance) stand in for CABAC contexts.
+        encoder->put(bin.symbol, &states[bin.slot % estimator_table::CABAC_STATE_SLOTS]);
+      }
+    }
+    encoder->put_terminate(1);
+    return out.size();
+  });
+}
+
+// The recoded arithmetic coder with the model's estimators: encoding, then
+// decoding with a check that every symbol comes back.
+template <typename FixedPoint, typename CompressedDigit, typename Estimator = reciprocal_count_estimator>
+bool replay_recoded(const std::string& name, const std::vector<bin_record>& bins, int repeat, size_t cabac_bytes) {
+  typedef arithmetic_code<FixedPoint, CompressedDigit> Code;
+  typedef trace_estimators<Estimator> estimators_type;
+  std::vector<uint8_t> out;
+  run_result encoded = best_of(repeat, [&]{
+    out.clear();
+    out.reserve(bins.size() / 8);
+    estimators_type estimators;
+    auto encoder = make_encoder<Code>(&out);
+    for (const bin_record& bin : bins) {
+      auto& e = estimators.at(bin);
+      encoder.put(bin.symbol, [&](FixedPoint range) { return estimators_type::probability(range, e); });
+      estimators_type::update(e, bin);
+    }
+    encoder.finish();
+    return out.size();
+  });
+  report(name + " encode", bins, encoded, cabac_bytes);
+
+  size_t mismatch = bins.size();
+  run_result decoded = best_of(repeat, [&]{
+    estimators_type estimators;
+    // From a contiguous buffer, like the decompressor.
+    typename Code::template decoder<const uint8_t*, uint8_t> decoder(out.data(), out.data() + out.size());
+    for (size_t i = 0; i < bins.size(); i++) {
+      auto& e = estimators.at(bins[i]);
+      int symbol = decoder.get([&](FixedPoint range) { return estimators_type::probability(range, e); });
+      if (symbol != bins[i].symbol && mismatch == bins.size()) {
+        mismatch = i;
+      }
+      // Update with the traced bin, so a mismatch doesn't change the timing.
+      estimators_type::update(e, bins[i]);
+    }
+    return out.size();
+  });
+  report(name + " decode", bins, decoded, cabac_bytes);
+  if (mismatch != bins.size()) {
+    std::cerr << name << ": mismatch at bin " << mismatch << std::endl;
+    return false;
+  }
+  return true;
+}
+
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 3) {
+    std::cerr << "Usage: " << argv[0] << " <trace> [repeat]" << std::endl;
+    return 1;
+  }
+  std::vector<bin_record> bins;
+  try {
+    bins = read_bin_trace(argv[1]);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  int repeat = argc > 2 ? std::max(1, std::stoi(argv[2])) : 3;
+  if (bins.empty()) {
+    std::cerr << "Empty bin trace." << std::endl;
+    return 1;
+  }
+  std::cout << bins.size() << " bins" << std::endl;
+
+  run_result cabac = replay_cabac<cabac::encoder>(bins, repeat);
+  report("cabac::encoder", bins, cabac, 0);
+  // The decompressor's encoder, which writes the same bytes.
+  report("cabac::fast_encoder", bins, replay_cabac<cabac::fast_encoder>(bins, repeat), cabac.bytes);
+  report("count_estimator (ideal)", bins, replay_estimators<count_estimator>(bins, repeat), cabac.bytes);
+  report("reciprocal_count_estimator (ideal)", bins,
+         replay_estimators<reciprocal_count_estimator>(bins, repeat), cabac.bytes);
+  report("shift_estimator (ideal)", bins, replay_estimators<shift_estimator>(bins, repeat), cabac.bytes);
+
+  bool ok = true;
+  // recode.cpp's recoded_code and wide_recoded_code (--wide-digits) first,
+  // then other word sizes for comparison.
+  ok &= replay_recoded<uint64_t, uint8_t>("recoded (uint64_t, uint8_t)", bins, repeat, cabac.bytes);
+  ok &= replay_recoded<uint64_t, uint8_t, count_estimator>(
+      "recoded (uint64_t, uint8_t, count_estimator)", bins, repeat, cabac.bytes);
+  ok &= replay_recoded<uint64_t, uint8_t, shift_estimator>(
+      "recoded (uint64_t, uint8_t, shift_estimator)", bins, repeat, cabac.bytes);
+  ok &= replay_recoded<uint64_t, uint32_t>("recoded (uint64_t, uint32_t)", bins, repeat, cabac.bytes);
+  ok &= replay_recoded<uint64_t, uint16_t>("recoded (uint64_t, uint16_t)", bins, repeat, cabac.bytes);
+  ok &= replay_recoded<uint32_t, uint8_t>("recoded (uint32_t, uint8_t)", bins, repeat, cabac.bytes);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Compresses a video as a single message, as a segmented message and as a
+# stream, and checks that `decompress <input> <output>` restores it to the
+# output file (and writes nothing to stdout) for each.
+#
+#   ./test/decompress_to_file.sh <video> [recode]
+set -e
+
+video=$1
+recode=${2:-./recode}
+if [ -z "$video" ]; then
+  echo "usage: $0 <video> [recode]" >&2
+  exit 2
+fi
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+status=0
+check() {
+  name=$1
+  shift
+  "$recode" compress "$@" "$video" "$dir/$name.rec" 2> "$dir/$name.log"
+  "$recode" decompress "$dir/$name.rec" "$dir/$name.out" > "$dir/$name.stdout" 2>> "$dir/$name.log"
+  if ! cmp -s "$video" "$dir/$name.out"; then
+    echo "$name: decompressed file differs from the input" >&2
+    status=1
+  elif [ -s "$dir/$name.stdout" ]; then
+    echo "$name: decompress wrote to stdout as well as the output file" >&2
+    status=1
+  else
+    echo "$name: ok"
+  fi
+}
+
+check message
+check segmented --segment-size=1 --threads=2
+check stream --stream
+exit $status
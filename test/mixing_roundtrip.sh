@@ -0,0 +1,17 @@
+#!/bin/sh
+# Checks that a build with -DAVRECODE_MIXING=1 decodes what it codes: random
+# significance maps of every layout, 8x8 and 4:2:2 chroma DC blocks included,
+# through `benchmark-model`, then the video, if one is given, through
+# decompress_to_file.sh.
+#
+#   ./test/mixing_roundtrip.sh [recode] [video]
+set -e
+
+recode=${1:-./recode}
+video=$2
+
+# Enough maps for a few frames, every other one 4:2:2.
+"$recode" benchmark-model 100000
+if [ -n "$video" ]; then
+  "$(dirname "$0")/decompress_to_file.sh" "$video" "$recode"
+fi
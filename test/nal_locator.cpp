@@ -0,0 +1,98 @@
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "nal_locator.h"
+
+
+// A file of framed slice NAL units: each is a prefix of prefix_bytes holding
+// its length (0 for an Annex B start code), an IDR slice NAL header, a slice
+// header of header_bytes and the slice data, which is what find looks for.
+// No byte is zero, so only the prefixes can look like candidates.
+struct framed_file {
+  std::vector<uint8_t> data;
+  std::vector<size_t> slice_offsets;
+  std::vector<std::vector<uint8_t>> slices;
+
+  void add_slice(int prefix_bytes, size_t header_bytes, size_t slice_bytes) {
+    std::vector<uint8_t> slice(slice_bytes);
+    for (uint8_t& byte : slice) {
+      byte = 1 + std::rand() % 255;
+    }
+    size_t nal_bytes = 1 + header_bytes + slice_bytes;
+    if (prefix_bytes == 0) {
+      data.insert(data.end(), {0, 0, 1});
+    }
+    for (int i = prefix_bytes - 1; i >= 0; i--) {
+      data.push_back(uint8_t(nal_bytes >> (8 * i)));
+    }
+    data.push_back(0x65);
+    for (size_t i = 0; i < header_bytes; i++) {
+      data.push_back(1 + std::rand() % 255);
+    }
+    slice_offsets.push_back(data.size());
+    data.insert(data.end(), slice.begin(), slice.end());
+    slices.push_back(std::move(slice));
+  }
+};
+
+// Checks that find_or_search finds every slice of file, in order, and that
+// only the full search found them exactly when expect_searched.
+bool check_framing(const std::string& name, const framed_file& file, bool expect_searched) {
+  nal_locator locator;
+  locator.scan(file.data.data(), file.data.size());
+  size_t begin = 0;
+  for (size_t i = 0; i < file.slices.size(); i++) {
+    const std::vector<uint8_t>& slice = file.slices[i];
+    bool searched = false;
+    int64_t offset = locator.find_or_search(file.data.data(), begin, file.data.size(), slice.data(),
+                                            slice.size(), &searched);
+    if (offset != int64_t(file.slice_offsets[i])) {
+      std::cerr << name << ": slice " << i << " found at " << offset << ", not " << file.slice_offsets[i]
+                << std::endl;
+      return false;
+    }
+    if (searched != expect_searched) {
+      std::cerr << name << ": slice " << i << (searched ? " needed" : " didn't need") << " the full search"
+                << std::endl;
+      return false;
+    }
+    begin = offset + slice.size();
+  }
+  return true;
+}
+
+
+int main() {
+  std::srand(1);
+  bool ok = true;
+
+  framed_file annex_b, mp4, short_prefixes, long_headers;
+  for (int i = 0; i < 20; i++) {
+    annex_b.add_slice(0, 4 + i, 300 + 17 * i);
+    mp4.add_slice(4, 4 + i, 300 + 17 * i);
+    // 2-byte lengths, as in an MP4 with lengthSizeMinusOne = 1.
+    short_prefixes.add_slice(2, 4 + i, 300 + 17 * i);
+    long_headers.add_slice(4, nal_locator::MAX_SLICE_HEADER_BYTES + 1 + i, 300 + 17 * i);
+  }
+  ok &= check_framing("Annex B", annex_b, false);
+  ok &= check_framing("4-byte lengths", mp4, false);
+  ok &= check_framing("2-byte lengths", short_prefixes, true);
+  ok &= check_framing("long slice headers", long_headers, true);
+
+  // Slice data that isn't in the file is not found by either.
+  nal_locator locator;
+  locator.scan(mp4.data.data(), mp4.data.size());
+  std::vector<uint8_t> missing(64, 0xff);
+  bool searched = true;
+  if (locator.find_or_search(mp4.data.data(), 0, mp4.data.size(), missing.data(), missing.size(),
+                             &searched) != -1 || searched) {
+    std::cerr << "missing slice data was found" << std::endl;
+    ok = false;
+  }
+
+  std::cout << (ok ? "nal_locator ok" : "nal_locator FAILED") << std::endl;
+  return ok ? 0 : 1;
+}